@@ -8,71 +8,68 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
-#include <minwindef.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include <assert.h>
+#include <errno.h>
+#include <locale.h>
 
 // init externs from the .h file
 
+#if defined(_WIN32)
 CONSOLE_SCREEN_BUFFER_INFO cprintf_previous_screen_buffer_info;
+#endif
+cprintf_attr_t cprintf_previous_attributes = FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE;
 bool cprintf_set_previous = false;
 
+// Our copy of the attributes the backend is showing, so we never have to ask it again after set_previous().
+// Only changed under state_lock, but calls that don't take the lock still read it.
+static _Atomic cprintf_attr_t current_attributes = FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE;
+static atomic_ullong counter_get_calls = 0;
+static atomic_ullong counter_set_calls = 0;
+static atomic_ullong counter_set_elided = 0;
+static atomic_ullong counter_async_dropped = 0;
+
+// Guards current_attributes, set_previous() and the format cache. Set up once by startup().
+static mtx_t state_lock;
+static once_flag init_flag = ONCE_FLAG_INIT;
+static atomic_bool previous_ready = false; // cprintf_set_previous, but safe to read without the lock
+static atomic_bool atomic_writes = false;
+static atomic_int forced_level = CPRINTF_COLOR_AUTO; // from cprintf_set_color_level
+static cprintf_color_level detected_level; // what the terminal can do, worked out once by startup()
+static tss_t line_buffer_key; // each thread's buffer for atomic writes
+static tss_t call_key; // each thread's cprintf_call
+
 /* So this is the macros section...
-* In an attempt to make code that didn't result in having to change things
-* in multiple places, I've found a way to genericize my functions with macros!
-* At what cost? Readability. Sorry in advance. I've tried to remedy this by
-* being generous with the comments, but it's putting lipstick on a pig.
+* The functions that used to be written twice (once for char and once for wchar_t) now live in
+* cprintf_engine.h, which gets included twice further down. What's left here is just sizes and helpers.
 */
 
 #if defined(CPRINTF_BUF_SIZE)
 #error Macro clash!
 #endif
 // the buffer size (in chars or wchars) for the escaped sequence like %s or %0.2f
-#define CPRINTF_BUF_SIZE 20
-
-#if defined(CPRINTF_TEXT)
-#error Macro clash!
-#endif
-#define CPRINTF_TEXT(dtype, s) _Generic((dtype), \
-	wchar_t: L ## s, \
-	char: s, \
-	default: s \
-)
-
-#if defined(CPRINTF_STRCHR)
-#error Macro clash!
-#endif
-#define CPRINTF_STRCHR(dtype, str, c) _Generic((dtype), \
-	wchar_t: wcschr(str, L ## c), \
-	char: strchr(str, c), \
-	default: strchr(str, c) \
-)
+#define CPRINTF_BUF_SIZE 32
 
-#if defined(CPRINTF_ATOI)
+#if defined(CPRINTF_OUT_SIZE)
 #error Macro clash!
 #endif
-#define CPRINTF_ATOI(dtype, str) _Generic((dtype), \
-	wchar_t: wcstol(str, NULL, 0), \
-	char: atoi(str), \
-	default: atoi(str) \
-)
+// the size (in bytes) of the buffer a single call collects its output in before handing it to the backend
+#define CPRINTF_OUT_SIZE 4096
 
-#if defined(CPRINTF_PUTCHAR)
+#if defined(CPRINTF_MIN)
 #error Macro clash!
 #endif
-#define CPRINTF_PUTCHAR(dtype, c) _Generic((dtype), \
-	wchar_t: putwchar(c), \
-	char: putchar(c), \
-	default: putchar(c) \
-)
+#define CPRINTF_MIN(a, b) ((a) < (b) ? (a) : (b))
 
-#if defined(CPRINTF_FUNC_SWITCH)
+#if defined(CPRINTF_MAX)
 #error Macro clash!
 #endif
-#define CPRINTF_FUNC_SWITCH(dtype, func, ...) _Generic((dtype), \
-	wchar_t: w ## func, \
-	char: ## func, \
-	default: ## func \
-)(__VA_ARGS__)
+#define CPRINTF_MAX(a, b) ((a) > (b) ? (a) : (b))
 
 /* The way colors work in Windows is... interesting. You add red, green, or blue to the color you want the background
 * or foreground to be. Additionally, you have the option to make the colors bright.
@@ -81,801 +78,4518 @@ bool cprintf_set_previous = false;
 * makes a lighter gray.
 * 
 * Anyway, I hope this helps understand what's going on here.
+*
+* Every SGR number boils down to clearing some of those bits and setting others, so the table (CPRINTF_SGR_TABLE
+* in cprintf.h) says which bits each number clears and sets. A whole sequence like %[1;31;44m is the same thing, just with the numbers'
+* clears and sets folded together, and that's what a color op carries around. 256-color and 24-bit colors are the
+* same again, they just clear and set bits higher up in the word.
 */
 
-void apply_background(WORD* pAttrs, int attr) {
-	*pAttrs |= BACKGROUND_RED | BACKGROUND_GREEN | BACKGROUND_BLUE;
-	switch (attr) {
-		case 40: // black
-			*pAttrs ^= BACKGROUND_RED | BACKGROUND_GREEN | BACKGROUND_BLUE; // leave nothing
-			break;
-		case 41: // red
-			*pAttrs ^= BACKGROUND_GREEN | BACKGROUND_BLUE; // red remains
-			break;
-		case 42: // green
-			*pAttrs ^= BACKGROUND_RED | BACKGROUND_BLUE; // green remains
-			break;
-		case 43: // yellow
-			*pAttrs ^= BACKGROUND_BLUE; // red and green remain
-			break;
-		case 44: // blue
-			*pAttrs ^= BACKGROUND_RED | BACKGROUND_GREEN; // blue remains
-			break;
-		case 45: // magenta
-			*pAttrs ^= BACKGROUND_GREEN; // red and blue remain
-			break;
-		case 46: // cyan
-			*pAttrs ^= BACKGROUND_RED; // green and blue remain
-			break;
-		case 47: // white
-			// do nothing
-			break;
-		default:
-			// error
-			break;
+// What a color sequence (or one number in it) does: optionally go back to the previous attributes, then clear, then set
+typedef struct cprintf_color {
+	cprintf_attr_t clear;
+	cprintf_attr_t set;
+	bool reset;
+} cprintf_color;
+
+// what a sink starts out in (and what %[0m goes back to there)
+#define CPRINTF_DEFAULT_ATTRIBUTES CPRINTF_FG_ALL
+
+// Numbers that aren't in the table do nothing (all zeros)
+#if defined(CPRINTF_SGR_ENTRY)
+#error Macro clash!
+#endif
+#define CPRINTF_SGR_ENTRY(code, clear, set, reset) [code] = { clear, set, reset },
+static const cprintf_color sgr_table[CPRINTF_SGR_COUNT] = {
+	CPRINTF_SGR_TABLE(CPRINTF_SGR_ENTRY)
+};
+#undef CPRINTF_SGR_ENTRY
+
+// Folds one number's (or extended color's) clear and set into what the sequence has done so far
+void fold_color(cprintf_color* color, const cprintf_color* entry) {
+	if (entry->reset) { // forget everything before it
+		color->clear = 0;
+		color->set = 0;
+		color->reset = true;
 	}
+	color->set = (color->set & ~entry->clear) | entry->set;
+	color->clear |= entry->clear;
 }
 
-void apply_foreground(WORD* pAttrs, int attr) {
-	*pAttrs |= FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE;
-	switch (attr) {
-		case 30: // black
-			*pAttrs ^= FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE; // leave nothing
-			break;
-		case 31: // red
-			*pAttrs ^= FOREGROUND_GREEN | FOREGROUND_BLUE; // red remains
-			break;
-		case 32: // green
-			*pAttrs ^= FOREGROUND_RED | FOREGROUND_BLUE; // green remains
-			break;
-		case 33: // yellow
-			*pAttrs ^= FOREGROUND_BLUE; // red and green remain
-			break;
-		case 34: // blue
-			*pAttrs ^= FOREGROUND_RED | FOREGROUND_GREEN; // blue remains
-			break;
-		case 35: // magenta
-			*pAttrs ^= FOREGROUND_GREEN; // red and blue remain
-			break;
-		case 36: // cyan
-			*pAttrs ^= FOREGROUND_RED; // green and blue remain
-			break;
-		case 37: // white
-			// do nothing
-			break;
-		default:
-			// error
-			break;
+// Folds one SGR number into what the sequence has done so far
+void add_sgr(cprintf_color* color, unsigned int code) {
+	if (code >= CPRINTF_SGR_COUNT)
+		return;
+	fold_color(color, &sgr_table[code]);
+}
+
+/* 38;5;n and 38;2;r;g;b (and 48;...) take more than one number, so parse_color_sequence hands the numbers to
+* add_sgr_field one at a time and this keeps track of where we are in one of those.
+*/
+enum {
+	CPRINTF_SGR_PLAIN, // not in an extended color
+	CPRINTF_SGR_KIND, // just had 38 or 48, waiting for 5 or 2
+	CPRINTF_SGR_INDEX, // waiting for the 256-color index
+	CPRINTF_SGR_RGB // waiting for red, green and blue
+};
+
+typedef struct sgr_reader {
+	unsigned char state;
+	unsigned char components; // how many of r, g and b we have
+	bool background;
+	uint32_t value;
+} sgr_reader;
+
+// Sets the foreground (or background) to a 256-color index or 0xRRGGBB
+void add_extended(cprintf_color* color, bool background, bool rgb, uint32_t value) {
+	cprintf_color entry = { 0, 0, false };
+	if (background) {
+		entry.clear = CPRINTF_BG_ALL | BACKGROUND_INTENSITY | CPRINTF_BG_EXTENDED;
+		entry.set = (rgb ? CPRINTF_BG_RGB : CPRINTF_BG_256) | (cprintf_attr_t) value << CPRINTF_BG_SHIFT;
+	}
+	else { // the intensity bit stays, it's bold
+		entry.clear = CPRINTF_FG_ALL | CPRINTF_FG_EXTENDED;
+		entry.set = (rgb ? CPRINTF_FG_RGB : CPRINTF_FG_256) | (cprintf_attr_t) value << CPRINTF_FG_SHIFT;
 	}
+	fold_color(color, &entry);
 }
 
-void apply_special(WORD* pAttrs, int attr) {
-	switch (attr) {
-		case 0: // reset
-			*pAttrs = -1;
-			break;
-		case 1: // bold (intensity)
-			// only foreground
-			*pAttrs |= FOREGROUND_INTENSITY;
-			break;
-		case 21: // bold off (intensity)
-			*pAttrs |= FOREGROUND_INTENSITY;
-			*pAttrs ^= FOREGROUND_INTENSITY;
-			break;
-		case 7: // inverse
-			*pAttrs |= COMMON_LVB_REVERSE_VIDEO;
-			break;
-		case 27: // inverse off
-			*pAttrs |= COMMON_LVB_REVERSE_VIDEO;
-			*pAttrs ^= COMMON_LVB_REVERSE_VIDEO;
-			break;
-		case 4: // underline
-			*pAttrs |= COMMON_LVB_UNDERSCORE;
-			break;
-		case 24: // underline off
-			*pAttrs |= COMMON_LVB_UNDERSCORE;
-			*pAttrs ^= COMMON_LVB_UNDERSCORE;
-			break;
-		default:
-			// error
-			break;
+/* One number of a color sequence. valid is false for an empty field or one with something other than digits in it,
+* which is skipped, and also gives up on an extended color that's half read (so does a number that's out of range there).
+*/
+void add_sgr_field(cprintf_color* color, sgr_reader* reader, bool valid, unsigned int code) {
+	switch (reader->state) {
+		case CPRINTF_SGR_PLAIN:
+			if (!valid)
+				return;
+			if (code == 38 || code == 48) {
+				reader->state = CPRINTF_SGR_KIND;
+				reader->background = code == 48;
+			}
+			else {
+				add_sgr(color, code);
+			}
+			return;
+		case CPRINTF_SGR_KIND:
+			reader->state = !valid ? CPRINTF_SGR_PLAIN
+				: code == 5 ? CPRINTF_SGR_INDEX
+				: code == 2 ? CPRINTF_SGR_RGB
+				: CPRINTF_SGR_PLAIN;
+			reader->components = 0;
+			reader->value = 0;
+			return;
+		case CPRINTF_SGR_INDEX:
+			reader->state = CPRINTF_SGR_PLAIN;
+			if (valid && code < 256)
+				add_extended(color, reader->background, false, code);
+			return;
+		case CPRINTF_SGR_RGB:
+			if (!valid || code > 255) {
+				reader->state = CPRINTF_SGR_PLAIN;
+				return;
+			}
+			reader->value = reader->value << 8 | code;
+			if (++reader->components == 3) {
+				reader->state = CPRINTF_SGR_PLAIN;
+				add_extended(color, reader->background, true, reader->value);
+			}
+			return;
 	}
 }
 
-void parse_color_sequence(const char* ptr, WORD* pAttributes) {
-	// IF YOU COPY AND PASTE THIS FUNCTION FOR EITHER parse_color_sequence OR wparse_color_sequence
-	// THEN CHANGE THESE ACCORDINGLY
-	typedef char char_t;
-	char dtype_check; // for macros that need to know the dtype
-	// ============================================================================================
-	if (!ptr || !pAttributes)
-		return;
+// Applies what parse_color_sequence worked out on top of *pAttributes (reset is what 0 goes back to)
+void apply_color(const cprintf_color* color, cprintf_attr_t reset, cprintf_attr_t* pAttributes) {
+	if (color->reset)
+		*pAttributes = reset;
+	*pAttributes = (*pAttributes & ~color->clear) | color->set;
+}
 
-	// these ptrs will hold the place in the string for chars we're searching for
+// Remembers what the backend was showing before we touched it so %[0m can go back to it
+void set_previous(void) {
+	const cprintf_backend* backend = cprintf_get_backend();
+#if defined(_WIN32)
+	GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &cprintf_previous_screen_buffer_info);
+#endif
+	backend->get_attributes(backend->ctx, &cprintf_previous_attributes);
+	atomic_fetch_add_explicit(&counter_get_calls, 1, memory_order_relaxed);
+	current_attributes = cprintf_previous_attributes;
+	cprintf_set_previous = true;
+}
 
-	const char_t* semi_ptr = NULL;
-	const char_t* m_ptr = NULL;
+bool default_backend(const cprintf_backend* backend) {
+#if defined(_WIN32)
+	return backend == cprintf_win32_backend();
+#else
+	return backend == cprintf_posix_backend();
+#endif
+}
 
-	char_t buf[3]; // for atoi()
+// What the terminal output gets. What we detected only goes for the backend we detected it for.
+cprintf_color_level terminal_color_level(void) {
+	int forced = atomic_load_explicit(&forced_level, memory_order_relaxed);
+	if (forced != CPRINTF_COLOR_AUTO)
+		return (cprintf_color_level) forced;
+	return default_backend(cprintf_get_backend()) ? detected_level : CPRINTF_COLOR_TRUECOLOR;
+}
 
-	CONSOLE_SCREEN_BUFFER_INFO info;
-	if (!GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &info)) {
-		// TODO: error
-		printf("%s error\n", __FUNCTION__);
+void cprintf_get_counters(cprintf_counters* pCounters) {
+	if (!pCounters)
 		return;
-	}
+	pCounters->get_attributes_calls = atomic_load_explicit(&counter_get_calls, memory_order_relaxed);
+	pCounters->set_attributes_calls = atomic_load_explicit(&counter_set_calls, memory_order_relaxed);
+	pCounters->set_attributes_elided = atomic_load_explicit(&counter_set_elided, memory_order_relaxed);
+	pCounters->async_dropped = atomic_load_explicit(&counter_async_dropped, memory_order_relaxed);
+}
 
-	if (ptr[1] != CPRINTF_TEXT(dtype_check, '['))
-		return;
+void cprintf_reset_counters(void) {
+	atomic_store_explicit(&counter_get_calls, 0, memory_order_relaxed);
+	atomic_store_explicit(&counter_set_calls, 0, memory_order_relaxed);
+	atomic_store_explicit(&counter_set_elided, 0, memory_order_relaxed);
+	atomic_store_explicit(&counter_async_dropped, 0, memory_order_relaxed);
+}
 
-	ptr += 2;
-	semi_ptr = CPRINTF_STRCHR(dtype_check, ptr, ';');
-	m_ptr = CPRINTF_STRCHR(dtype_check, ptr, 'm');
+/* Memory.
+* Everything cprintf allocates goes through the allocator from cprintf_set_allocator (malloc, realloc and free
+* unless you set one). What a call only needs while it's going on (a conversion too big for the output buffer,
+* room for vswprintf, a second cprintf_call) comes out of the thread's scratch arena instead: blocks that get
+* handed out front to back and taken back all at once when the thread's outermost call ends. If a call needs
+* more than the block has it gets another one, and when the call's over they're all swapped for one block as big
+* as all of them together, so the next call like it doesn't allocate anything. That's only up to
+* CPRINTF_SCRATCH_KEEP though: one huge call shouldn't pin that much memory in the thread for good, so calls that
+* need more than that allocate every time. The same goes for the line buffer atomic writes use.
+*
+* With CPRINTF_NO_MALLOC, allocating or freeing in the middle of a call asserts, except on a thread's first call
+* (that's where its buffers get made) and for the buffers a thread keeps around getting bigger than they've ever
+* been (mem_grow). Async records too big for their slot are the one thing that still has to come from the heap,
+* so that asserts too.
+*/
 
-	if (!m_ptr) {
-		// TODO: error
-		return;
-	}
+#if defined(CPRINTF_SCRATCH_SIZE)
+#error Macro clash!
+#endif
+// the size (in bytes) of a thread's first scratch block
+#define CPRINTF_SCRATCH_SIZE 16384
 
-	*pAttributes = info.wAttributes;
+#if defined(CPRINTF_SCRATCH_KEEP)
+#error Macro clash!
+#endif
+// the most (in bytes) a thread keeps of its scratch blocks, or of its line buffer, between calls
+#define CPRINTF_SCRATCH_KEEP 262144
 
-	memset(buf, 0, 3 * sizeof(dtype_check));
+typedef struct scratch_block {
+	struct scratch_block* prev; // the block that filled up before this one
+	size_t size;
+	size_t used;
+	max_align_t data[]; // so anything can go at the front
+} scratch_block;
 
-	// ====================
-	// parsing special arg
-	// ====================
+typedef struct scratch_arena {
+	scratch_block* block; // the one being handed out from (NULL until a call needs one)
+	unsigned depth; // how many calls deep the thread is (a sink can call cprintf, for one)
+	bool warm; // the thread's finished a call, so its buffers are made
+} scratch_arena;
 
-	if (ptr != semi_ptr) {
-		if (semi_ptr && semi_ptr < m_ptr)
-			memcpy(buf, ptr, min(semi_ptr - ptr, 2) * sizeof(dtype_check));
-		else
-			memcpy(buf, ptr, min(m_ptr - ptr, 2) * sizeof(dtype_check));
-		apply_special(pAttributes, CPRINTF_ATOI(dtype_check, buf)); // buf is zero terminated
+static tss_t arena_key; // each thread's arena
+static once_flag arena_flag = ONCE_FLAG_INIT;
 
-		if (*pAttributes == (WORD) -1) { // means reset 
-			*pAttributes = cprintf_previous_screen_buffer_info.wAttributes;
-			return;
-		}
-	}
+void* default_alloc(void* ctx, size_t size) {
+	(void) ctx;
+	return malloc(size);
+}
 
-	if (!semi_ptr)
-		return;
-	ptr = semi_ptr + 1;
-	if (ptr == m_ptr) // No more args left
-		return;
-	semi_ptr = CPRINTF_STRCHR(dtype_check, ptr, ';'); // find another semicolon
+void* default_resize(void* ctx, void* ptr, size_t size) {
+	(void) ctx;
+	return realloc(ptr, size);
+}
+
+void default_release(void* ctx, void* ptr) {
+	(void) ctx;
+	free(ptr);
+}
 
-	memset(buf, 0, 3 * sizeof(dtype_check));
+static const cprintf_allocator default_allocator = { NULL, default_alloc, default_resize, default_release };
+static _Atomic(const cprintf_allocator*) current_allocator = &default_allocator;
 
-	// ======================
-	// parsing foreground arg
-	// ======================
+void cprintf_set_allocator(const cprintf_allocator* allocator) {
+	atomic_store_explicit(&current_allocator, allocator ? allocator : &default_allocator, memory_order_release);
+}
 
-	if (ptr != semi_ptr) {
-		if (semi_ptr && semi_ptr < m_ptr)
-			memcpy(buf, ptr, min(semi_ptr - ptr, 2) * sizeof(dtype_check));
-		else
-			memcpy(buf, ptr, min(m_ptr - ptr, 2) * sizeof(dtype_check));
-		apply_foreground(pAttributes, CPRINTF_ATOI(dtype_check, buf));
-	}
+const cprintf_allocator* get_allocator(void) {
+	return atomic_load_explicit(&current_allocator, memory_order_acquire);
+}
 
-	if (!semi_ptr)
-		return;
-	ptr = semi_ptr + 1;
-	if (ptr == m_ptr)
-		return;
+// The allocations that are meant to last, no checks
+void* mem_grow(void* ptr, size_t size) {
+	const cprintf_allocator* allocator = get_allocator();
+	if (!ptr)
+		return allocator->alloc(allocator->ctx, size);
+	return allocator->resize(allocator->ctx, ptr, size);
+}
 
-	memset(buf, 0, 3 * sizeof(dtype_check));
+void mem_release(void* ptr) {
+	const cprintf_allocator* allocator = get_allocator();
+	if (ptr)
+		allocator->release(allocator->ctx, ptr);
+}
 
-	// ======================
-	// parsing background arg
-	// ======================
-	if (ptr != m_ptr) {
-		memcpy(buf, ptr, min(m_ptr - ptr, 2) * sizeof(dtype_check));
-		apply_background(pAttributes, CPRINTF_ATOI(dtype_check, buf));
+void free_arena(void* ptr) {
+	scratch_arena* arena = ptr;
+	scratch_block* prev;
+	for (scratch_block* block = arena->block; block; block = prev) {
+		prev = block->prev;
+		mem_release(block);
 	}
+	mem_release(arena);
+}
 
-	ptr = m_ptr;
+void init_arena(void) {
+	tss_create(&arena_key, free_arena);
+}
+
+#if defined(CPRINTF_NO_MALLOC)
+// Every allocation and free that isn't mem_grow comes through here
+void mem_check(void) {
+	scratch_arena* arena;
+	call_once(&arena_flag, init_arena);
+	arena = tss_get(arena_key);
+	assert((!arena || arena->depth == 0 || !arena->warm) && "cprintf allocated in the middle of a call (CPRINTF_NO_MALLOC)");
+}
+#endif
+
+void* mem_alloc(size_t size) {
+#if defined(CPRINTF_NO_MALLOC)
+	mem_check();
+#endif
+	return mem_grow(NULL, size);
 }
-void wparse_color_sequence(const wchar_t* ptr, WORD* pAttributes) {
-	typedef wchar_t char_t;
-	wchar_t dtype_check; // for macros that need to know the dtype
-	if (!ptr || !pAttributes)
-		return;
 
-	// these ptrs will hold the place in the string for chars we're searching for
+void* mem_calloc(size_t size) {
+	void* ptr = mem_alloc(size);
+	if (ptr)
+		memset(ptr, 0, size);
+	return ptr;
+}
 
-	const char_t* semi_ptr = NULL;
-	const char_t* m_ptr = NULL;
+void* mem_realloc(void* ptr, size_t size) {
+#if defined(CPRINTF_NO_MALLOC)
+	mem_check();
+#endif
+	return mem_grow(ptr, size);
+}
 
-	char_t buf[3]; // for atoi()
+void mem_free(void* ptr) {
+#if defined(CPRINTF_NO_MALLOC)
+	if (ptr)
+		mem_check();
+#endif
+	mem_release(ptr);
+}
 
-	CONSOLE_SCREEN_BUFFER_INFO info;
-	if (!GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &info)) {
-		// TODO: error
-		printf("parse_color_sequence() error\n");
-		return;
+scratch_block* scratch_block_new(size_t size, scratch_block* prev) {
+	scratch_block* block = mem_grow(NULL, sizeof(scratch_block) + size);
+	if (!block)
+		return NULL;
+	block->prev = prev;
+	block->size = size;
+	block->used = 0;
+	return block;
+}
+
+// The start of a call. Returns the thread's arena, or NULL if there's no memory for one.
+scratch_arena* arena_enter(void) {
+	scratch_arena* arena;
+
+	call_once(&arena_flag, init_arena);
+	arena = tss_get(arena_key);
+	if (!arena) {
+		arena = mem_grow(NULL, sizeof(scratch_arena));
+		if (!arena)
+			return NULL;
+		arena->block = NULL;
+		arena->depth = 0;
+		arena->warm = false;
+		tss_set(arena_key, arena);
 	}
+	arena->depth++;
+	return arena;
+}
+
+// The end of a call. The outermost one gives everything back.
+void arena_leave(scratch_arena* arena) {
+	scratch_block* block;
+	scratch_block* prev;
+	size_t total = 0;
 
-	if (ptr[1] != CPRINTF_TEXT(dtype_check, '['))
+	if (!arena || --arena->depth > 0)
 		return;
+	arena->warm = true;
+	block = arena->block;
+	if (!block)
+		return;
+	if (!block->prev && block->size <= CPRINTF_SCRATCH_KEEP) {
+		block->used = 0;
+		return;
+	}
+	// the call needed more than one block, so next time it gets one that fits all of it (as long as that's not
+	// more than is worth keeping)
+	for (; block; block = prev) {
+		prev = block->prev;
+		total += block->size;
+		mem_release(block);
+	}
+	arena->block = scratch_block_new(CPRINTF_MIN(total, CPRINTF_SCRATCH_KEEP), NULL);
+}
 
-	ptr += 2;
-	semi_ptr = CPRINTF_STRCHR(dtype_check, ptr, ';');
-	m_ptr = CPRINTF_STRCHR(dtype_check, ptr, 'm');
+// size bytes from the arena, good until the thread's outermost call ends. NULL if there's no memory.
+void* scratch_alloc(scratch_arena* arena, size_t size) {
+	scratch_block* block;
+	void* ptr;
 
-	if (!m_ptr) {
-		// TODO: error
-		return;
+	if (!arena)
+		return NULL;
+	size = (size + sizeof(max_align_t) - 1) / sizeof(max_align_t) * sizeof(max_align_t);
+	block = arena->block;
+	if (!block || block->size - block->used < size) {
+		block = scratch_block_new(CPRINTF_MAX(block ? block->size * 2 : CPRINTF_SCRATCH_SIZE, size), block);
+		if (!block)
+			return NULL;
+		arena->block = block;
 	}
+	ptr = (char*) block->data + block->used;
+	block->used += size;
+	return ptr;
+}
 
-	*pAttributes = info.wAttributes;
+/* Stats (see cprintf_stats in cprintf.h). Everything here is only compiled in with CPRINTF_STATS.
+* A thread counts into a shard that nobody else writes to, so counting is a plain load and store (atomic only so
+* a snapshot can read it at the same time). A call looks its shard up once, in out_init.
+* Shards go on a list that only ever grows. When a thread ends its shard is marked free, and the next new thread
+* takes it over, counts and all, so nothing gets lost and nothing has to be merged when threads come and go.
+*/
 
-	memset(buf, 0, 3 * sizeof(dtype_check));
+#if defined(CPRINTF_STAT)
+#error Macro clash!
+#endif
+#if defined(CPRINTF_STATS)
+#define CPRINTF_STAT(call) call
+#else
+#define CPRINTF_STAT(call)
+#endif
 
-	// ====================
-	// parsing special arg
-	// ====================
+#if defined(CPRINTF_STATS)
 
-	if (ptr != semi_ptr) {
-		if (semi_ptr && semi_ptr < m_ptr)
-			memcpy(buf, ptr, min(semi_ptr - ptr, 2) * sizeof(dtype_check));
-		else
-			memcpy(buf, ptr, min(m_ptr - ptr, 2) * sizeof(dtype_check));
-		apply_special(pAttributes, CPRINTF_ATOI(dtype_check, buf)); // buf is zero terminated
+typedef struct stats_shard {
+	struct stats_shard* next;
+	atomic_bool in_use; // a thread is counting into it
+	atomic_ullong calls;
+	atomic_ullong bytes;
+	atomic_ullong writes;
+	atomic_ullong conversions[CPRINTF_CONVERSION_TYPES];
+	atomic_ullong color_sequences;
+	atomic_ullong flushes;
+	atomic_ullong latency_sum_ns;
+	atomic_ullong latency_max_ns;
+	atomic_ullong latency[CPRINTF_STATS_BUCKETS];
+} stats_shard;
 
-		if (*pAttributes == (WORD) -1) { // means reset 
-			*pAttributes = cprintf_previous_screen_buffer_info.wAttributes;
-			return;
-		}
-	}
+static _Atomic(stats_shard*) stats_shards = NULL;
+static tss_t stats_key; // each thread's shard
 
-	if (!semi_ptr)
-		return;
-	ptr = semi_ptr + 1;
-	if (ptr == m_ptr) // No more args left
-		return;
-	semi_ptr = CPRINTF_STRCHR(dtype_check, ptr, ';'); // find another semicolon
+// Only the shard's own thread ever writes to it, so this doesn't need to be a read-modify-write
+void stats_add(atomic_ullong* counter, unsigned long long n) {
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
 
-	memset(buf, 0, 3 * sizeof(dtype_check));
+uint64_t stats_now(void) {
+	struct timespec now;
+	timespec_get(&now, TIME_UTC);
+	return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
 
-	// ======================
-	// parsing foreground arg
-	// ======================
+unsigned int highest_bit(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+	return 63 - (unsigned int) __builtin_clzll(v);
+#else
+	unsigned int bit = 0;
+	while (v >>= 1)
+		++bit;
+	return bit;
+#endif
+}
 
-	if (ptr != semi_ptr) {
-		if (semi_ptr && semi_ptr < m_ptr)
-			memcpy(buf, ptr, min(semi_ptr - ptr, 2) * sizeof(dtype_check));
-		else
-			memcpy(buf, ptr, min(m_ptr - ptr, 2) * sizeof(dtype_check));
-		apply_foreground(pAttributes, CPRINTF_ATOI(dtype_check, buf));
-	}
+// Which histogram bucket a latency goes in
+int stats_bucket(uint64_t ns) {
+	unsigned int top;
+	if (ns < CPRINTF_STATS_SUB)
+		return (int) ns;
+	top = highest_bit(ns);
+	if (top >= 40)
+		return CPRINTF_STATS_BUCKETS - 1;
+	return (int) ((top - CPRINTF_STATS_SUB_BITS + 1) * CPRINTF_STATS_SUB + (ns >> (top - CPRINTF_STATS_SUB_BITS)) - CPRINTF_STATS_SUB);
+}
 
-	if (!semi_ptr)
-		return;
-	ptr = semi_ptr + 1;
-	if (ptr == m_ptr)
-		return;
+void stats_release(void* shard) {
+	atomic_store_explicit(&((stats_shard*) shard)->in_use, false, memory_order_release);
+}
 
-	memset(buf, 0, 3 * sizeof(dtype_check));
+// The calling thread's shard: its own, a free one, or a new one. NULL if there's no memory for one.
+stats_shard* stats_shard_get(void) {
+	stats_shard* shard = tss_get(stats_key);
+	bool in_use;
 
-	// ======================
-	// parsing background arg
-	// ======================
-	if (ptr != m_ptr) {
-		memcpy(buf, ptr, min(m_ptr - ptr, 2) * sizeof(dtype_check));
-		apply_background(pAttributes, CPRINTF_ATOI(dtype_check, buf));
+	if (shard)
+		return shard;
+	for (shard = atomic_load_explicit(&stats_shards, memory_order_acquire); shard; shard = shard->next) {
+		in_use = false;
+		if (atomic_compare_exchange_strong(&shard->in_use, &in_use, true))
+			break;
 	}
-
-	ptr = m_ptr;
+	if (!shard) {
+		shard = mem_calloc(sizeof(stats_shard));
+		if (!shard)
+			return NULL;
+		atomic_init(&shard->in_use, true);
+		shard->next = atomic_load_explicit(&stats_shards, memory_order_relaxed);
+		while (!atomic_compare_exchange_weak_explicit(&stats_shards, &shard->next, shard, memory_order_release, memory_order_relaxed))
+			;
+	}
+	tss_set(stats_key, shard);
+	return shard;
 }
 
-const char* find_any(const char* cstr, const char* chars) {
-	for (const char* ptr = cstr; *ptr != '\0'; ++ptr) {
-		for (const char* chars_ptr = chars; *chars_ptr != '\0'; ++chars_ptr) {
-			if (*ptr == *chars_ptr)
-				return ptr;
-		}
+// what kind of conversion the ending character c is (-1 for anything that isn't one)
+int conversion_type(unsigned char c) {
+	switch (c) {
+		case 'd': case 'i':
+			return CPRINTF_CONVERSION_SIGNED;
+		case 'u': case 'o': case 'x': case 'X':
+			return CPRINTF_CONVERSION_UNSIGNED;
+		case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+			return CPRINTF_CONVERSION_FLOAT;
+		case 'c':
+			return CPRINTF_CONVERSION_CHAR;
+		case 's':
+			return CPRINTF_CONVERSION_STRING;
+		case 'p':
+			return CPRINTF_CONVERSION_POINTER;
+		case 'n':
+			return CPRINTF_CONVERSION_COUNT;
+		default:
+			return -1;
 	}
-	return NULL;
 }
-const wchar_t* wfind_any(const wchar_t* cstr, const wchar_t* chars) {
-	for (const wchar_t* ptr = cstr; *ptr != L'\0'; ++ptr) {
-		for (const wchar_t* chars_ptr = chars; *chars_ptr != L'\0'; ++chars_ptr) {
-			if (*ptr == *chars_ptr)
-				return ptr;
-		}
-	}
-	return NULL;
+
+void stats_flush(void) {
+	stats_shard* shard = stats_shard_get();
+	if (shard)
+		stats_add(&shard->flushes, 1);
 }
 
-int cprintf(const char* const format, ...) {
-	if (!cprintf_set_previous) {
-		GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &cprintf_previous_screen_buffer_info);
-		cprintf_set_previous = true;
+#endif
+
+int cprintf_stats_snapshot(cprintf_stats* pStats) {
+#if defined(CPRINTF_STATS)
+	cprintf_counters counters;
+	unsigned long long max;
+#endif
+
+	if (!pStats)
+		return -1;
+	memset(pStats, 0, sizeof(cprintf_stats));
+#if defined(CPRINTF_STATS)
+	for (stats_shard* shard = atomic_load_explicit(&stats_shards, memory_order_acquire); shard; shard = shard->next) {
+		pStats->calls += atomic_load_explicit(&shard->calls, memory_order_relaxed);
+		pStats->bytes += atomic_load_explicit(&shard->bytes, memory_order_relaxed);
+		pStats->writes += atomic_load_explicit(&shard->writes, memory_order_relaxed);
+		for (int i = 0; i < CPRINTF_CONVERSION_TYPES; ++i)
+			pStats->conversions[i] += atomic_load_explicit(&shard->conversions[i], memory_order_relaxed);
+		pStats->color_sequences += atomic_load_explicit(&shard->color_sequences, memory_order_relaxed);
+		pStats->flushes += atomic_load_explicit(&shard->flushes, memory_order_relaxed);
+		pStats->latency_sum_ns += atomic_load_explicit(&shard->latency_sum_ns, memory_order_relaxed);
+		max = atomic_load_explicit(&shard->latency_max_ns, memory_order_relaxed);
+		pStats->latency_max_ns = CPRINTF_MAX(pStats->latency_max_ns, max);
+		for (int i = 0; i < CPRINTF_STATS_BUCKETS; ++i)
+			pStats->latency[i] += atomic_load_explicit(&shard->latency[i], memory_order_relaxed);
 	}
-	// IF YOU COPY AND PASTE THIS FUNCTION FOR EITHER cprintf OR cwprintf
-	// THEN CHANGE THESE ACCORDINGLY
-	char dtype;
-	typedef char char_t;
-	// ==================================================================
+	cprintf_get_counters(&counters);
+	pStats->get_attributes_calls = counters.get_attributes_calls;
+	pStats->set_attributes_calls = counters.set_attributes_calls;
+	return 0;
+#else
+	return -1;
+#endif
+}
 
-	int chars_written = 0;
-	int res;
+unsigned long long cprintf_stats_bucket_limit(int bucket) {
+	if (bucket < 0)
+		return 0;
+	if (bucket >= CPRINTF_STATS_BUCKETS - 1)
+		return ULLONG_MAX;
+	if (bucket < CPRINTF_STATS_SUB)
+		return (unsigned long long) bucket + 1;
+	return (unsigned long long) (CPRINTF_STATS_SUB + bucket % CPRINTF_STATS_SUB + 1) << (bucket / CPRINTF_STATS_SUB - 1);
+}
+
+unsigned long long cprintf_stats_percentile(const cprintf_stats* stats, double q) {
+	unsigned long long total = 0;
+	unsigned long long seen = 0;
+	unsigned long long rank;
+
+	if (!stats)
+		return 0;
+	for (int i = 0; i < CPRINTF_STATS_BUCKETS; ++i)
+		total += stats->latency[i];
+	if (total == 0)
+		return 0;
+	// the rank of the call we're after, counting from 1 (q of the calls are at or below it)
+	rank = q <= 0 ? 1 : q >= 1 ? total : (unsigned long long) (q * (double) total);
+	if ((double) rank < q * (double) total)
+		++rank;
+	rank = CPRINTF_MAX(rank, 1);
+	for (int i = 0; i < CPRINTF_STATS_BUCKETS; ++i) {
+		seen += stats->latency[i];
+		if (seen >= rank)
+			return CPRINTF_MIN(cprintf_stats_bucket_limit(i) - 1, stats->latency_max_ns);
+	}
+	return stats->latency_max_ns;
+}
 
+// One line of cprintf_stats_dump (they're all short)
+int dump_line(cprintf_sink sink, void* ctx, const char* format, ...) {
+	char line[256];
 	va_list arg;
+	int len;
+
 	va_start(arg, format);
+	len = vsnprintf(line, sizeof(line), format, arg);
+	va_end(arg);
+	if (len < 0)
+		return -1;
+	return sink(ctx, line, CPRINTF_MIN((size_t) len, sizeof(line) - 1));
+}
 
-	WORD attrs;
+int dump_counter(cprintf_sink sink, void* ctx, const char* name, const char* help, unsigned long long value) {
+	if (dump_line(sink, ctx, "# HELP cprintf_%s_total %s\n# TYPE cprintf_%s_total counter\n", name, help, name) < 0)
+		return -1;
+	return dump_line(sink, ctx, "cprintf_%s_total %llu\n", name, value);
+}
 
-	const char_t* pos = NULL;
-	const char_t* length_pos = NULL;
-	char_t buf[CPRINTF_BUF_SIZE];
+int cprintf_stats_dump(cprintf_sink sink, void* ctx) {
+	static const char* const conversion_names[CPRINTF_CONVERSION_TYPES] = {
+		"signed", "unsigned", "float", "char", "string", "pointer", "count"
+	};
+	cprintf_stats* stats;
+	unsigned long long below = 0;
+	int bucket = 0;
+	int res = -1;
 
-	for (const char_t* ptr = format; *ptr != CPRINTF_TEXT(dtype, '\0'); ++ptr) {
-		// Iterating through the string until we find a % or a null character
-		// we are also printing the chars that don't meet those criteria
-		while (*ptr != CPRINTF_TEXT(dtype, '%') && *ptr != CPRINTF_TEXT(dtype, '\0')) {
-			CPRINTF_PUTCHAR(dtype, *ptr);
-			ptr++;
-			chars_written++;
-		}
+	if (!sink || !(stats = mem_alloc(sizeof(cprintf_stats)))) // it's a bit big for the stack
+		return -1;
+	cprintf_stats_snapshot(stats);
 
-		// If we at the end of the string, then break
-		if (*ptr == CPRINTF_TEXT(dtype, '\0'))
-			break;
-	
-		// check if the % isn't an escaped %
-		if (ptr[1] == CPRINTF_TEXT(dtype, '%')) {
-			++ptr;
-			continue;
-		}
+	if (dump_counter(sink, ctx, "calls", "Calls that printed something.", stats->calls) < 0
+		|| dump_counter(sink, ctx, "bytes", "Bytes handed to the backend or a sink.", stats->bytes) < 0
+		|| dump_counter(sink, ctx, "writes", "Times output was handed to the backend or a sink.", stats->writes) < 0
+		|| dump_line(sink, ctx, "# HELP cprintf_conversions_total Conversions carried out, by type.\n"
+			"# TYPE cprintf_conversions_total counter\n") < 0)
+		goto done;
+	for (int i = 0; i < CPRINTF_CONVERSION_TYPES; ++i) {
+		if (dump_line(sink, ctx, "cprintf_conversions_total{type=\"%s\"} %llu\n", conversion_names[i], stats->conversions[i]) < 0)
+			goto done;
+	}
+	if (dump_counter(sink, ctx, "color_sequences", "Color sequences carried out.", stats->color_sequences) < 0
+		|| dump_counter(sink, ctx, "get_attributes_calls", "Times the backend was asked for its attributes.", stats->get_attributes_calls) < 0
+		|| dump_counter(sink, ctx, "set_attributes_calls", "Attribute changes sent to the backend.", stats->set_attributes_calls) < 0
+		|| dump_counter(sink, ctx, "flushes", "cprintf_flush calls.", stats->flushes) < 0
+		|| dump_line(sink, ctx, "# HELP cprintf_call_duration_seconds How long calls took.\n"
+			"# TYPE cprintf_call_duration_seconds histogram\n") < 0)
+		goto done;
 
-		// If we get here, then we have come across a printf escape sequence
+	// a Prometheus bucket at every power of two from 128 ns to about 34 s (where the histogram's groups start)
+	for (int shift = 7; shift <= 35; ++shift) {
+		for (; cprintf_stats_bucket_limit(bucket) <= 1ull << shift; ++bucket)
+			below += stats->latency[bucket];
+		if (dump_line(sink, ctx, "cprintf_call_duration_seconds_bucket{le=\"%.9g\"} %llu\n", (double) (1ull << shift) * 1e-9, below) < 0)
+			goto done;
+	}
+	if (dump_line(sink, ctx, "cprintf_call_duration_seconds_bucket{le=\"+Inf\"} %llu\n", stats->calls) < 0
+		|| dump_line(sink, ctx, "cprintf_call_duration_seconds_sum %.9f\n", (double) stats->latency_sum_ns * 1e-9) < 0
+		|| dump_line(sink, ctx, "cprintf_call_duration_seconds_count %llu\n", stats->calls) < 0)
+		goto done;
+	res = 0;
 
-		memset(buf, 0, CPRINTF_BUF_SIZE * sizeof(char_t)); // zero buffer (so it is always null terminated)
-		
-		// Find any character in that string. These characters are the "ending characters"
-		pos = CPRINTF_FUNC_SWITCH(dtype, find_any, ptr, CPRINTF_TEXT(dtype, "diuoxXfFeEgGaAcspn m"));
-		if (!pos) // if we didn't find one
-			continue;
-		memcpy(buf, ptr, min(1 + pos - ptr, CPRINTF_BUF_SIZE - 1) * sizeof(char_t)); // copy the string into the buffer but truncate it at CPRINTF_BUF_SIZE - 1
-
-		// finding length specifier
-		length_pos = CPRINTF_FUNC_SWITCH(dtype, find_any, ptr, CPRINTF_TEXT(dtype, "hljztL"));
-
-		// Now we decipher what the user wants to do
-		res = 0;
-		switch (*pos) {
-			case CPRINTF_TEXT(dtype, 'd'): // signed decimal integer
-			case CPRINTF_TEXT(dtype, 'i'): // signed decimal integer
-				if (!length_pos || length_pos > pos) {
-					res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, int));
-					break;
-				}
-				// if there is a length specified, then we have to cast the argument we got appropriately
-				switch (*length_pos) {
-					case CPRINTF_TEXT(dtype, 'h'):
-						// check if there's not another one
-						if (length_pos[1] != length_pos[0])
-							res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, short int));
-						else
-							res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, signed char));
-						break;
-					case CPRINTF_TEXT(dtype, 'l'):
-						// check if there's not another one
-						if (length_pos[1] != length_pos[0])
-							res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, long int));
-						else
-							res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, long long int));
-						break;
-					case CPRINTF_TEXT(dtype, 'j'):
-						res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, intmax_t));
-						break;
-					case CPRINTF_TEXT(dtype, 'z'):
-						res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, size_t));
-						break;
-					case CPRINTF_TEXT(dtype, 't'):
-						res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, ptrdiff_t));
-						break;
-					case CPRINTF_TEXT(dtype, 'L'): // N/A but we will do default
-						res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, int));
-						break;
-					default:
-						break;
-				}
-				break;
-			case CPRINTF_TEXT(dtype, 'u'): // unsigned decimal integer
-			case CPRINTF_TEXT(dtype, 'o'): // unsigned octal
-			case CPRINTF_TEXT(dtype, 'x'): // unsigned hexadecimal integer
-			case CPRINTF_TEXT(dtype, 'X'): // unsigned hexadecimal integer (uppercase)
-				if (!length_pos || length_pos > pos) {
-					res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, unsigned int));
-					break;
-				}
-				// if there is a length specified, then we have to cast the argument we got appropriately
-				switch (*length_pos) {
-					case CPRINTF_TEXT(dtype, 'h'):
-						// check if there's not another one
-						if (length_pos[1] != length_pos[0])
-							res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, unsigned short int));
-						else
-							res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, unsigned char));
-						break;
-					case CPRINTF_TEXT(dtype, 'l'):
-						// check if there's not another one
-						if (length_pos[1] != length_pos[0])
-							res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, unsigned long int));
-						else
-							res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, unsigned long long int));
-						break;
-					case CPRINTF_TEXT(dtype, 'j'):
-						res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, uintmax_t));
-						break;
-					case CPRINTF_TEXT(dtype, 'z'):
-						res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, size_t));
-						break;
-					case CPRINTF_TEXT(dtype, 't'):
-						res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, ptrdiff_t));
-						break;
-					case CPRINTF_TEXT(dtype, 'L'): // N/A but we will do default
-						res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, unsigned int));
-						break;
-					default:
-						break;
-				}
-				break;
-			case CPRINTF_TEXT(dtype, 'f'): // decimal floating point
-			case CPRINTF_TEXT(dtype, 'F'): // decimal floating point (uppercase)
-			case CPRINTF_TEXT(dtype, 'e'): // scientific notation (mantissa/exponent)
-			case CPRINTF_TEXT(dtype, 'E'): // scientific notation (mantissa/exponent) (uppercase)
-			case CPRINTF_TEXT(dtype, 'g'): // Use the shortest representation: %e or %f
-			case CPRINTF_TEXT(dtype, 'G'): // Use the shortest representation: %E or %F
-			case CPRINTF_TEXT(dtype, 'a'): // hexadecimal floating point
-			case CPRINTF_TEXT(dtype, 'A'): // Hexadecimal floating point (uppercase)
-				if (!length_pos || length_pos > pos)
-					res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, double));
-				else if (*length_pos == CPRINTF_TEXT(dtype, 'L'))
-					res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, long double));
-				break;
-			case CPRINTF_TEXT(dtype, 'c'): // character
-				if (!length_pos || length_pos > pos)
-					res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, int));
-				else if (*length_pos == CPRINTF_TEXT(dtype, 'l'))
-					res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, wint_t));
-				break;
-			case CPRINTF_TEXT(dtype, 's'): // string of characters
-				if (!length_pos || length_pos > pos)
-					res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, char*));
-				else if (*length_pos == CPRINTF_TEXT(dtype, 'l'))
-					res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, wchar_t*));
-				break;
-			case CPRINTF_TEXT(dtype, 'p'): // pointer address
-				res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, void*));
-				break;
-			case CPRINTF_TEXT(dtype, 'n'): // number of characters written so far
-				if (!length_pos || length_pos > pos) {
-					int* p = va_arg(arg, int*);
-					*p = (int) chars_written;
-					res = 0;
-					break;
-				}
-				// if there is a length specified, then we have to cast the argument we got appropriately
-				switch (*length_pos) {
-					case CPRINTF_TEXT(dtype, 'h'):
-						// check if there's not another one
-						if (length_pos[1] != length_pos[0]) {
-							short int* p = va_arg(arg, short int*);
-							*p = (short int) chars_written;
-						}
-						else {
-							signed char* p = va_arg(arg, signed char*);
-							*p = (signed char) chars_written;
-						}
-						break;
-					case CPRINTF_TEXT(dtype, 'l'):
-						// check if there's not another one
-						if (length_pos[1] != length_pos[0]) {
-							long int* p = va_arg(arg, long int*);
-							*p = (long int) chars_written;
-						}
-						else {
-							long long int* p = va_arg(arg, long long int*);
-							*p = (long long int) chars_written;
-						}
-						break;
-					case CPRINTF_TEXT(dtype, 'j'): {
-						intmax_t* p = va_arg(arg, intmax_t*);
-						*p = (intmax_t) chars_written;
-						break;
-					}
-					case CPRINTF_TEXT(dtype, 'z'): {
-						size_t* p = va_arg(arg, size_t*);
-						*p = (size_t) chars_written;
-						break;
-					}
-					case CPRINTF_TEXT(dtype, 't'): {
-						ptrdiff_t* p = va_arg(arg, ptrdiff_t*);
-						*p = (ptrdiff_t) chars_written;
-						break;
-					}
-					case CPRINTF_TEXT(dtype, 'L'): // N/A
-					default:
-						break;
-				}
-				res = 0;
-				break;
-			case CPRINTF_TEXT(dtype, 'm'): { // our color escape sequence
-				if (ptr[1] != CPRINTF_TEXT(dtype, '[')) // not the escape character we're looking for
-					break;
-				CPRINTF_FUNC_SWITCH(dtype, parse_color_sequence, ptr, &attrs); // parse the color sequence
+done:
+	mem_free(stats);
+	return res;
+}
 
-				if (!SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE), attrs)) {
-					// TODO: error
-					return -1;
-				}
-				res = 0;
-				break;
-			}
-			case CPRINTF_TEXT(dtype, '%'): // escaped the sequence
-				res = CPRINTF_PUTCHAR(dtype, *pos);
-				break;
-			case CPRINTF_TEXT(dtype, ' '): // didn't finish the sequence
-				// TODO: ?
-			default:
+/* Async mode.
+* cprintf_start_async gives the writing its own thread. A call formats into the thread's line buffer the same
+* way atomic writes do, copies the result into a slot of a ring that was allocated up front, and goes back to
+* whatever it was doing. The writer thread empties the ring in order, glues as many slots as it can into one
+* big write, and puts a color change in front of a slot when the slot expects colors that aren't showing.
+*
+* The ring is a bounded queue in the style of Dmitry Vyukov's. Every slot has a sequence number that says
+* whose turn it is, and the producers and the writer claim slots by moving their position along with a CAS.
+* Dropping the oldest slot is just a producer doing the writer's job once and throwing the slot away.
+*/
+
+#define CPRINTF_ASYNC_TEXT 224 // messages longer than this get a copy on the heap
+#define CPRINTF_ASYNC_BATCH 65536 // the most the writer puts in one write (unless one message is bigger)
+
+typedef struct async_slot {
+	atomic_size_t sequence;
+	size_t len;
+	char* heap;
+	cprintf_attr_t start; // the attributes the text expects to be drawn in
+	cprintf_attr_t end; // the attributes it leaves behind
+	char text[CPRINTF_ASYNC_TEXT];
+} async_slot;
+
+typedef struct async_queue {
+	const cprintf_backend* backend;
+	cprintf_overflow overflow;
+	size_t mask; // slot count - 1 (the count is a power of 2)
+	async_slot* slots;
+	char* batch;
+	cprintf_attr_t shown; // what the writer left the backend showing
+	thrd_t writer;
+	mtx_t lock; // only for sleeping and waking up
+	cnd_t wake; // the writer waits on this when the ring is empty
+	cnd_t done; // cprintf_flush waits on this
+	atomic_bool running;
+	atomic_bool sleeping;
+	atomic_size_t enqueue_pos;
+	atomic_size_t dequeue_pos;
+	atomic_size_t written_pos; // everything before this has been written (or dropped)
+} async_queue;
+
+static _Atomic(async_queue*) async_ring = NULL;
+
+// Claims the next free slot for a producer. Returns NULL if the ring is full.
+async_slot* async_claim(async_queue* q, size_t* pPos) {
+	size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+	async_slot* slot;
+	ptrdiff_t diff;
+	for (;;) {
+		slot = &q->slots[pos & q->mask];
+		diff = (ptrdiff_t) (atomic_load_explicit(&slot->sequence, memory_order_acquire) - pos);
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
 				break;
 		}
-		ptr = pos;
-		if (res >= 0)
-			chars_written += res;
-		else
-			return res;
+		else if (diff < 0) {
+			return NULL;
+		}
+		else {
+			pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+		}
 	}
-	va_end(arg);
-	return (int) chars_written;
+	*pPos = pos;
+	return slot;
 }
-int cwprintf(const wchar_t* const format, ...) {
-	if (!cprintf_set_previous) {
-		GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &cprintf_previous_screen_buffer_info);
-		cprintf_set_previous = true;
+
+// Takes the oldest filled slot. Returns NULL if there isn't one. Hand it back with async_release.
+async_slot* async_take(async_queue* q, size_t* pPos) {
+	size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+	async_slot* slot;
+	ptrdiff_t diff;
+	for (;;) {
+		slot = &q->slots[pos & q->mask];
+		diff = (ptrdiff_t) (atomic_load_explicit(&slot->sequence, memory_order_acquire) - (pos + 1));
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&q->dequeue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if (diff < 0) {
+			return NULL;
+		}
+		else {
+			pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+		}
 	}
-	// IF YOU COPY AND PASTE THIS FUNCTION FOR EITHER cprintf OR cwprintf
-	// THEN CHANGE THESE ACCORDINGLY
-	wchar_t dtype;
-	typedef wchar_t char_t;
-	// ==================================================================
+	*pPos = pos;
+	return slot;
+}
 
-	int chars_written = 0;
-	int res;
+void async_release(async_queue* q, async_slot* slot, size_t pos) {
+	mem_free(slot->heap);
+	slot->heap = NULL;
+	atomic_store_explicit(&slot->sequence, pos + q->mask + 1, memory_order_release);
+}
 
-	va_list arg;
-	va_start(arg, format);
+bool async_empty(async_queue* q) {
+	size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+	return atomic_load_explicit(&q->slots[pos & q->mask].sequence, memory_order_acquire) != pos + 1;
+}
 
-	WORD attrs;
+void async_wait(cnd_t* cond, mtx_t* lock) {
+	struct timespec until;
+	timespec_get(&until, TIME_UTC);
+	until.tv_nsec += 10000000; // 10ms, in case a wake up slips past us
+	if (until.tv_nsec >= 1000000000) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
+	cnd_timedwait(cond, lock, &until);
+}
 
-	const char_t* pos = NULL;
-	const char_t* length_pos = NULL;
-	char_t buf[CPRINTF_BUF_SIZE];
+void async_wake(async_queue* q) {
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!atomic_load_explicit(&q->sleeping, memory_order_relaxed))
+		return;
+	mtx_lock(&q->lock);
+	cnd_signal(&q->wake);
+	mtx_unlock(&q->lock);
+}
 
-	for (const char_t* ptr = format; *ptr != CPRINTF_TEXT(dtype, '\0'); ++ptr) {
-		// Iterating through the string until we find a % or a null character
-		// we are also printing the chars that don't meet those criteria
-		while (*ptr != CPRINTF_TEXT(dtype, '%') && *ptr != CPRINTF_TEXT(dtype, '\0')) {
-			CPRINTF_PUTCHAR(dtype, *ptr);
-			ptr++;
-			chars_written++;
-		}
+// Queues len bytes for the writer. Returns false if they couldn't be queued.
+bool async_push(async_queue* q, const char* bytes, size_t len, cprintf_attr_t start, cprintf_attr_t end) {
+	async_slot* slot;
+	async_slot* oldest;
+	size_t pos;
+	char* heap = NULL;
 
-		// If we at the end of the string, then break
-		if (*ptr == CPRINTF_TEXT(dtype, '\0'))
-			break;
+	if (len > CPRINTF_ASYNC_TEXT) {
+		heap = mem_alloc(len);
+		if (!heap)
+			return false;
+		memcpy(heap, bytes, len);
+	}
 
-		// check if the % isn't an escaped %
-		if (ptr[1] == CPRINTF_TEXT(dtype, '%')) {
-			++ptr;
+	while (!(slot = async_claim(q, &pos))) { // full
+		if (q->overflow == CPRINTF_OVERFLOW_DROP_NEWEST) {
+			mem_free(heap);
+			atomic_fetch_add_explicit(&counter_async_dropped, 1, memory_order_relaxed);
+			return true;
+		}
+		if (q->overflow == CPRINTF_OVERFLOW_DROP_OLDEST) {
+			oldest = async_take(q, &pos);
+			if (oldest) { // the writer sorts out the colors the next slot expects, so nothing is lost there
+				async_release(q, oldest, pos);
+				atomic_fetch_add_explicit(&counter_async_dropped, 1, memory_order_relaxed);
+			}
 			continue;
 		}
+		async_wake(q);
+		thrd_yield();
+	}
 
-		// If we get here, then we have come across a printf escape sequence
+	slot->len = len;
+	slot->heap = heap;
+	slot->start = start;
+	slot->end = end;
+	if (!heap)
+		memcpy(slot->text, bytes, len);
+	atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+	async_wake(q);
+	return true;
+}
 
-		memset(buf, 0, CPRINTF_BUF_SIZE * sizeof(char_t)); // zero buffer (so it is always null terminated)
+void async_write(async_queue* q, const char* bytes, size_t len) {
+	if (len)
+		q->backend->write(q->backend->ctx, bytes, len);
+}
 
-														   // Find any character in that string. These characters are the "ending characters"
-		pos = CPRINTF_FUNC_SWITCH(dtype, find_any, ptr, CPRINTF_TEXT(dtype, "diuoxXfFeEgGaAcspn m"));
-		if (!pos) // if we didn't find one
-			continue;
-		memcpy(buf, ptr, min(1 + pos - ptr, CPRINTF_BUF_SIZE - 1) * sizeof(char_t)); // copy the string into the buffer but truncate it at CPRINTF_BUF_SIZE - 1
-
-																					 // finding length specifier
-		length_pos = CPRINTF_FUNC_SWITCH(dtype, find_any, ptr, CPRINTF_TEXT(dtype, "hljztL"));
-
-		// Now we decipher what the user wants to do
-		res = 0;
-		switch (*pos) {
-			case CPRINTF_TEXT(dtype, 'd'): // signed decimal integer
-			case CPRINTF_TEXT(dtype, 'i'): // signed decimal integer
-				if (!length_pos) {
-					res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, int));
-					break;
-				}
-				// if there is a length specified, then we have to cast the argument we got appropriately
-				switch (*length_pos) {
-					case CPRINTF_TEXT(dtype, 'h'):
-						// check if there's not another one
-						if (length_pos[1] != length_pos[0])
-							res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, short int));
-						else
-							res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, signed char));
-						break;
-					case CPRINTF_TEXT(dtype, 'l'):
-						// check if there's not another one
-						if (length_pos[1] != length_pos[0])
-							res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, long int));
-						else
-							res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, long long int));
-						break;
-					case CPRINTF_TEXT(dtype, 'j'):
-						res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, intmax_t));
-						break;
-					case CPRINTF_TEXT(dtype, 'z'):
-						res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, size_t));
-						break;
-					case CPRINTF_TEXT(dtype, 't'):
-						res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, ptrdiff_t));
-						break;
-					case CPRINTF_TEXT(dtype, 'L'): // N/A but we will do default
-						res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, int));
-						break;
-					default:
-						break;
-				}
-				break;
-			case CPRINTF_TEXT(dtype, 'u'): // unsigned decimal integer
-			case CPRINTF_TEXT(dtype, 'o'): // unsigned octal
-			case CPRINTF_TEXT(dtype, 'x'): // unsigned hexadecimal integer
-			case CPRINTF_TEXT(dtype, 'X'): // unsigned hexadecimal integer (uppercase)
-				if (!length_pos) {
-					res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, unsigned int));
-					break;
-				}
-				// if there is a length specified, then we have to cast the argument we got appropriately
-				switch (*length_pos) {
-					case CPRINTF_TEXT(dtype, 'h'):
-						// check if there's not another one
-						if (length_pos[1] != length_pos[0])
-							res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, unsigned short int));
-						else
-							res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, unsigned char));
-						break;
-					case CPRINTF_TEXT(dtype, 'l'):
-						// check if there's not another one
-						if (length_pos[1] != length_pos[0])
-							res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, unsigned long int));
-						else
-							res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, unsigned long long int));
-						break;
-					case CPRINTF_TEXT(dtype, 'j'):
-						res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, uintmax_t));
-						break;
-					case CPRINTF_TEXT(dtype, 'z'):
-						res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, size_t));
-						break;
-					case CPRINTF_TEXT(dtype, 't'):
-						res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, ptrdiff_t));
-						break;
-					case CPRINTF_TEXT(dtype, 'L'): // N/A but we will do default
-						res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, unsigned int));
-						break;
-					default:
-						break;
-				}
-				break;
-			case CPRINTF_TEXT(dtype, 'f'): // decimal floating point
-			case CPRINTF_TEXT(dtype, 'F'): // decimal floating point (uppercase)
-			case CPRINTF_TEXT(dtype, 'e'): // scientific notation (mantissa/exponent)
-			case CPRINTF_TEXT(dtype, 'E'): // scientific notation (mantissa/exponent) (uppercase)
-			case CPRINTF_TEXT(dtype, 'g'): // Use the shortest representation: %e or %f
-			case CPRINTF_TEXT(dtype, 'G'): // Use the shortest representation: %E or %F
-			case CPRINTF_TEXT(dtype, 'a'): // hexadecimal floating point
-			case CPRINTF_TEXT(dtype, 'A'): // Hexadecimal floating point (uppercase)
-				if (!length_pos)
-					res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, double));
-				else if (*length_pos == CPRINTF_TEXT(dtype, 'L'))
-					res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, long double));
-				break;
-			case CPRINTF_TEXT(dtype, 'c'): // character
-				if (!length_pos)
-					res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, int));
-				else if (*length_pos == CPRINTF_TEXT(dtype, 'l'))
-					res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, wint_t));
-				break;
-			case CPRINTF_TEXT(dtype, 's'): // string of characters
-				if (!length_pos)
-					res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, char*));
-				else if (*length_pos == CPRINTF_TEXT(dtype, 'l'))
-					res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, wchar_t*));
-				break;
-			case CPRINTF_TEXT(dtype, 'p'): // pointer address
-				res = CPRINTF_FUNC_SWITCH(dtype, printf, buf, va_arg(arg, void*));
-				break;
-			case CPRINTF_TEXT(dtype, 'n'): // number of characters written so far
-				if (!length_pos) {
-					int* p = va_arg(arg, int*);
-					*p = (int) chars_written;
-					res = 0;
-					break;
-				}
-				// if there is a length specified, then we have to cast the argument we got appropriately
-				switch (*length_pos) {
-					case CPRINTF_TEXT(dtype, 'h'):
-						// check if there's not another one
-						if (length_pos[1] != length_pos[0]) {
-							short int* p = va_arg(arg, short int*);
-							*p = (short int) chars_written;
-						}
-						else {
-							signed char* p = va_arg(arg, signed char*);
-							*p = (signed char) chars_written;
-						}
-						break;
-					case CPRINTF_TEXT(dtype, 'l'):
-						// check if there's not another one
-						if (length_pos[1] != length_pos[0]) {
-							long int* p = va_arg(arg, long int*);
-							*p = (long int) chars_written;
-						}
-						else {
-							long long int* p = va_arg(arg, long long int*);
-							*p = (long long int) chars_written;
-						}
-						break;
-					case CPRINTF_TEXT(dtype, 'j'): {
-						intmax_t* p = va_arg(arg, intmax_t*);
-						*p = (intmax_t) chars_written;
-						break;
-					}
-					case CPRINTF_TEXT(dtype, 'z'): {
-						size_t* p = va_arg(arg, size_t*);
-						*p = (size_t) chars_written;
-						break;
-					}
-					case CPRINTF_TEXT(dtype, 't'): {
-						ptrdiff_t* p = va_arg(arg, ptrdiff_t*);
-						*p = (ptrdiff_t) chars_written;
-						break;
-					}
-					case CPRINTF_TEXT(dtype, 'L'): // N/A
-					default:
-						break;
-				}
-				res = 0;
-				break;
-			case CPRINTF_TEXT(dtype, 'm'): { // our color escape sequence
-				if (ptr[1] != CPRINTF_TEXT(dtype, '[')) // not the escape character we're looking for
-					break;
-				CPRINTF_FUNC_SWITCH(dtype, parse_color_sequence, ptr, &attrs); // parse the color sequence
+int async_writer(void* arg) {
+	async_queue* q = arg;
+	async_slot* slot;
+	const char* text;
+	size_t len = 0;
+	size_t pos;
+	size_t taken = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+	size_t behind;
 
-				if (!SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE), attrs)) {
-					// TODO: error
-					return -1;
-				}
-				res = 0;
+	for (;;) {
+		slot = async_take(q, &pos);
+		if (slot) {
+			text = slot->heap ? slot->heap : slot->text;
+			if (CPRINTF_ASYNC_BATCH - len < slot->len + CPRINTF_ENCODE_MAX) {
+				async_write(q, q->batch, len);
+				len = 0;
+			}
+			if (slot->start != q->shown)
+				len += q->backend->encode_attributes(q->backend->ctx, slot->start, q->batch + len);
+			if (CPRINTF_ASYNC_BATCH - len < slot->len) { // too big to batch
+				async_write(q, q->batch, len);
+				async_write(q, text, slot->len);
+				len = 0;
+			}
+			else {
+				memcpy(q->batch + len, text, slot->len);
+				len += slot->len;
+			}
+			q->shown = slot->end;
+			async_release(q, slot, pos);
+			taken = pos + 1;
+			continue;
+		}
+
+		// caught up, so get the batch out and let cprintf_flush know
+		async_write(q, q->batch, len);
+		len = 0;
+		behind = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed); // includes slots that were dropped
+		atomic_store_explicit(&q->written_pos, behind > taken ? behind : taken, memory_order_release);
+		mtx_lock(&q->lock);
+		cnd_broadcast(&q->done);
+		if (!atomic_load_explicit(&q->running, memory_order_relaxed) && async_empty(q)) {
+			mtx_unlock(&q->lock);
+			break;
+		}
+		atomic_store_explicit(&q->sleeping, true, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (async_empty(q) && atomic_load_explicit(&q->running, memory_order_relaxed))
+			async_wait(&q->wake, &q->lock);
+		atomic_store_explicit(&q->sleeping, false, memory_order_relaxed);
+		mtx_unlock(&q->lock);
+	}
+	return 0;
+}
+
+void free_async(async_queue* q) {
+	mtx_destroy(&q->lock);
+	cnd_destroy(&q->wake);
+	cnd_destroy(&q->done);
+	mem_free(q->slots);
+	mem_free(q->batch);
+	mem_free(q);
+}
+
+/* The output buffer.
+* Everything a call prints is collected here and handed to the backend in as few writes as possible
+* (once at the end of the call, before a color change, or whenever the buffer fills up).
+* Wide text is converted to multibyte on the way in, so the backend only ever sees bytes.
+*
+* Color changes wait here too. A color sequence only changes out->attributes, and the backend doesn't hear
+* about it until there's text to draw in it (or the call ends). That way %[0m%[1;32m costs one change
+* and re-applying the color that's already showing costs nothing.
+*
+* With atomic writes on (see cprintf_set_atomic_writes) the buffer is the thread's line buffer instead of
+* one on the stack. It grows instead of flushing, colors go into it inline if the backend can encode them,
+* and the whole call goes out in one write at the end. Async mode works the same way, except that the end of
+* the call hands the buffer to the writer thread instead of the backend.
+*/
+
+typedef struct cprintf_out {
+	const cprintf_backend* backend;
+	char* data;
+	size_t len;
+	size_t capacity;
+	int error;
+	cprintf_attr_t attributes; // what the next text should be drawn in
+	cprintf_attr_t shown; // what the text at the end of the buffer will be drawn in
+	cprintf_attr_t start; // what we thought the backend was showing when the call started
+	unsigned pending_colors; // color sequences the backend hasn't caught up with
+	bool atomic; // the whole call goes out in one write
+	bool inline_colors; // colors are encoded into the buffer (atomic only)
+	bool locked; // we're holding state_lock for the whole call (atomic without inline colors)
+	async_queue* async; // where the output goes in async mode
+	bool shared; // the output is the terminal everyone prints to (the one current_attributes is about)
+	bool colors; // color sequences do anything (otherwise they're dropped)
+	cprintf_attr_t reset; // what %[0m goes back to
+	unsigned char mark; // the backend's mark byte, which text has to double (0 if it doesn't have one)
+	scratch_arena* arena; // the thread's arena (NULL if there's no memory for one)
+#if defined(CPRINTF_STATS)
+	stats_shard* stats; // the thread's shard (NULL if it couldn't get one)
+	uint64_t started; // when the call started, in ns
+#endif
+	char small[CPRINTF_OUT_SIZE];
+} cprintf_out;
+
+#if defined(CPRINTF_STATS)
+
+void stats_begin(cprintf_out* out) {
+	out->stats = stats_shard_get();
+	out->started = stats_now();
+}
+
+// the call's done, so it counts, and so does how long it took
+void stats_end(const cprintf_out* out) {
+	uint64_t now = stats_now();
+	uint64_t took = now > out->started ? now - out->started : 0; // (the clock can be set back)
+	stats_shard* shard = out->stats;
+
+	if (!shard)
+		return;
+	stats_add(&shard->calls, 1);
+	stats_add(&shard->latency_sum_ns, took);
+	stats_add(&shard->latency[stats_bucket(took)], 1);
+	if (took > atomic_load_explicit(&shard->latency_max_ns, memory_order_relaxed))
+		atomic_store_explicit(&shard->latency_max_ns, took, memory_order_relaxed);
+}
+
+void stats_write(const cprintf_out* out, size_t len) {
+	if (!out->stats)
+		return;
+	stats_add(&out->stats->writes, 1);
+	stats_add(&out->stats->bytes, len);
+}
+
+void stats_conversion(const cprintf_out* out, unsigned char c) {
+	int type = conversion_type(c);
+	if (out->stats && type >= 0)
+		stats_add(&out->stats->conversions[type], 1);
+}
+
+void stats_color(const cprintf_out* out) {
+	if (out->stats)
+		stats_add(&out->stats->color_sequences, 1);
+}
+
+#endif
+
+// A thread's buffer for atomic writes. The first CPRINTF_ENCODE_MAX bytes are kept free so a color change can
+// be put in front of the line if another thread changed the colors while we were formatting it.
+typedef struct line_buffer {
+	size_t capacity;
+	char data[];
+} line_buffer;
+
+void free_line_buffer(void* buffer) {
+	mem_release(buffer);
+}
+
+/* Gets out ready for a call. sink is NULL for the terminal, otherwise it's where the output goes
+* (a file, a string, a frame...), which starts out in the default colors every time. A sink gets its colors
+* inline if it can encode them, and set_attributes calls (with nobody else to worry about) if it can't.
+*/
+void out_init(cprintf_out* out, const cprintf_backend* sink) {
+	line_buffer* line = NULL;
+
+	out->len = 0;
+	out->error = 0;
+	out->pending_colors = 0;
+	out->locked = false;
+	out->arena = arena_enter();
+	CPRINTF_STAT(stats_begin(out));
+
+	if (sink) {
+		out->backend = sink;
+		out->mark = sink->mark;
+		out->async = NULL;
+		out->atomic = false;
+		out->inline_colors = sink->encode_attributes != NULL;
+		out->shared = false;
+		out->colors = true;
+		out->data = out->small;
+		out->capacity = CPRINTF_OUT_SIZE;
+		out->attributes = out->shown = out->start = out->reset = CPRINTF_DEFAULT_ATTRIBUTES;
+		return;
+	}
+
+	out->backend = cprintf_get_backend();
+	out->mark = out->backend->mark;
+	out->shared = true;
+	out->colors = terminal_color_level() != CPRINTF_COLOR_NONE;
+	out->reset = cprintf_previous_attributes;
+	out->async = atomic_load_explicit(&async_ring, memory_order_acquire);
+	out->atomic = out->async || atomic_load_explicit(&atomic_writes, memory_order_relaxed);
+	out->inline_colors = out->atomic && out->backend->encode_attributes;
+
+	if (out->atomic) {
+		line = tss_get(line_buffer_key);
+		if (!line) {
+			line = mem_grow(NULL, sizeof(line_buffer) + CPRINTF_ENCODE_MAX + CPRINTF_OUT_SIZE);
+			if (line) {
+				line->capacity = CPRINTF_OUT_SIZE;
+				tss_set(line_buffer_key, line);
+			}
+		}
+	}
+	if (line) {
+		out->data = line->data + CPRINTF_ENCODE_MAX;
+		out->capacity = line->capacity;
+	}
+	else { // not atomic (or no memory), so use the stack
+		out->atomic = false;
+		out->inline_colors = out->async != NULL;
+		out->data = out->small;
+		out->capacity = CPRINTF_OUT_SIZE;
+	}
+
+	if (out->atomic && !out->inline_colors) { // the only way to keep the colors straight is to hold everyone else off
+		mtx_lock(&state_lock);
+		out->locked = true;
+	}
+	out->attributes = out->shown = out->start = current_attributes;
+}
+
+// Hands bytes over to the backend, or to the writer thread in async mode
+void out_send(cprintf_out* out, const char* bytes, size_t len) {
+	CPRINTF_STAT(stats_write(out, len));
+	if (out->async) {
+		if (!async_push(out->async, bytes, len, out->start, out->shown))
+			out->error = -1;
+		if (out->shown != out->start)
+			current_attributes = out->shown;
+	}
+	else if (out->backend->write(out->backend->ctx, bytes, len) < 0) {
+		out->error = -1;
+	}
+	if (out->inline_colors) // whatever comes next starts in the colors this left behind
+		out->start = out->shown;
+}
+
+void out_flush(cprintf_out* out) {
+	if (out->len == 0)
+		return;
+	out_send(out, out->data, out->len);
+	out->len = 0;
+}
+
+// Doubles the thread's line buffer until n more bytes fit
+bool out_grow(cprintf_out* out, size_t n) {
+	line_buffer* line = tss_get(line_buffer_key);
+	size_t capacity = out->capacity;
+	while (capacity - out->len < n) {
+		if (capacity > SIZE_MAX / 4)
+			return false;
+		capacity *= 2;
+	}
+	line = mem_grow(line, sizeof(line_buffer) + CPRINTF_ENCODE_MAX + capacity);
+	if (!line)
+		return false;
+	line->capacity = capacity;
+	tss_set(line_buffer_key, line);
+	out->data = line->data + CPRINTF_ENCODE_MAX;
+	out->capacity = capacity;
+	return true;
+}
+
+// Gives back what a big call made the thread's line buffer grow to past CPRINTF_SCRATCH_KEEP
+void shrink_line_buffer(void) {
+	line_buffer* line = tss_get(line_buffer_key);
+	if (!line || line->capacity <= CPRINTF_SCRATCH_KEEP)
+		return;
+	line = mem_grow(line, sizeof(line_buffer) + CPRINTF_ENCODE_MAX + CPRINTF_SCRATCH_KEEP);
+	if (!line) // (the old one's still there then)
+		return;
+	line->capacity = CPRINTF_SCRATCH_KEEP;
+	tss_set(line_buffer_key, line);
+}
+
+// Makes room for n more bytes. Returns false if that's more than the buffer can ever hold.
+bool out_reserve(cprintf_out* out, size_t n) {
+	if (out->capacity - out->len >= n)
+		return true;
+	if (out->atomic && out_grow(out, n))
+		return true;
+	out_flush(out);
+	return out->capacity >= n;
+}
+
+// Catches the backend up with the color sequences we've been holding on to
+void out_sync(cprintf_out* out) {
+	if (out->pending_colors == 0)
+		return;
+	if (out->attributes == out->shown) { // they all cancelled out
+		atomic_fetch_add_explicit(&counter_set_elided, out->pending_colors, memory_order_relaxed);
+	}
+	else if (out->inline_colors && out_reserve(out, CPRINTF_ENCODE_MAX)) {
+		atomic_fetch_add_explicit(&counter_set_calls, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&counter_set_elided, out->pending_colors - 1, memory_order_relaxed);
+		out->len += out->backend->encode_attributes(out->backend->ctx, out->attributes, out->data + out->len);
+		out->shown = out->attributes;
+	}
+	else {
+		out_flush(out); // the text before this has to come out in the old colors
+		atomic_fetch_add_explicit(&counter_set_calls, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&counter_set_elided, out->pending_colors - 1, memory_order_relaxed);
+		if (out->shared && !out->locked)
+			mtx_lock(&state_lock);
+		if (out->backend->set_attributes(out->backend->ctx, out->attributes) < 0) {
+			out->error = -1;
+		}
+		else {
+			if (out->shared)
+				current_attributes = out->attributes;
+			out->shown = out->attributes;
+		}
+		if (out->shared && !out->locked)
+			mtx_unlock(&state_lock);
+	}
+	out->pending_colors = 0;
+}
+
+// The end of the call: hands over what's left and lets go of everything
+void out_close(cprintf_out* out) {
+	out_sync(out); // colors at the very end still have to stick for whatever gets printed next
+
+	if (out->async || !out->shared) { // the writer thread keeps the colors straight (and nobody else uses a sink)
+		out_flush(out);
+	}
+	else if (out->inline_colors) {
+		mtx_lock(&state_lock);
+		if (current_attributes != out->start && out->len > 0) {
+			// someone else changed the colors since we started, so put ours back first (that's what the room in
+			// front of the line is for)
+			char seq[CPRINTF_ENCODE_MAX];
+			size_t size = out->backend->encode_attributes(out->backend->ctx, out->start, seq);
+			out->data -= size;
+			out->len += size;
+			memcpy(out->data, seq, size);
+			out_flush(out);
+			out->data += size;
+		}
+		else {
+			out_flush(out);
+		}
+		if (out->shown != out->start || current_attributes != out->start)
+			current_attributes = out->shown;
+		mtx_unlock(&state_lock);
+	}
+	else {
+		out_flush(out);
+		if (out->locked) {
+			mtx_unlock(&state_lock);
+			out->locked = false;
+		}
+	}
+	CPRINTF_STAT(stats_end(out)); // (after the flush, since handing the output over is part of how long it took)
+	if (out->atomic && out->capacity > CPRINTF_SCRATCH_KEEP && out->arena && out->arena->depth == 1)
+		shrink_line_buffer(); // (only the outermost call, anything else is still using it)
+	arena_leave(out->arena);
+}
+
+// Puts text in the buffer as it is
+void out_put(cprintf_out* out, const char* bytes, size_t len) {
+	if (!out_reserve(out, len)) { // no point copying something this big, send it straight through
+		out_send(out, bytes, len);
+		return;
+	}
+	memcpy(out->data + out->len, bytes, len);
+	out->len += len;
+}
+
+void out_write(cprintf_out* out, const char* bytes, size_t len) {
+	const char* mark;
+
+	if (len == 0)
+		return;
+	if (out->pending_colors)
+		out_sync(out);
+	// the backend's mark byte goes in twice (both in one write), so it can't be taken for the start of a color
+	while (out->mark && (mark = memchr(bytes, out->mark, len)) != NULL) {
+		char twice[2] = { (char) out->mark, (char) out->mark };
+		out_put(out, bytes, (size_t) (mark - bytes));
+		out_put(out, twice, 2);
+		len -= (size_t) (mark + 1 - bytes);
+		bytes = mark + 1;
+	}
+	out_put(out, bytes, len);
+}
+
+// Goes back over what printf put straight into the buffer from start on, in case it needs the mark byte doubled
+void out_escape(cprintf_out* out, size_t start) {
+	size_t len = out->len - start;
+	char* copy;
+
+	if (!out->mark || !memchr(out->data + start, out->mark, len))
+		return;
+	copy = scratch_alloc(out->arena, len);
+	if (!copy) {
+		out->error = -1;
+		return;
+	}
+	memcpy(copy, out->data + start, len);
+	out->len = start;
+	out_write(out, copy, len);
+}
+
+// printf straight into the output buffer. Returns what printf would.
+int out_printf(cprintf_out* out, const char* spec, ...) {
+	va_list arg;
+	int res;
+	size_t space;
+
+	if (out->pending_colors)
+		out_sync(out);
+	space = out->capacity - out->len;
+
+	va_start(arg, spec);
+	res = vsnprintf(out->data + out->len, space, spec, arg);
+	va_end(arg);
+	if (res < 0 || (size_t) res < space) {
+		if (res > 0) {
+			out->len += res;
+			out_escape(out, out->len - res);
+		}
+		return res;
+	}
+
+	// didn't fit, so make room and try again
+	va_start(arg, spec);
+	if (out_reserve(out, (size_t) res + 1)) {
+		vsnprintf(out->data + out->len, out->capacity - out->len, spec, arg);
+		out->len += res;
+		out_escape(out, out->len - res);
+	}
+	else { // bigger than the whole buffer
+		char* tmp = scratch_alloc(out->arena, (size_t) res + 1);
+		if (tmp) {
+			vsnprintf(tmp, (size_t) res + 1, spec, arg);
+			out_write(out, tmp, res);
+		}
+		else {
+			res = -1;
+		}
+	}
+	va_end(arg);
+	return res;
+}
+
+/* The scanning section.
+* Literal text is by far most of a format, so finding the next % is the hot loop. On x86 we look at 16 (SSE2)
+* or 32 (AVX2) bytes at a time, picked once at run time based on what the CPU can do. Everywhere else we
+* fall back to strcspn/wcscspn.
+*
+* The vector versions read whole aligned blocks, which can start before the string and end after its
+* terminator. Aligned blocks never cross a page, so that can't fault, but the address sanitizer doesn't
+* know that, hence CPRINTF_NO_SANITIZE.
+*/
+
+#if defined(CPRINTF_SIMD) || defined(CPRINTF_AVX2_TARGET) || defined(CPRINTF_NO_SANITIZE)
+#error Macro clash!
+#endif
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CPRINTF_SIMD 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#else
+#define CPRINTF_SIMD 0
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define CPRINTF_AVX2_TARGET __attribute__((target("avx2")))
+#define CPRINTF_NO_SANITIZE __attribute__((no_sanitize_address))
+#else
+#define CPRINTF_AVX2_TARGET
+#define CPRINTF_NO_SANITIZE
+#endif
+
+// what each character can be in a sequence
+enum {
+	CPRINTF_CLASS_ENDING = 1, // ends a sequence: a conversion, the m of a color, or a space (unfinished)
+	CPRINTF_CLASS_LENGTH = 2 // a length modifier
+};
+
+static const unsigned char char_class[256] = {
+	['d'] = CPRINTF_CLASS_ENDING, ['i'] = CPRINTF_CLASS_ENDING, ['u'] = CPRINTF_CLASS_ENDING,
+	['o'] = CPRINTF_CLASS_ENDING, ['x'] = CPRINTF_CLASS_ENDING, ['X'] = CPRINTF_CLASS_ENDING,
+	['f'] = CPRINTF_CLASS_ENDING, ['F'] = CPRINTF_CLASS_ENDING, ['e'] = CPRINTF_CLASS_ENDING,
+	['E'] = CPRINTF_CLASS_ENDING, ['g'] = CPRINTF_CLASS_ENDING, ['G'] = CPRINTF_CLASS_ENDING,
+	['a'] = CPRINTF_CLASS_ENDING, ['A'] = CPRINTF_CLASS_ENDING, ['c'] = CPRINTF_CLASS_ENDING,
+	['s'] = CPRINTF_CLASS_ENDING, ['p'] = CPRINTF_CLASS_ENDING, ['n'] = CPRINTF_CLASS_ENDING,
+	[' '] = CPRINTF_CLASS_ENDING, ['m'] = CPRINTF_CLASS_ENDING,
+
+	['h'] = CPRINTF_CLASS_LENGTH, ['l'] = CPRINTF_CLASS_LENGTH, ['j'] = CPRINTF_CLASS_LENGTH,
+	['z'] = CPRINTF_CLASS_LENGTH, ['t'] = CPRINTF_CLASS_LENGTH, ['L'] = CPRINTF_CLASS_LENGTH
+};
+
+#if defined(CPRINTF_CLASS_OF)
+#error Macro clash!
+#endif
+// the class of a char or wchar_t (anything past 255 is never part of a sequence)
+#define CPRINTF_CLASS_OF(c) ((unsigned long) (c) < 256 ? char_class[(unsigned long) (c)] : 0)
+
+const char* scalar_find_percent(const char* ptr) {
+	return ptr + strcspn(ptr, "%");
+}
+const wchar_t* wscalar_find_percent(const wchar_t* ptr) {
+	return ptr + wcscspn(ptr, L"%");
+}
+
+#if CPRINTF_SIMD
+
+unsigned int lowest_bit(unsigned int mask) {
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (unsigned int) index;
+#else
+	return (unsigned int) __builtin_ctz(mask);
+#endif
+}
+
+CPRINTF_NO_SANITIZE
+const char* sse2_find_percent(const char* ptr) {
+	const __m128i percent = _mm_set1_epi8('%');
+	const __m128i zero = _mm_setzero_si128();
+	size_t skip = (uintptr_t) ptr & 15; // bytes of the first block that come before ptr
+	const __m128i* block = (const __m128i*) (ptr - skip);
+	__m128i chunk = _mm_load_si128(block);
+	unsigned int mask = (unsigned int) _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, percent), _mm_cmpeq_epi8(chunk, zero)));
+
+	mask >>= skip;
+	if (mask)
+		return ptr + lowest_bit(mask);
+	for (;;) {
+		chunk = _mm_load_si128(++block);
+		mask = (unsigned int) _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, percent), _mm_cmpeq_epi8(chunk, zero)));
+		if (mask)
+			return (const char*) block + lowest_bit(mask);
+	}
+}
+
+CPRINTF_AVX2_TARGET CPRINTF_NO_SANITIZE
+const char* avx2_find_percent(const char* ptr) {
+	const __m256i percent = _mm256_set1_epi8('%');
+	const __m256i zero = _mm256_setzero_si256();
+	size_t skip = (uintptr_t) ptr & 31; // bytes of the first block that come before ptr
+	const __m256i* block = (const __m256i*) (ptr - skip);
+	__m256i chunk = _mm256_load_si256(block);
+	unsigned int mask = (unsigned int) _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, percent), _mm256_cmpeq_epi8(chunk, zero)));
+
+	mask >>= skip;
+	if (mask)
+		return ptr + lowest_bit(mask);
+	for (;;) {
+		chunk = _mm256_load_si256(++block);
+		mask = (unsigned int) _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, percent), _mm256_cmpeq_epi8(chunk, zero)));
+		if (mask)
+			return (const char*) block + lowest_bit(mask);
+	}
+}
+
+/* The wide versions compare 16 bit (Windows) or 32 bit (everywhere else) lanes, so a 16 byte block is 8 or 4
+* characters. movemask still hands back one bit per byte, so the index gets divided by the character size.
+*/
+
+CPRINTF_NO_SANITIZE
+__m128i wsse2_matches(__m128i chunk) {
+	if (sizeof(wchar_t) == 2)
+		return _mm_or_si128(_mm_cmpeq_epi16(chunk, _mm_set1_epi16(L'%')), _mm_cmpeq_epi16(chunk, _mm_setzero_si128()));
+	return _mm_or_si128(_mm_cmpeq_epi32(chunk, _mm_set1_epi32(L'%')), _mm_cmpeq_epi32(chunk, _mm_setzero_si128()));
+}
+
+CPRINTF_NO_SANITIZE
+const wchar_t* wsse2_find_percent(const wchar_t* ptr) {
+	size_t skip = (uintptr_t) ptr & 15;
+	const __m128i* block;
+	unsigned int mask;
+
+	if (skip % sizeof(wchar_t)) // not even lined up on a character, don't bother
+		return wscalar_find_percent(ptr);
+
+	block = (const __m128i*) ((const char*) ptr - skip);
+	mask = (unsigned int) _mm_movemask_epi8(wsse2_matches(_mm_load_si128(block))) >> skip;
+	if (mask)
+		return ptr + lowest_bit(mask) / sizeof(wchar_t);
+	for (;;) {
+		mask = (unsigned int) _mm_movemask_epi8(wsse2_matches(_mm_load_si128(++block)));
+		if (mask)
+			return (const wchar_t*) block + lowest_bit(mask) / sizeof(wchar_t);
+	}
+}
+
+CPRINTF_AVX2_TARGET CPRINTF_NO_SANITIZE
+__m256i wavx2_matches(__m256i chunk) {
+	if (sizeof(wchar_t) == 2)
+		return _mm256_or_si256(_mm256_cmpeq_epi16(chunk, _mm256_set1_epi16(L'%')), _mm256_cmpeq_epi16(chunk, _mm256_setzero_si256()));
+	return _mm256_or_si256(_mm256_cmpeq_epi32(chunk, _mm256_set1_epi32(L'%')), _mm256_cmpeq_epi32(chunk, _mm256_setzero_si256()));
+}
+
+CPRINTF_AVX2_TARGET CPRINTF_NO_SANITIZE
+const wchar_t* wavx2_find_percent(const wchar_t* ptr) {
+	size_t skip = (uintptr_t) ptr & 31;
+	const __m256i* block;
+	unsigned int mask;
+
+	if (skip % sizeof(wchar_t)) // not even lined up on a character, don't bother
+		return wscalar_find_percent(ptr);
+
+	block = (const __m256i*) ((const char*) ptr - skip);
+	mask = (unsigned int) _mm256_movemask_epi8(wavx2_matches(_mm256_load_si256(block))) >> skip;
+	if (mask)
+		return ptr + lowest_bit(mask) / sizeof(wchar_t);
+	for (;;) {
+		mask = (unsigned int) _mm256_movemask_epi8(wavx2_matches(_mm256_load_si256(++block)));
+		if (mask)
+			return (const wchar_t*) block + lowest_bit(mask) / sizeof(wchar_t);
+	}
+}
+
+bool cpu_has_avx2(void) {
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	__cpuid(info, 1);
+	if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28))) // OSXSAVE and AVX
+		return false;
+	if ((_xgetbv(0) & 6) != 6) // the OS saves the ymm registers
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif // CPRINTF_SIMD
+
+/* find_percent returns the next % at or after ptr, or the terminator if there isn't one.
+* startup() picks the best version for this CPU once and every call after goes straight to it (unless
+* cprintf_set_scanner says otherwise).
+*/
+
+typedef const char* (*find_percent_fn)(const char*);
+typedef const wchar_t* (*wfind_percent_fn)(const wchar_t*);
+
+static find_percent_fn find_percent_impl = scalar_find_percent;
+static wfind_percent_fn wfind_percent_impl = wscalar_find_percent;
+
+void pick_find_percent(void) {
+#if CPRINTF_SIMD
+	bool avx2 = cpu_has_avx2();
+	find_percent_impl = avx2 ? avx2_find_percent : sse2_find_percent;
+	wfind_percent_impl = avx2 ? wavx2_find_percent : wsse2_find_percent;
+#endif
+}
+
+const char* find_percent(const char* ptr) {
+	return find_percent_impl(ptr);
+}
+const wchar_t* wfind_percent(const wchar_t* ptr) {
+	return wfind_percent_impl(ptr);
+}
+
+// ======================
+// UTF-8
+// ======================
+
+/* Wide text (wchar_t formats, and %ls/%lc in any format) always comes out as UTF-8, whatever the locale is.
+* wchar_t is UTF-16 on Windows and UTF-32 everywhere else. Most text is ASCII, so on x86 we check 8 wchar_ts at a
+* time and squash them down to bytes in one go, and only go character by character when we hit one that isn't.
+*/
+
+#if defined(CPRINTF_UTF8_MAX) || defined(CPRINTF_UTF16)
+#error Macro clash!
+#endif
+// the most bytes one character can take
+#define CPRINTF_UTF8_MAX 4
+// whether wchar_t is UTF-16 (surrogate pairs and all)
+#define CPRINTF_UTF16 (WCHAR_MAX <= 0xFFFF)
+
+/* Reads the character at wstr[*pIndex] and moves past it. On UTF-16 a surrogate pair is one character, as long
+* as its second half is before len. Anything that isn't a character comes back as U+FFFD.
+*/
+uint32_t wide_next(const wchar_t* wstr, size_t len, size_t* pIndex) {
+	uint32_t c = (uint32_t) wstr[(*pIndex)++];
+#if CPRINTF_UTF16
+	if (c >= 0xD800 && c < 0xDC00 && *pIndex < len) {
+		uint32_t low = (uint32_t) wstr[*pIndex];
+		if (low >= 0xDC00 && low < 0xE000) {
+			++*pIndex;
+			return 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+		}
+	}
+#else
+	(void) len;
+#endif
+	if ((c >= 0xD800 && c < 0xE000) || c > 0x10FFFF)
+		return 0xFFFD;
+	return c;
+}
+
+size_t utf8_length(uint32_t c) {
+	return c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+}
+
+// Writes c as UTF-8 and returns how many bytes that took
+size_t utf8_put(char* dst, uint32_t c) {
+	if (c < 0x80) {
+		dst[0] = (char) c;
+		return 1;
+	}
+	if (c < 0x800) {
+		dst[0] = (char) (0xC0 | (c >> 6));
+		dst[1] = (char) (0x80 | (c & 0x3F));
+		return 2;
+	}
+	if (c < 0x10000) {
+		dst[0] = (char) (0xE0 | (c >> 12));
+		dst[1] = (char) (0x80 | ((c >> 6) & 0x3F));
+		dst[2] = (char) (0x80 | (c & 0x3F));
+		return 3;
+	}
+	dst[0] = (char) (0xF0 | (c >> 18));
+	dst[1] = (char) (0x80 | ((c >> 12) & 0x3F));
+	dst[2] = (char) (0x80 | ((c >> 6) & 0x3F));
+	dst[3] = (char) (0x80 | (c & 0x3F));
+	return 4;
+}
+
+#if CPRINTF_SIMD
+// Copies the ASCII at the start of wstr (up to count wchar_ts) to dst as bytes, 8 at a time. Returns how many it did.
+size_t sse2_ascii_run(char* dst, const wchar_t* wstr, size_t count) {
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+#if CPRINTF_UTF16
+	const __m128i high = _mm_set1_epi16((short) ~0x7F);
+	for (; i + 8 <= count; i += 8) {
+		__m128i units = _mm_loadu_si128((const __m128i*) (wstr + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, high), zero)) != 0xFFFF)
+			break;
+		_mm_storel_epi64((__m128i*) (dst + i), _mm_packus_epi16(units, zero));
+	}
+#else
+	const __m128i high = _mm_set1_epi32(~0x7F);
+	for (; i + 8 <= count; i += 8) {
+		__m128i lo = _mm_loadu_si128((const __m128i*) (wstr + i));
+		__m128i hi = _mm_loadu_si128((const __m128i*) (wstr + i + 4));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(_mm_or_si128(lo, hi), high), zero)) != 0xFFFF)
+			break;
+		// everything is under 0x80 by now, so neither pack can saturate
+		_mm_storel_epi64((__m128i*) (dst + i), _mm_packus_epi16(_mm_packs_epi32(lo, hi), zero));
+	}
+#endif
+	return i;
+}
+#endif // CPRINTF_SIMD
+
+/* Turns as much of wstr as fits in room bytes into UTF-8 at dst, without cutting a character in half.
+* Returns how many wchar_ts it used and puts how many bytes they made in *pBytes.
+*/
+size_t utf8_from_wide(char* dst, size_t room, const wchar_t* wstr, size_t len, size_t* pBytes) {
+	size_t i = 0;
+	size_t n = 0;
+	size_t next;
+	uint32_t c;
+
+	while (i < len) {
+#if CPRINTF_SIMD
+		if ((uint32_t) wstr[i] < 0x80) {
+			size_t run = sse2_ascii_run(dst + n, wstr + i, CPRINTF_MIN(len - i, room - n));
+			i += run;
+			n += run;
+			if (i == len)
+				break;
+		}
+#endif
+		next = i;
+		c = wide_next(wstr, len, &next);
+		if (room - n < utf8_length(c))
+			break;
+		n += utf8_put(dst + n, c);
+		i = next;
+	}
+	*pBytes = n;
+	return i;
+}
+
+/* How many bytes of UTF-8 wstr makes, stopping at its terminator or before going past limit bytes (without
+* cutting a character in half). Puts how many wchar_ts that was in *pLen.
+*/
+size_t utf8_measure(const wchar_t* wstr, size_t limit, size_t* pLen) {
+	size_t i = 0;
+	size_t bytes = 0;
+	size_t next;
+	size_t size;
+
+	while (wstr[i] != L'\0') {
+		next = i;
+		size = utf8_length(wide_next(wstr, SIZE_MAX, &next));
+		if (size > limit - bytes)
+			break;
+		bytes += size;
+		i = next;
+	}
+	*pLen = i;
+	return bytes;
+}
+
+/* How many bytes of the UTF-8 in str make at most limit wchar_ts, stopping at its terminator. Puts how many
+* wchar_ts that was in *pUnits. A byte that isn't part of a character counts as one.
+*/
+size_t utf8_span(const char* str, size_t limit, size_t* pUnits) {
+	size_t i = 0;
+	size_t units = 0;
+	size_t size;
+	size_t width;
+	unsigned char lead;
+
+	while (str[i] != '\0') {
+		lead = (unsigned char) str[i];
+		width = CPRINTF_UTF16 && lead >= 0xF0 ? 2 : 1; // past U+FFFF takes a surrogate pair
+		if (width > limit - units)
+			break;
+		size = lead < 0xC0 ? 1 : lead < 0xE0 ? 2 : lead < 0xF0 ? 3 : 4;
+		for (++i; --size > 0 && ((unsigned char) str[i] & 0xC0) == 0x80; ++i)
+			;
+		units += width;
+	}
+	*pUnits = units;
+	return i;
+}
+
+/* Reads one character from the len bytes at str into *pChar and returns how many bytes it took, or 0 if str ends
+* partway through one. Anything that isn't a real character reads as U+FFFD (a stray byte by itself).
+*/
+size_t utf8_next(const unsigned char* str, size_t len, uint32_t* pChar) {
+	uint32_t c = str[0];
+	uint32_t least;
+	size_t size;
+
+	*pChar = 0xFFFD;
+	if (c < 0x80) {
+		*pChar = c;
+		return 1;
+	}
+	if (c >= 0xC2 && c <= 0xDF) {
+		size = 2;
+		c &= 0x1F;
+		least = 0x80;
+	}
+	else if (c >= 0xE0 && c <= 0xEF) {
+		size = 3;
+		c &= 0x0F;
+		least = 0x800;
+	}
+	else if (c >= 0xF0 && c <= 0xF4) {
+		size = 4;
+		c &= 0x07;
+		least = 0x10000;
+	}
+	else {
+		return 1;
+	}
+	for (size_t i = 1; i < size; ++i) {
+		if (i >= len)
+			return 0;
+		if ((str[i] & 0xC0) != 0x80)
+			return 1;
+		c = c << 6 | (str[i] & 0x3F);
+	}
+	if (c >= least && c <= 0x10FFFF && (c < 0xD800 || c > 0xDFFF)) // not too long, too big or a surrogate
+		*pChar = c;
+	return size;
+}
+
+// Writes wide text as UTF-8. Returns how many bytes that came to.
+size_t wout_write(cprintf_out* out, const wchar_t* wstr, size_t len) {
+	size_t total = 0;
+	size_t used;
+	size_t bytes;
+
+	if (len == 0)
+		return 0;
+	if (out->pending_colors)
+		out_sync(out);
+	while (len > 0) {
+		if (!out_reserve(out, CPRINTF_UTF8_MAX)) { // so there's always room for at least one more character
+			out->error = -1;
+			break;
+		}
+		used = utf8_from_wide(out->data + out->len, out->capacity - out->len, wstr, len, &bytes);
+		out->len += bytes;
+		total += bytes;
+		wstr += used;
+		len -= used;
+	}
+	return total;
+}
+
+// wprintf into the output buffer. Returns what wprintf would.
+int wout_printf(cprintf_out* out, const wchar_t* spec, ...) {
+	va_list arg;
+	int res;
+	wchar_t small[256];
+	wchar_t* tmp = small;
+	size_t size = sizeof(small) / sizeof(small[0]);
+
+	// swprintf can't tell us how much room it needs, so keep doubling until it fits. It fails the same way for
+	// something it can't convert (a %s or %c that isn't a character), but that says EILSEQ and won't get better.
+	for (;;) {
+		va_start(arg, spec);
+		errno = 0;
+		res = vswprintf(tmp, size, spec, arg);
+		va_end(arg);
+		if (res >= 0 || errno == EILSEQ || size >= (1u << 24))
+			break;
+		size *= 2;
+		tmp = scratch_alloc(out->arena, size * sizeof(wchar_t)); // (the smaller tries go back with the rest of the arena)
+		if (!tmp)
+			return -1;
+	}
+	if (res > 0)
+		wout_write(out, tmp, res);
+	return res;
+}
+
+// ======================
+// startup
+// ======================
+
+void init_library(void) {
+	mtx_init(&state_lock, mtx_plain);
+	tss_create(&line_buffer_key, free_line_buffer);
+	tss_create(&call_key, mem_release);
+#if defined(CPRINTF_STATS)
+	tss_create(&stats_key, stats_release);
+#endif
+	pick_find_percent();
+	detected_level = cprintf_detect_color_level();
+}
+
+// Every entry point goes through here first
+void startup(void) {
+	call_once(&init_flag, init_library);
+}
+
+// startup(), plus reading what the backend is showing if we haven't yet
+void startup_previous(void) {
+	startup();
+	if (atomic_load_explicit(&previous_ready, memory_order_acquire) && cprintf_set_previous)
+		return;
+	if (terminal_color_level() == CPRINTF_COLOR_NONE) // we'll never change the colors, so don't ask about them
+		return;
+	mtx_lock(&state_lock);
+	if (!cprintf_set_previous)
+		set_previous();
+	atomic_store_explicit(&previous_ready, true, memory_order_release);
+	mtx_unlock(&state_lock);
+}
+
+// What a call has to do before out_init. Sinks don't care what the terminal is showing.
+void startup_for(const cprintf_backend* sink) {
+	if (sink)
+		startup();
+	else
+		startup_previous();
+}
+
+void cprintf_set_color_level(cprintf_color_level level) {
+	atomic_store_explicit(&forced_level, (int) level, memory_order_relaxed);
+}
+
+cprintf_color_level cprintf_get_color_level(void) {
+	startup();
+	return terminal_color_level();
+}
+
+int cprintf_set_scanner(cprintf_scanner scanner) {
+	startup(); // or the first call would pick one over the top of it
+	switch (scanner) {
+		case CPRINTF_SCANNER_AUTO:
+			pick_find_percent();
+			return 0;
+		case CPRINTF_SCANNER_SCALAR:
+			find_percent_impl = scalar_find_percent;
+			wfind_percent_impl = wscalar_find_percent;
+			return 0;
+#if CPRINTF_SIMD
+		case CPRINTF_SCANNER_SSE2:
+			find_percent_impl = sse2_find_percent;
+			wfind_percent_impl = wsse2_find_percent;
+			return 0;
+		case CPRINTF_SCANNER_AVX2:
+			if (!cpu_has_avx2())
+				return -1;
+			find_percent_impl = avx2_find_percent;
+			wfind_percent_impl = wavx2_find_percent;
+			return 0;
+#endif
+		default:
+			return -1;
+	}
+}
+
+void cprintf_set_atomic_writes(bool enabled) {
+	atomic_store_explicit(&atomic_writes, enabled, memory_order_relaxed);
+}
+
+int cprintf_start_async(size_t slots, cprintf_overflow overflow) {
+	static bool stop_at_exit = false;
+	const cprintf_backend* backend;
+	async_queue* q;
+	size_t count = 2;
+
+	startup_previous();
+	backend = cprintf_get_backend();
+	if (!backend->encode_attributes) // the writer has to be able to put colors in the text
+		return -1;
+	while (count < slots) {
+		if (count > SIZE_MAX / 2 / sizeof(async_slot))
+			return -1;
+		count *= 2;
+	}
+
+	q = mem_calloc(sizeof(async_queue));
+	if (!q)
+		return -1;
+	q->slots = mem_alloc(count * sizeof(async_slot));
+	q->batch = mem_alloc(CPRINTF_ASYNC_BATCH);
+	if (!q->slots || !q->batch) {
+		mem_free(q->slots);
+		mem_free(q->batch);
+		mem_free(q);
+		return -1;
+	}
+	for (size_t i = 0; i < count; ++i) {
+		atomic_init(&q->slots[i].sequence, i);
+		q->slots[i].heap = NULL;
+	}
+	q->backend = backend;
+	q->overflow = overflow;
+	q->mask = count - 1;
+	mtx_init(&q->lock, mtx_plain);
+	cnd_init(&q->wake);
+	cnd_init(&q->done);
+	atomic_init(&q->running, true);
+
+	mtx_lock(&state_lock);
+	q->shown = current_attributes;
+	if (atomic_load_explicit(&async_ring, memory_order_relaxed) || thrd_create(&q->writer, async_writer, q) != thrd_success) {
+		mtx_unlock(&state_lock);
+		free_async(q);
+		return -1;
+	}
+	atomic_store_explicit(&async_ring, q, memory_order_release);
+	if (!stop_at_exit) // otherwise whatever's still in the ring is lost when the program ends
+		stop_at_exit = atexit(cprintf_stop_async) == 0;
+	mtx_unlock(&state_lock);
+	return 0;
+}
+
+void cprintf_stop_async(void) {
+	async_queue* q;
+
+	mtx_lock(&state_lock);
+	q = atomic_exchange_explicit(&async_ring, NULL, memory_order_acq_rel);
+	mtx_unlock(&state_lock);
+	if (!q)
+		return;
+
+	atomic_store_explicit(&q->running, false, memory_order_relaxed);
+	mtx_lock(&q->lock);
+	cnd_signal(&q->wake);
+	mtx_unlock(&q->lock);
+	thrd_join(q->writer, NULL);
+
+	current_attributes = q->shown; // dropped slots could have left something else showing
+	free_async(q);
+}
+
+void cprintf_flush(void) {
+	async_queue* q = atomic_load_explicit(&async_ring, memory_order_acquire);
+	size_t target;
+
+	CPRINTF_STAT(stats_flush());
+	if (!q) // everything's written by the time a call returns
+		return;
+	target = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+	mtx_lock(&q->lock);
+	while (atomic_load_explicit(&q->written_pos, memory_order_acquire) < target) {
+		cnd_signal(&q->wake);
+		async_wait(&q->done, &q->lock);
+	}
+	mtx_unlock(&q->lock);
+}
+
+/* The ops section.
+* A format string is read as a list of ops: a run of literal text, a conversion like %5.2f, or a color
+* sequence like %[1;31m. Reading a format into ops (next_op) is kept apart from carrying them out (run_op)
+* so a format can be read once by cprintf_compile and carried out as many times as you want.
+*/
+
+enum {
+	CPRINTF_OP_NONE, // nothing to do (an unfinished or unknown sequence)
+	CPRINTF_OP_LITERAL,
+	CPRINTF_OP_CONVERSION,
+	CPRINTF_OP_COLOR
+};
+
+enum {
+	CPRINTF_LENGTH_NONE,
+	CPRINTF_LENGTH_HH,
+	CPRINTF_LENGTH_H,
+	CPRINTF_LENGTH_L,
+	CPRINTF_LENGTH_LL,
+	CPRINTF_LENGTH_J,
+	CPRINTF_LENGTH_Z,
+	CPRINTF_LENGTH_T,
+	CPRINTF_LENGTH_BIG_L
+};
+
+enum {
+	CPRINTF_FLAG_LEFT = 1, // -
+	CPRINTF_FLAG_PLUS = 2, // +
+	CPRINTF_FLAG_SPACE = 4, // (space)
+	CPRINTF_FLAG_ALT = 8, // #
+	CPRINTF_FLAG_ZERO = 16, // 0
+	CPRINTF_FLAG_STAR_WIDTH = 32, // * (the width comes from an argument)
+	CPRINTF_FLAG_STAR_PRECISION = 64, // .* (and so does the precision)
+	CPRINTF_FLAG_OTHER = 128 // something we couldn't make sense of (so printf gets to deal with it)
+};
+
+typedef struct cprintf_op {
+	unsigned char type; // CPRINTF_OP_*
+	unsigned char conversion; // the ending character of the sequence, like d or s
+	unsigned char length; // CPRINTF_LENGTH_*
+	unsigned char flags; // CPRINTF_FLAG_*
+	bool fast; // whether the fast formatters can handle it without printf
+	unsigned char kind; // CPRINTF_ARG_*, what the conversion takes out of the ...
+	unsigned short arg; // which argument it takes for %2$d (counting from 1), 0 if it doesn't say
+	unsigned char width_arg; // the same for the width's argument (*2$), with CPRINTF_FLAG_STAR_WIDTH
+	unsigned char precision_arg; // and the precision's (.*2$), with CPRINTF_FLAG_STAR_PRECISION
+	int width; // -1 if not given
+	int precision; // -1 if not given
+	size_t start; // where the literal text (or the whole sequence) starts in the format, in chars
+	size_t size; // how long it is, in chars
+	cprintf_color color; // color sequences: what they do to the attributes
+} cprintf_op;
+
+#if defined(CPRINTF_ARGS_MAX)
+#error Macro clash!
+#endif
+// the most arguments a format that numbers them (%2$d) can take
+#define CPRINTF_ARGS_MAX 32
+
+// What type each argument of a format that numbers its arguments is read as, by number, so they can all be
+// read out of the ... before anything's printed
+typedef struct arg_layout {
+	unsigned count; // the highest number it uses (0 if the format doesn't number its arguments)
+	bool broken; // a number's out of range, two conversions read one argument as different types, or one's skipped
+	unsigned char types[CPRINTF_ARGS_MAX]; // CPRINTF_VA_*
+} arg_layout;
+
+struct cprintf_fmt {
+	size_t op_count;
+	cprintf_op* ops;
+	char* text; // our own copy of the format, which the ops point into
+	arg_layout layout; // worked out once here, so printing it doesn't have to look at the whole format first
+	bool deferrable; // whether cprintf_deferred can record it
+	atomic_bool announced; // whether cprintf_deferred has written a format record for it yet
+};
+
+// Works out the length modifier from its character (and the one after it, for hh and ll)
+unsigned char length_modifier(int c, int next) {
+	switch (c) {
+		case 'h':
+			return next == 'h' ? CPRINTF_LENGTH_HH : CPRINTF_LENGTH_H;
+		case 'l':
+			return next == 'l' ? CPRINTF_LENGTH_LL : CPRINTF_LENGTH_L;
+		case 'j':
+			return CPRINTF_LENGTH_J;
+		case 'z':
+			return CPRINTF_LENGTH_Z;
+		case 't':
+			return CPRINTF_LENGTH_T;
+		case 'L':
+			return CPRINTF_LENGTH_BIG_L;
+		default:
+			return CPRINTF_LENGTH_NONE;
+	}
+}
+
+// Whether the conversion character prints a double (or a long double, with L)
+bool is_float_conversion(int c) {
+	switch (c) {
+		case 'f':
+		case 'F':
+		case 'e':
+		case 'E':
+		case 'g':
+		case 'G':
+		case 'a':
+		case 'A':
+			return true;
+		default:
+			return false;
+	}
+}
+
+#if defined(CPRINTF_WIDE_S_IS_CHAR)
+#error Macro clash!
+#endif
+// whether %s in a wchar_t format takes a char string like the standard says (older Windows CRTs want a wchar_t one)
+#if defined(_WIN32) && !defined(_CRT_STDIO_ISO_WIDE_SPECIFIERS)
+#define CPRINTF_WIDE_S_IS_CHAR 0
+#else
+#define CPRINTF_WIDE_S_IS_CHAR 1
+#endif
+
+#if defined(CPRINTF_FLOAT_PRECISION_MAX)
+#error Macro clash!
+#endif
+// the longest precision the fast formatters do floats with (anything past 15 digits comes from printf anyway)
+#define CPRINTF_FLOAT_PRECISION_MAX 40
+
+// Whether the fast formatters below know how to do everything this sequence asks for
+bool can_go_fast(const cprintf_op* op, bool wide) {
+	if (op->flags & (CPRINTF_FLAG_ALT | CPRINTF_FLAG_OTHER))
+		return false;
+	switch (op->conversion) {
+		case 'd':
+		case 'i':
+		case 'u':
+		case 'o':
+		case 'x':
+		case 'X':
+			return op->precision < 0 && !(op->flags & CPRINTF_FLAG_STAR_PRECISION);
+		case 's':
+		case 'c':
+			if (op->flags & (CPRINTF_FLAG_PLUS | CPRINTF_FLAG_SPACE | CPRINTF_FLAG_ZERO))
+				return false;
+			if (op->length == CPRINTF_LENGTH_L) // we turn those into UTF-8 ourselves
+				return true;
+			if (op->length != CPRINTF_LENGTH_NONE)
+				return false;
+			// a char string in a wchar_t format (%c there is left to the CRT)
+			return !wide || (op->conversion == 's' && CPRINTF_WIDE_S_IS_CHAR);
+		case 'f':
+		case 'F':
+		case 'e':
+		case 'E':
+		case 'g':
+		case 'G': // (out_double still hands the ones it isn't sure about to printf)
+			return (op->length == CPRINTF_LENGTH_NONE || op->length == CPRINTF_LENGTH_L) && op->precision <= CPRINTF_FLOAT_PRECISION_MAX;
+		default:
+			return false;
+	}
+}
+
+// What cprintf_deferred has to record for a conversion
+enum {
+	CPRINTF_ARG_NONE, // can't be recorded (%n, * width, or something run_op wouldn't print either)
+	CPRINTF_ARG_SIGNED,
+	CPRINTF_ARG_UNSIGNED,
+	CPRINTF_ARG_DOUBLE,
+	CPRINTF_ARG_LONG_DOUBLE,
+	CPRINTF_ARG_CHAR,
+	CPRINTF_ARG_WCHAR,
+	CPRINTF_ARG_STRING,
+	CPRINTF_ARG_WSTRING,
+	CPRINTF_ARG_POINTER
+};
+
+// Sorts a conversion the same way run_op picks its va_arg type
+unsigned char deferred_kind(const cprintf_op* op) {
+	// (a record only has room for the conversion's own argument, not a * width or precision's)
+	if (op->flags & (CPRINTF_FLAG_OTHER | CPRINTF_FLAG_STAR_WIDTH | CPRINTF_FLAG_STAR_PRECISION))
+		return CPRINTF_ARG_NONE;
+	switch (op->conversion) {
+		case 'd':
+		case 'i':
+			return CPRINTF_ARG_SIGNED;
+		case 'u':
+		case 'o':
+		case 'x':
+		case 'X':
+			return CPRINTF_ARG_UNSIGNED;
+		case 'f':
+		case 'F':
+		case 'e':
+		case 'E':
+		case 'g':
+		case 'G':
+		case 'a':
+		case 'A':
+			if (op->length == CPRINTF_LENGTH_NONE)
+				return CPRINTF_ARG_DOUBLE;
+			return op->length == CPRINTF_LENGTH_BIG_L ? CPRINTF_ARG_LONG_DOUBLE : CPRINTF_ARG_NONE;
+		case 'c':
+			if (op->length == CPRINTF_LENGTH_NONE)
+				return CPRINTF_ARG_CHAR;
+			return op->length == CPRINTF_LENGTH_L ? CPRINTF_ARG_WCHAR : CPRINTF_ARG_NONE;
+		case 's':
+			if (op->length == CPRINTF_LENGTH_NONE)
+				return CPRINTF_ARG_STRING;
+			return op->length == CPRINTF_LENGTH_L ? CPRINTF_ARG_WSTRING : CPRINTF_ARG_NONE;
+		case 'p':
+			return CPRINTF_ARG_POINTER;
+		default:
+			return CPRINTF_ARG_NONE;
+	}
+}
+
+/* Numbered arguments (%2$d).
+* A format either numbers its arguments or doesn't, and its first conversion is what decides. When it does, the
+* type of every argument is worked out from the whole format first (an arg_layout, which a compiled format keeps)
+* and they're all read out of the ... in one go, before anything's printed, so each conversion can pick its own
+* out by number. A conversion without a number in a format like that takes the argument after the one before it.
+* A format that takes its arguments in order and then numbers one is an error, and so is a broken layout.
+*/
+
+// What va_arg reads an argument as (the same as run_op does)
+enum {
+	CPRINTF_VA_NONE, // nothing reads it
+	CPRINTF_VA_INT,
+	CPRINTF_VA_LONG,
+	CPRINTF_VA_LONG_LONG,
+	CPRINTF_VA_INTMAX,
+	CPRINTF_VA_SIZE,
+	CPRINTF_VA_PTRDIFF,
+	CPRINTF_VA_WINT,
+	CPRINTF_VA_DOUBLE,
+	CPRINTF_VA_LONG_DOUBLE,
+	CPRINTF_VA_POINTER
+};
+
+unsigned char arg_type(const cprintf_op* op) {
+	switch (op->conversion) {
+		case 'd':
+		case 'i':
+		case 'u':
+		case 'o':
+		case 'x':
+		case 'X':
+			switch (op->length) {
+				case CPRINTF_LENGTH_L:
+					return CPRINTF_VA_LONG;
+				case CPRINTF_LENGTH_LL:
+					return CPRINTF_VA_LONG_LONG;
+				case CPRINTF_LENGTH_J:
+					return CPRINTF_VA_INTMAX;
+				case CPRINTF_LENGTH_Z:
+					return CPRINTF_VA_SIZE;
+				case CPRINTF_LENGTH_T:
+					return CPRINTF_VA_PTRDIFF;
+				default:
+					return CPRINTF_VA_INT;
+			}
+		case 'f':
+		case 'F':
+		case 'e':
+		case 'E':
+		case 'g':
+		case 'G':
+		case 'a':
+		case 'A':
+			if (op->length == CPRINTF_LENGTH_NONE)
+				return CPRINTF_VA_DOUBLE;
+			return op->length == CPRINTF_LENGTH_BIG_L ? CPRINTF_VA_LONG_DOUBLE : CPRINTF_VA_NONE;
+		case 'c':
+			if (op->length == CPRINTF_LENGTH_NONE)
+				return CPRINTF_VA_INT;
+			return op->length == CPRINTF_LENGTH_L ? CPRINTF_VA_WINT : CPRINTF_VA_NONE;
+		case 's':
+			return op->length == CPRINTF_LENGTH_NONE || op->length == CPRINTF_LENGTH_L ? CPRINTF_VA_POINTER : CPRINTF_VA_NONE;
+		case 'p':
+			return CPRINTF_VA_POINTER;
+		case 'n':
+			return op->length == CPRINTF_LENGTH_BIG_L ? CPRINTF_VA_NONE : CPRINTF_VA_POINTER;
+		default:
+			return CPRINTF_VA_NONE;
+	}
+}
+
+// One argument, read ahead of time
+typedef union arg_value {
+	intmax_t i; // any integer (and wint_t), as whatever type va_arg read it as
+	double d;
+	long double ld;
+	void* p; // strings, %p and %n
+} arg_value;
+
+// Where a call's arguments come from
+typedef struct cprintf_args {
+	va_list* list;
+	arg_value* values; // all of them, by number, once a format that numbers them has been read (NULL until then)
+	unsigned count; // how many values there are
+	unsigned next; // the number of the argument a conversion without one takes
+	const arg_value* current; // the argument of the conversion being carried out, if it's in values
+} cprintf_args;
+
+#if defined(CPRINTF_ARG)
+#error Macro clash!
+#endif
+// The argument of the conversion being carried out, as type: out of values (where it's in field) if it was read
+// ahead, otherwise the next one out of the ...
+#define CPRINTF_ARG(args, type, field) ((args)->current ? (type) (args)->current->field : va_arg(*(args)->list, type))
+
+void args_init(cprintf_args* args, va_list* list) {
+	args->list = list;
+	args->values = NULL;
+	args->count = 0;
+	args->next = 1;
+	args->current = NULL;
+}
+
+// Says argument number (or *pNext, if it's 0) is read as type
+void layout_put(arg_layout* layout, unsigned* pNext, unsigned number, unsigned char type) {
+	if (!number)
+		number = *pNext;
+	*pNext = number + 1;
+	if (number > CPRINTF_ARGS_MAX) {
+		layout->broken = true;
+		return;
+	}
+	layout->count = CPRINTF_MAX(layout->count, number);
+	if (type == CPRINTF_VA_NONE)
+		return;
+	if (layout->types[number - 1] != CPRINTF_VA_NONE && layout->types[number - 1] != type)
+		layout->broken = true;
+	layout->types[number - 1] = type;
+}
+
+// Adds the arguments op takes to layout: the width's, the precision's, then its own
+void layout_add(arg_layout* layout, unsigned* pNext, const cprintf_op* op) {
+	if (op->flags & CPRINTF_FLAG_STAR_WIDTH)
+		layout_put(layout, pNext, op->width_arg, CPRINTF_VA_INT);
+	if (op->flags & CPRINTF_FLAG_STAR_PRECISION)
+		layout_put(layout, pNext, op->precision_arg, CPRINTF_VA_INT);
+	layout_put(layout, pNext, op->arg, arg_type(op));
+}
+
+// Works out the layout of ops. It's empty if the first conversion doesn't have a number (and broken if a later one does).
+// It's broken too if a number's left out (%1$d %3$d), since nothing says what the one in the gap is.
+void layout_ops(arg_layout* layout, const cprintf_op* ops, size_t op_count) {
+	unsigned next = 1;
+
+	memset(layout, 0, sizeof(*layout));
+	for (size_t i = 0; i < op_count; ++i) {
+		if (ops[i].type != CPRINTF_OP_CONVERSION)
+			continue;
+		if (next == 1 && !ops[i].arg) { // the first conversion doesn't have a number, so none of them can
+			for (; i < op_count; ++i) {
+				if (ops[i].type == CPRINTF_OP_CONVERSION && ops[i].arg)
+					layout->broken = true;
+			}
+			return;
+		}
+		layout_add(layout, &next, &ops[i]);
+	}
+	for (unsigned i = 0; i < layout->count; ++i) {
+		if (layout->types[i] == CPRINTF_VA_NONE)
+			layout->broken = true;
+	}
+}
+
+// Reads everything layout says into values (which has room for layout->count). False if the layout's broken.
+bool args_read(cprintf_args* args, const arg_layout* layout, arg_value* values) {
+	if (layout->broken)
+		return false;
+	for (unsigned i = 0; i < layout->count; ++i) {
+		switch (layout->types[i]) {
+			case CPRINTF_VA_INT:
+				values[i].i = va_arg(*args->list, int);
+				break;
+			case CPRINTF_VA_LONG:
+				values[i].i = va_arg(*args->list, long int);
+				break;
+			case CPRINTF_VA_LONG_LONG:
+				values[i].i = va_arg(*args->list, long long int);
+				break;
+			case CPRINTF_VA_INTMAX:
+				values[i].i = va_arg(*args->list, intmax_t);
+				break;
+			case CPRINTF_VA_SIZE:
+				values[i].i = (intmax_t) va_arg(*args->list, size_t);
+				break;
+			case CPRINTF_VA_PTRDIFF:
+				values[i].i = va_arg(*args->list, ptrdiff_t);
+				break;
+			case CPRINTF_VA_WINT:
+				values[i].i = va_arg(*args->list, wint_t);
+				break;
+			case CPRINTF_VA_DOUBLE:
+				values[i].d = va_arg(*args->list, double);
+				break;
+			case CPRINTF_VA_LONG_DOUBLE:
+				values[i].ld = va_arg(*args->list, long double);
+				break;
+			case CPRINTF_VA_POINTER:
+				values[i].p = va_arg(*args->list, void*);
+				break;
+			default: // nothing says what it is, so there's no way to get past it to the ones after it
+				return false;
+		}
+	}
+	args->values = values;
+	args->count = layout->count;
+	return true;
+}
+
+// Reads the int argument a * takes (number is from *2$, or 0). False if it can't have one.
+bool take_int(cprintf_args* args, unsigned number, int* pValue) {
+	if (!args->values) {
+		if (number)
+			return false;
+		*pValue = va_arg(*args->list, int);
+		args->next++;
+		return true;
+	}
+	if (!number)
+		number = args->next;
+	if (number > args->count)
+		return false;
+	*pValue = (int) args->values[number - 1].i;
+	args->next = number + 1;
+	return true;
+}
+
+// For %*.*d: makes starred a copy of op with the width and precision its arguments say. False if it can't have them.
+bool take_stars(cprintf_args* args, const cprintf_op* op, cprintf_op* starred) {
+	int v;
+
+	*starred = *op;
+	starred->flags &= (unsigned char) ~(CPRINTF_FLAG_STAR_WIDTH | CPRINTF_FLAG_STAR_PRECISION);
+	if (op->flags & CPRINTF_FLAG_STAR_WIDTH) {
+		if (!take_int(args, op->width_arg, &v))
+			return false;
+		if (v < 0) { // a negative width is a - flag
+			starred->flags |= CPRINTF_FLAG_LEFT;
+			v = v == INT_MIN ? INT_MAX : -v;
+		}
+		starred->width = CPRINTF_MIN(v, 1 << 20);
+	}
+	if (op->flags & CPRINTF_FLAG_STAR_PRECISION) {
+		if (!take_int(args, op->precision_arg, &v))
+			return false;
+		starred->precision = v < 0 ? -1 : CPRINTF_MIN(v, 1 << 20); // and a negative precision is none at all
+	}
+	return true;
+}
+
+// Picks the argument op takes. False if it can't have one.
+bool take_arg(cprintf_args* args, const cprintf_op* op) {
+	unsigned number;
+
+	if (!args->values) { // in order, straight out of the ...
+		args->next++;
+		return !op->arg;
+	}
+	number = op->arg ? op->arg : args->next;
+	if (number > args->count)
+		return false;
+	args->current = &args->values[number - 1];
+	args->next = number + 1;
+	return true;
+}
+
+/* The fast formatters.
+* printf has to read the sequence all over again (and some CRTs lock stdout for it), which is a lot of work for
+* a plain %d or %s. These write integers, strings and most floats straight into the output buffer instead.
+* Anything they don't handle (%a, long doubles, precision on integers, #...) still goes to printf. Wide strings
+* and characters (%ls and %lc, or %s in a wchar_t format) are done here too, so they come out as UTF-8 without a
+* trip through the locale.
+*/
+
+static const char digit_pairs[201] =
+	"0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+	"5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+// Writes v in decimal so it ends right before end. Returns where it starts.
+char* format_decimal(char* end, uintmax_t v) {
+	while (v >= 100) {
+		end -= 2;
+		memcpy(end, digit_pairs + (v % 100) * 2, 2);
+		v /= 100;
+	}
+	if (v >= 10) {
+		end -= 2;
+		memcpy(end, digit_pairs + v * 2, 2);
+	}
+	else {
+		*--end = (char) ('0' + v);
+	}
+	return end;
+}
+
+// what goes between the precision and the conversion for each CPRINTF_LENGTH_*
+static const char* const length_names[] = { "", "hh", "h", "l", "ll", "j", "z", "t", "L" };
+
+// Writes op's sequence back out for printf from its fields, with the precision and length modifier given
+// (deferred printing swaps the length for the type its record holds)
+void deferred_spec(char* spec, const cprintf_op* op, int precision, const char* length) {
+	char digits[sizeof(int) * 3];
+	char* end = digits + sizeof(digits);
+	char* start;
+
+	*spec++ = '%';
+	if (op->flags & CPRINTF_FLAG_LEFT)
+		*spec++ = '-';
+	if (op->flags & CPRINTF_FLAG_PLUS)
+		*spec++ = '+';
+	if (op->flags & CPRINTF_FLAG_SPACE)
+		*spec++ = ' ';
+	if (op->flags & CPRINTF_FLAG_ALT)
+		*spec++ = '#';
+	if (op->flags & CPRINTF_FLAG_ZERO)
+		*spec++ = '0';
+	if (op->width >= 0) {
+		start = format_decimal(end, (uintmax_t) op->width);
+		memcpy(spec, start, end - start);
+		spec += end - start;
+	}
+	if (precision >= 0) {
+		*spec++ = '.';
+		start = format_decimal(end, (uintmax_t) precision);
+		memcpy(spec, start, end - start);
+		spec += end - start;
+	}
+	while (*length)
+		*spec++ = *length++;
+	*spec++ = (char) op->conversion;
+	*spec = '\0';
+}
+
+// Same as format_decimal but in base 8 or 16 (shift is 3 or 4)
+char* format_power_of_two(char* end, uintmax_t v, unsigned int shift, bool upper) {
+	const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+	const unsigned int mask = (1u << shift) - 1;
+	do {
+		*--end = digits[v & mask];
+		v >>= shift;
+	} while (v);
+	return end;
+}
+
+// Writes count copies of c
+void out_fill(cprintf_out* out, char c, size_t count) {
+	static const char spaces[32] = "                                ";
+	static const char zeros[32] = "00000000000000000000000000000000";
+	const char* fill = c == '0' ? zeros : spaces;
+	while (count > 0) {
+		size_t chunk = CPRINTF_MIN(count, sizeof(spaces));
+		out_write(out, fill, chunk);
+		count -= chunk;
+	}
+}
+
+// Writes prefix (a sign) and body padded out to the op's width. Returns how many characters that was.
+int out_padded(cprintf_out* out, const cprintf_op* op, const char* prefix, size_t prefix_len, const char* body, size_t body_len) {
+	size_t total = prefix_len + body_len;
+	size_t pad = op->width > 0 && (size_t) op->width > total ? (size_t) op->width - total : 0;
+
+	if (op->flags & CPRINTF_FLAG_LEFT) {
+		out_write(out, prefix, prefix_len);
+		out_write(out, body, body_len);
+		out_fill(out, ' ', pad);
+	}
+	else if (op->flags & CPRINTF_FLAG_ZERO && op->conversion != 's' && op->conversion != 'c') {
+		out_write(out, prefix, prefix_len);
+		out_fill(out, '0', pad);
+		out_write(out, body, body_len);
+	}
+	else {
+		out_fill(out, ' ', pad);
+		out_write(out, prefix, prefix_len);
+		out_write(out, body, body_len);
+	}
+	return (int) (total + pad);
+}
+
+// How much padding text that takes up count characters needs to fill the op's width
+size_t pad_width(const cprintf_op* op, size_t count) {
+	return op->width > 0 && (size_t) op->width > count ? (size_t) op->width - count : 0;
+}
+
+/* %ls. wide says whether it's in a wchar_t format, where the width and precision count wchar_ts. In a char
+* format they count bytes, and the precision doesn't cut a character in half.
+*/
+int out_wide_string(cprintf_out* out, const cprintf_op* op, bool wide, const wchar_t* wstr) {
+	size_t len = 0;
+	size_t count = 0; // what the width is measured against
+	size_t pad;
+	size_t bytes;
+
+	if (!wstr)
+		wstr = L"(null)";
+	if (wide) {
+		if (op->precision < 0)
+			len = wcslen(wstr);
+		else // don't read past the precision, the string doesn't have to be terminated
+			while (len < (size_t) op->precision && wstr[len] != L'\0')
+				len++;
+		count = len;
+	}
+	else if (op->precision < 0 && op->width <= 0) { // nothing to measure
+		len = wcslen(wstr);
+	}
+	else {
+		count = utf8_measure(wstr, op->precision < 0 ? SIZE_MAX : (size_t) op->precision, &len);
+	}
+
+	pad = pad_width(op, count);
+	if (!(op->flags & CPRINTF_FLAG_LEFT))
+		out_fill(out, ' ', pad);
+	bytes = wout_write(out, wstr, len);
+	if (op->flags & CPRINTF_FLAG_LEFT)
+		out_fill(out, ' ', pad);
+	return (int) ((wide ? len : bytes) + pad);
+}
+
+// %lc, measured the same way as out_wide_string
+int out_wide_char(cprintf_out* out, const cprintf_op* op, bool wide, wint_t c) {
+	wchar_t wc = (wchar_t) c;
+	size_t index = 0;
+	size_t count = wide ? 1 : utf8_length(wide_next(&wc, 1, &index));
+	size_t pad = pad_width(op, count);
+
+	if (!(op->flags & CPRINTF_FLAG_LEFT))
+		out_fill(out, ' ', pad);
+	wout_write(out, &wc, 1);
+	if (op->flags & CPRINTF_FLAG_LEFT)
+		out_fill(out, ' ', pad);
+	return (int) (count + pad);
+}
+
+/* %s in a wchar_t format. The string is taken to be UTF-8 already so its bytes go straight out, but the width and
+* precision still count the wchar_ts it would have turned into.
+*/
+int out_narrow_string(cprintf_out* out, const cprintf_op* op, const char* str) {
+	size_t units;
+	size_t len;
+	size_t pad;
+
+	if (!str)
+		str = "(null)";
+	len = utf8_span(str, op->precision < 0 ? SIZE_MAX : (size_t) op->precision, &units);
+	pad = pad_width(op, units);
+	if (!(op->flags & CPRINTF_FLAG_LEFT))
+		out_fill(out, ' ', pad);
+	out_write(out, str, len);
+	if (op->flags & CPRINTF_FLAG_LEFT)
+		out_fill(out, ' ', pad);
+	return (int) (units + pad);
+}
+
+/* Floats.
+* %f, %e and %g start from the shortest digits that read back as the same double (worked out the way Ryu does it,
+* from its small tables), rounded to the precision asked for. printf rounds the double's exact value instead, but
+* the two come out the same when:
+* - there are more shortest digits than the precision keeps, and what gets cut off isn't exactly a 5 (a rounding
+*   boundary in between the double and its shortest digits would make for shorter or closer ones)
+* - or there are no more than it keeps, and it keeps at most 15 significant digits (the double is within half a
+*   place of those, so the zeros after the shortest digits are right too)
+* Anything else (a tie, a subnormal, inf and nan, a locale whose decimal point isn't '.', or a rounding mode that
+* isn't to nearest) goes to printf after all.
+*/
+
+#if defined(CPRINTF_FLOAT_BUF_SIZE) || defined(CPRINTF_POW5_STEP)
+#error Macro clash!
+#endif
+#define CPRINTF_FLOAT_BUF_SIZE 80 // the most a float that goes fast takes, minus the sign
+#define CPRINTF_POW5_STEP 26 // the tables below have every 26th power of 5, the rest are worked out from those
+
+// 5^0 to 5^25
+static const uint64_t pow5_small[CPRINTF_POW5_STEP] = {
+	1u, 5u, 25u, 125u, 625u, 3125u, 15625u, 78125u, 390625u, 1953125u, 9765625u, 48828125u, 244140625u, 1220703125u,
+	6103515625u, 30517578125u, 152587890625u, 762939453125u, 3814697265625u, 19073486328125u, 95367431640625u,
+	476837158203125u, 2384185791015625u, 11920928955078125u, 59604644775390625u, 298023223876953125u
+};
+
+// The top 125 bits of 5^0, 5^26, 5^52... (low 64 bits first)
+static const uint64_t pow5_split_table[13][2] = {
+	{ 0x0000000000000000u, 0x1000000000000000u },
+	{ 0x0000000000000000u, 0x14adf4b7320334b9u },
+	{ 0x0e549208b31adb10u, 0x1aba4714957d300du },
+	{ 0x6dc6ad264d8f0866u, 0x1145b7e285bf98f5u },
+	{ 0xeb1dbd923d8596cau, 0x1652efdc6018a1fcu },
+	{ 0xb4c1b80b22ae923cu, 0x1cda62055b2d9d83u },
+	{ 0x5bb28b4e8f7e4c30u, 0x12a5568b9f52f416u },
+	{ 0xf08aed437682d4fbu, 0x1819651531f9e78fu },
+	{ 0xb4ee134ad99bf150u, 0x1f25c186a6f04c28u },
+	{ 0x16499ecb70c25f03u, 0x1420eb449c8842e6u },
+	{ 0x85a56ead360865b0u, 0x1a03fde214caf085u },
+	{ 0x093db1d57999890bu, 0x10cfeb353a97dad8u },
+	{ 0xcf38bb735e3f36acu, 0x15baaf44fa52673eu }
+};
+
+// 2^(124 + the bits in 5^i) / 5^i, rounded down, plus 1, for i = 0, 26, 52...
+static const uint64_t pow5_inv_split_table[15][2] = {
+	{ 0x0000000000000001u, 0x2000000000000000u },
+	{ 0x52a6c95fc0655034u, 0x18c240c4aecb13bbu },
+	{ 0x7ca8d50071dfc806u, 0x1327fc58da0f6ff5u },
+	{ 0x6520247d3556476eu, 0x1da48ce468e7c702u },
+	{ 0x6139cdd76802e6e9u, 0x16ef5b40c2fc7779u },
+	{ 0xf951a7ff43de8c79u, 0x11bebdf578b2f391u },
+	{ 0x7be8bee8d6e957e8u, 0x1b758d848fac54b0u },
+	{ 0x8bd3f9e999a423eau, 0x153eda614071a3b7u },
+	{ 0x0848f973cb3ee3ceu, 0x10701bd527b4978cu },
+	{ 0x153285ebb9efbfa2u, 0x196fbb9bb44db44du },
+	{ 0xadeee7f86c07b696u, 0x13ae3591f5b4d936u },
+	{ 0x4d686a4eaf182222u, 0x1e74404f3daada91u },
+	{ 0x98c0a106e09ebd9fu, 0x17900ea4fda7c257u },
+	{ 0x8f20e37371497d0eu, 0x123b140576d820b2u },
+	{ 0xb043138134743d85u, 0x1c35f4275f7a29adu }
+};
+
+// What the ones in between come out short by (0 to 3, 2 bits each, 16 to a number)
+static const uint32_t pow5_split_fix[21] = {
+	0x00000000u, 0x00000000u, 0x00000000u, 0x00000000u, 0x40000000u, 0x59695995u, 0x55545555u,
+	0x56555515u, 0x41150504u, 0x40555410u, 0x44555145u, 0x44504540u, 0x45555550u, 0x40004000u,
+	0x96440440u, 0x55565565u, 0x54454045u, 0x40154151u, 0x55559155u, 0x51405555u, 0x00000105u
+};
+static const uint32_t pow5_inv_split_fix[22] = {
+	0x54544554u, 0x04055545u, 0x10041000u, 0x00400414u, 0x40010000u, 0x41155555u, 0x00000454u,
+	0x00010044u, 0x40000000u, 0x44000041u, 0x50454450u, 0x55550054u, 0x51655554u, 0x40004000u,
+	0x01000001u, 0x00010500u, 0x51515411u, 0x05555554u, 0x50411500u, 0x40040000u, 0x05040110u,
+	0x00000000u
+};
+
+// The bits in 5^e (1 for e = 0)
+int32_t pow5_bits(int32_t e) {
+	return (int32_t) ((((uint32_t) e * 1217359) >> 19) + 1);
+}
+// floor(log10(2^e)) and floor(log10(5^e))
+uint32_t log10_pow2(int32_t e) {
+	return ((uint32_t) e * 78913) >> 18;
+}
+uint32_t log10_pow5(int32_t e) {
+	return ((uint32_t) e * 732923) >> 20;
+}
+
+// How many times 5 goes into v (which isn't 0)
+uint32_t pow5_factor(uint64_t v) {
+	uint32_t count = 0;
+	while (v % 5 == 0) {
+		v /= 5;
+		count++;
+	}
+	return count;
+}
+
+// a * b: returns the low 64 bits and puts the high 64 in *pHigh
+uint64_t mul_128(uint64_t a, uint64_t b, uint64_t* pHigh) {
+#if defined(__SIZEOF_INT128__)
+	__extension__ typedef unsigned __int128 cprintf_u128; // (so -Wpedantic doesn't mind)
+	cprintf_u128 product = (cprintf_u128) a * b;
+	*pHigh = (uint64_t) (product >> 64);
+	return (uint64_t) product;
+#else
+	uint64_t low = (uint64_t) (uint32_t) a * (uint32_t) b;
+	uint64_t high_low = (a >> 32) * (uint32_t) b;
+	uint64_t low_high = (uint64_t) (uint32_t) a * (b >> 32);
+	uint64_t middle = (low >> 32) + (uint32_t) high_low + (uint32_t) low_high;
+	*pHigh = (a >> 32) * (b >> 32) + (high_low >> 32) + (low_high >> 32) + (middle >> 32);
+	return (middle << 32) | (uint32_t) low;
+#endif
+}
+
+// high:low >> dist (0 < dist < 64)
+uint64_t shift_right_128(uint64_t low, uint64_t high, uint32_t dist) {
+	return (high << (64 - dist)) | (low >> dist);
+}
+
+// The 125 bit number in mul times m, >> dist (0 < dist < 64, and it has to fit in 128 bits)
+void mul_shift_split(const uint64_t mul[2], uint64_t m, uint32_t dist, uint64_t result[2]) {
+	uint64_t high0;
+	uint64_t high1;
+	uint64_t low0 = mul_128(m, mul[0], &high0);
+	uint64_t middle = mul_128(m, mul[1], &high1) + high0;
+
+	high1 += middle < high0;
+	result[0] = shift_right_128(low0, middle, dist);
+	result[1] = shift_right_128(middle, high1, dist);
+}
+
+void add_128(uint64_t value[2], uint64_t n) {
+	value[0] += n;
+	value[1] += value[0] < n;
+}
+
+// The top 125 bits of 5^i (i < 326)
+void pow5_split(int32_t i, uint64_t result[2]) {
+	int32_t base = i / CPRINTF_POW5_STEP;
+	int32_t offset = i - base * CPRINTF_POW5_STEP;
+
+	if (!offset) {
+		result[0] = pow5_split_table[base][0];
+		result[1] = pow5_split_table[base][1];
+		return;
+	}
+	mul_shift_split(pow5_split_table[base], pow5_small[offset],
+		(uint32_t) (pow5_bits(i) - pow5_bits(base * CPRINTF_POW5_STEP)), result);
+	add_128(result, (pow5_split_fix[i / 16] >> (i % 16 * 2)) & 3);
+}
+
+// 2^(124 + the bits in 5^i) / 5^i, rounded down, plus 1 (i < 342)
+void pow5_inv_split(int32_t i, uint64_t result[2]) {
+	int32_t base = (i + CPRINTF_POW5_STEP - 1) / CPRINTF_POW5_STEP;
+	int32_t offset = base * CPRINTF_POW5_STEP - i;
+	const uint64_t* inv = pow5_inv_split_table[base];
+	uint64_t less[2];
+
+	if (!offset) {
+		result[0] = inv[0];
+		result[1] = inv[1];
+		return;
+	}
+	less[0] = inv[0] - 1; // (the table's rounded up, this works from the one rounded down)
+	less[1] = inv[1] - (inv[0] == 0);
+	mul_shift_split(less, pow5_small[offset], (uint32_t) (pow5_bits(base * CPRINTF_POW5_STEP) - pow5_bits(i)), result);
+	add_128(result, 1 + ((pow5_inv_split_fix[i / 16] >> (i % 16 * 2)) & 3));
+}
+
+// (m * the 125 bit number in mul) >> j, for the j shortest_digits uses (64 < j < 128)
+uint64_t mul_shift_64(uint64_t m, const uint64_t mul[2], int32_t j) {
+	uint64_t high0;
+	uint64_t high1;
+	uint64_t sum;
+
+	mul_128(m, mul[0], &high0);
+	sum = mul_128(m, mul[1], &high1) + high0;
+	high1 += sum < high0;
+	return shift_right_128(sum, high1, (uint32_t) (j - 64));
+}
+
+/* The shortest digits that read back as the double with these bits (and the closest of those, if there's a choice),
+* the way Ryu does it. Returns them as a number, with the power of 10 it goes with in *pExponent.
+* The double can't be 0, inf or nan.
+*/
+uint64_t shortest_digits(uint64_t mantissa, uint32_t exponent, int32_t* pExponent) {
+	int32_t e2;
+	int32_t e10;
+	uint64_t m2;
+	uint64_t mv;
+	uint64_t vr; // the double, and the top and bottom of what reads back as it, in the same power of 10
+	uint64_t vp;
+	uint64_t vm;
+	uint64_t mul[2];
+	uint64_t output;
+	bool accept_bounds;
+	bool vr_trailing_zeros = false; // whether everything below vr (and vm) that's been cut off is 0
+	bool vm_trailing_zeros = false;
+	uint32_t mm_shift;
+	uint32_t last_removed = 0;
+	int32_t removed = 0;
+
+	if (exponent == 0) {
+		e2 = 1 - 1023 - 52 - 2;
+		m2 = mantissa;
+	}
+	else {
+		e2 = (int32_t) exponent - 1023 - 52 - 2;
+		m2 = (UINT64_C(1) << 52) | mantissa;
+	}
+	accept_bounds = (m2 & 1) == 0; // reading it back rounds ties to even, so the bounds themselves count if m2 is
+	mv = 4 * m2;
+	mm_shift = mantissa != 0 || exponent <= 1; // (the gap below is half as big at a power of 2)
+
+	// Step 3 of the paper: vr, vp and vm in base 10, with enough of the digits right
+	if (e2 >= 0) {
+		uint32_t q = log10_pow2(e2) - (e2 > 3);
+		int32_t j = -e2 + (int32_t) q + 125 + pow5_bits((int32_t) q) - 1;
+		e10 = (int32_t) q;
+		pow5_inv_split((int32_t) q, mul);
+		vr = mul_shift_64(mv, mul, j);
+		vp = mul_shift_64(mv + 2, mul, j);
+		vm = mul_shift_64(mv - 1 - mm_shift, mul, j);
+		if (q <= 21) { // only these can be exact
+			if (mv % 5 == 0)
+				vr_trailing_zeros = pow5_factor(mv) >= q;
+			else if (accept_bounds)
+				vm_trailing_zeros = pow5_factor(mv - 1 - mm_shift) >= q;
+			else
+				vp -= pow5_factor(mv + 2) >= q;
+		}
+	}
+	else {
+		uint32_t q = log10_pow5(-e2) - (-e2 > 1);
+		int32_t i = -e2 - (int32_t) q;
+		int32_t j = (int32_t) q - (pow5_bits(i) - 125);
+		e10 = (int32_t) q + e2;
+		pow5_split(i, mul);
+		vr = mul_shift_64(mv, mul, j);
+		vp = mul_shift_64(mv + 2, mul, j);
+		vm = mul_shift_64(mv - 1 - mm_shift, mul, j);
+		if (q <= 1) {
+			vr_trailing_zeros = true; // mv has at least 2 trailing zero bits
+			if (accept_bounds)
+				vm_trailing_zeros = mm_shift == 1;
+			else
+				--vp;
+		}
+		else if (q < 63) {
+			vr_trailing_zeros = (mv & ((UINT64_C(1) << q) - 1)) == 0;
+		}
+	}
+
+	// Step 4: take digits off while vp and vm still differ in what's left
+	if (vm_trailing_zeros || vr_trailing_zeros) { // (rare) one of them might be exact, so keep track of what's cut off
+		while (vp / 10 > vm / 10) {
+			vm_trailing_zeros &= vm % 10 == 0;
+			vr_trailing_zeros &= last_removed == 0;
+			last_removed = (uint32_t) (vr % 10);
+			vr /= 10;
+			vp /= 10;
+			vm /= 10;
+			++removed;
+		}
+		if (vm_trailing_zeros) {
+			while (vm % 10 == 0) {
+				vr_trailing_zeros &= last_removed == 0;
+				last_removed = (uint32_t) (vr % 10);
+				vr /= 10;
+				vp /= 10;
+				vm /= 10;
+				++removed;
+			}
+		}
+		if (vr_trailing_zeros && last_removed == 5 && vr % 2 == 0)
+			last_removed = 4; // exactly halfway, so round to even
+		output = vr + ((vr == vm && (!accept_bounds || !vm_trailing_zeros)) || last_removed >= 5);
+	}
+	else {
+		bool round_up = false;
+		while (vp / 10 > vm / 10) {
+			round_up = vr % 10 >= 5;
+			vr /= 10;
+			vp /= 10;
+			vm /= 10;
+			++removed;
+		}
+		output = vr + (vr == vm || round_up);
+	}
+	*pExponent = e10 + removed;
+	return output;
+}
+
+// A double as decimal digits, with the first one worth 10^exponent (no digits at all is 0)
+typedef struct float_digits {
+	char digits[20];
+	int count;
+	int exponent;
+} float_digits;
+
+// The digit index places after the first one ('0' before the first or after the last)
+char digit_at(const float_digits* f, int index) {
+	return index >= 0 && index < f->count ? f->digits[index] : '0';
+}
+
+// Rounds f to keep significant digits (0 or less for %f when it's all past the precision) the way printf would
+// round the double it came from. False if that depends on digits f doesn't have.
+bool round_digits(float_digits* f, int keep) {
+	int i;
+
+	if (f->count == 0)
+		return true;
+	if (keep >= f->count)
+		return keep <= 15;
+	if (keep < 0 || f->digits[keep] < '5') {
+		f->count = CPRINTF_MAX(keep, 0);
+		return true;
+	}
+	if (f->digits[keep] == '5' && keep + 1 == f->count)
+		return false; // a tie, which way it goes depends on the exact value
+	for (i = keep - 1; i >= 0 && f->digits[i] == '9'; --i)
+		;
+	if (i < 0) { // all 9s, so it's 1 with one more zero
+		f->digits[0] = '1';
+		f->count = 1;
+		f->exponent++;
+		return true;
+	}
+	f->digits[i]++;
+	f->count = i + 1;
+	return true;
+}
+
+// f like %.<precision>f (f already rounded to that), returns how long that is
+size_t fixed_digits(char* buf, const float_digits* f, int precision) {
+	char* ptr = buf;
+
+	if (f->exponent < 0)
+		*ptr++ = '0';
+	for (int place = f->exponent; place >= 0; --place)
+		*ptr++ = digit_at(f, f->exponent - place);
+	if (precision > 0) {
+		*ptr++ = '.';
+		for (int place = -1; place >= -precision; --place)
+			*ptr++ = digit_at(f, f->exponent - place);
+	}
+	return ptr - buf;
+}
+
+// f like %.<precision>e (f already rounded to that), e is the e to use
+size_t exponent_digits(char* buf, const float_digits* f, int precision, char e) {
+	char* ptr = buf;
+	int exponent = f->count ? f->exponent : 0;
+
+	*ptr++ = digit_at(f, 0);
+	if (precision > 0) {
+		*ptr++ = '.';
+		for (int i = 1; i <= precision; ++i)
+			*ptr++ = digit_at(f, i);
+	}
+	*ptr++ = e;
+	*ptr++ = exponent < 0 ? '-' : '+';
+	if (exponent < 0)
+		exponent = -exponent;
+	if (exponent >= 100)
+		*ptr++ = (char) ('0' + exponent / 100);
+	memcpy(ptr, digit_pairs + exponent % 100 * 2, 2);
+	return ptr + 2 - buf;
+}
+
+// Whether printf would write a float with a '.' and round it to nearest right now
+bool plain_floats(void) {
+	// (half a place either side of 1 only goes back to 1 when rounding to nearest, and this way there's no need
+	// for fegetround, which wants libm in some places)
+	static volatile double one = 1.0;
+	static volatile double half_place = 0x1p-53;
+	const char* point = localeconv()->decimal_point;
+
+	return point[0] == '.' && point[1] == '\0' && one + half_place == one && one - half_place / 2 == one;
+}
+
+// %f, %e or %g (or their capitals), written here if the digits are sure to match printf's, by printf if not
+int out_double(cprintf_out* out, const cprintf_op* op, double value) {
+	char buf[CPRINTF_FLOAT_BUF_SIZE];
+	float_digits f = { { 0 }, 0, 0 };
+	int precision = op->precision < 0 ? 6 : op->precision;
+	uint64_t bits;
+	uint64_t mantissa;
+	uint32_t exponent;
+	size_t len = 0;
+	char sign = 0;
+	bool fits;
+
+	memcpy(&bits, &value, sizeof(bits));
+	mantissa = bits & ((UINT64_C(1) << 52) - 1);
+	exponent = (uint32_t) (bits >> 52) & 0x7FF;
+	if (exponent == 0x7FF || (exponent == 0 && mantissa != 0) || precision > CPRINTF_FLOAT_PRECISION_MAX || !plain_floats()) {
+		char spec[CPRINTF_BUF_SIZE];
+		deferred_spec(spec, op, op->precision, "");
+		return out_printf(out, spec, value);
+	}
+
+	if (bits >> 63)
+		sign = '-';
+	else if (op->flags & CPRINTF_FLAG_PLUS)
+		sign = '+';
+	else if (op->flags & CPRINTF_FLAG_SPACE)
+		sign = ' ';
+	if (exponent) { // (0 has no digits)
+		int32_t e10;
+		uint64_t digits = shortest_digits(mantissa, exponent, &e10);
+		char* end = f.digits + sizeof(f.digits);
+		char* start;
+		while (digits % 10 == 0) {
+			digits /= 10;
+			e10++;
+		}
+		start = format_decimal(end, digits);
+		f.count = (int) (end - start);
+		memmove(f.digits, start, f.count);
+		f.exponent = e10 + f.count - 1;
+	}
+
+	switch (op->conversion) {
+		case 'f':
+		case 'F':
+			fits = round_digits(&f, f.exponent + precision + 1);
+			if (fits)
+				len = fixed_digits(buf, &f, precision);
+			break;
+		case 'e':
+		case 'E':
+			fits = round_digits(&f, precision + 1);
+			if (fits)
+				len = exponent_digits(buf, &f, precision, (char) op->conversion);
+			break;
+		default: { // g and G: %e if the exponent's below -4 or not below the precision, %f if not, minus trailing zeros
+			int significant = precision ? precision : 1;
+			int count;
+			fits = round_digits(&f, significant);
+			if (!fits)
+				break;
+			for (count = f.count; count > 0 && f.digits[count - 1] == '0'; --count)
+				;
+			if (count && (f.exponent < -4 || f.exponent >= significant))
+				len = exponent_digits(buf, &f, CPRINTF_MAX(count - 1, 0), op->conversion == 'G' ? 'E' : 'e');
+			else
+				len = fixed_digits(buf, &f, CPRINTF_MAX(count - 1 - (count ? f.exponent : 0), 0));
+			break;
+		}
+	}
+	if (!fits) {
+		char spec[CPRINTF_BUF_SIZE];
+		deferred_spec(spec, op, op->precision, "");
+		return out_printf(out, spec, value);
+	}
+	return out_padded(out, op, &sign, sign ? 1 : 0, buf, len);
+}
+
+intmax_t read_signed(const cprintf_op* op, cprintf_args* args) {
+	switch (op->length) {
+		case CPRINTF_LENGTH_H:
+			return (short int) CPRINTF_ARG(args, int, i);
+		case CPRINTF_LENGTH_HH:
+			return (signed char) CPRINTF_ARG(args, int, i);
+		case CPRINTF_LENGTH_L:
+			return CPRINTF_ARG(args, long int, i);
+		case CPRINTF_LENGTH_LL:
+			return CPRINTF_ARG(args, long long int, i);
+		case CPRINTF_LENGTH_J:
+			return CPRINTF_ARG(args, intmax_t, i);
+		case CPRINTF_LENGTH_Z:
+			return (intmax_t) CPRINTF_ARG(args, size_t, i);
+		case CPRINTF_LENGTH_T:
+			return CPRINTF_ARG(args, ptrdiff_t, i);
+		default:
+			return CPRINTF_ARG(args, int, i);
+	}
+}
+
+uintmax_t read_unsigned(const cprintf_op* op, cprintf_args* args) {
+	switch (op->length) {
+		case CPRINTF_LENGTH_H:
+			return (unsigned short int) CPRINTF_ARG(args, unsigned int, i);
+		case CPRINTF_LENGTH_HH:
+			return (unsigned char) CPRINTF_ARG(args, unsigned int, i);
+		case CPRINTF_LENGTH_L:
+			return CPRINTF_ARG(args, unsigned long int, i);
+		case CPRINTF_LENGTH_LL:
+			return CPRINTF_ARG(args, unsigned long long int, i);
+		case CPRINTF_LENGTH_J:
+			return CPRINTF_ARG(args, uintmax_t, i);
+		case CPRINTF_LENGTH_Z:
+			return CPRINTF_ARG(args, size_t, i);
+		case CPRINTF_LENGTH_T:
+			return (uintmax_t) CPRINTF_ARG(args, ptrdiff_t, i);
+		default:
+			return CPRINTF_ARG(args, unsigned int, i);
+	}
+}
+
+// Carries out a conversion that can_go_fast said yes to (wide is whether the format is wchar_t)
+int run_fast(cprintf_out* out, const cprintf_op* op, bool wide, cprintf_args* args) {
+	char digits[sizeof(uintmax_t) * 3]; // enough for octal (22 digits for 64 bits)
+	char* end = digits + sizeof(digits);
+	char* start;
+	char sign = 0;
+
+	switch (op->conversion) {
+		case 'd':
+		case 'i': {
+			intmax_t v = read_signed(op, args);
+			uintmax_t magnitude = v < 0 ? 0 - (uintmax_t) v : (uintmax_t) v;
+			if (v < 0)
+				sign = '-';
+			else if (op->flags & CPRINTF_FLAG_PLUS)
+				sign = '+';
+			else if (op->flags & CPRINTF_FLAG_SPACE)
+				sign = ' ';
+			start = format_decimal(end, magnitude);
+			return out_padded(out, op, &sign, sign ? 1 : 0, start, end - start);
+		}
+		case 'u':
+			start = format_decimal(end, read_unsigned(op, args));
+			return out_padded(out, op, NULL, 0, start, end - start);
+		case 'o':
+			start = format_power_of_two(end, read_unsigned(op, args), 3, false);
+			return out_padded(out, op, NULL, 0, start, end - start);
+		case 'x':
+		case 'X':
+			start = format_power_of_two(end, read_unsigned(op, args), 4, op->conversion == 'X');
+			return out_padded(out, op, NULL, 0, start, end - start);
+		case 's': {
+			const char* str;
+			size_t len = 0;
+			if (op->length == CPRINTF_LENGTH_L)
+				return out_wide_string(out, op, wide, CPRINTF_ARG(args, const wchar_t*, p));
+			str = CPRINTF_ARG(args, const char*, p);
+			if (wide)
+				return out_narrow_string(out, op, str);
+			if (!str)
+				str = "(null)";
+			if (op->precision < 0)
+				len = strlen(str);
+			else // don't read past the precision, the string doesn't have to be terminated
+				while (len < (size_t) op->precision && str[len] != '\0')
+					len++;
+			return out_padded(out, op, NULL, 0, str, len);
+		}
+		case 'c': {
+			char c;
+			if (op->length == CPRINTF_LENGTH_L)
+				return out_wide_char(out, op, wide, CPRINTF_ARG(args, wint_t, i));
+			c = (char) CPRINTF_ARG(args, int, i);
+			return out_padded(out, op, NULL, 0, &c, 1);
+		}
+		case 'f':
+		case 'F':
+		case 'e':
+		case 'E':
+		case 'g':
+		case 'G':
+			return out_double(out, op, CPRINTF_ARG(args, double, d));
+		default:
+			return 0;
+	}
+}
+
+// Hands what's left to the backend and works out what the call should return
+int out_finish(cprintf_out* out, int chars_written) {
+	out_close(out);
+	if (out->error < 0)
+		return out->error;
+	return chars_written;
+}
+
+/* Reading and carrying out formats.
+* All of that is written once in cprintf_engine.h and included here twice, once for char formats and once for
+* wchar_t formats, so the two can't drift apart. The wide versions get a w in front of their names.
+*/
+
+#if defined(CPRINTF_CHAR) || defined(CPRINTF_NAME) || defined(CPRINTF_LIT) || defined(CPRINTF_WIDE)
+#error Macro clash!
+#endif
+#define CPRINTF_CHAR char
+#define CPRINTF_NAME(name) name
+#define CPRINTF_LIT(c) c
+#define CPRINTF_WIDE false
+#include "cprintf_engine.h"
+#undef CPRINTF_CHAR
+#undef CPRINTF_NAME
+#undef CPRINTF_LIT
+#undef CPRINTF_WIDE
+
+#define CPRINTF_CHAR wchar_t
+#define CPRINTF_NAME(name) w ## name
+#define CPRINTF_LIT(c) L ## c
+#define CPRINTF_WIDE true
+#include "cprintf_engine.h"
+#undef CPRINTF_CHAR
+#undef CPRINTF_NAME
+#undef CPRINTF_LIT
+#undef CPRINTF_WIDE
+
+int run_compiled(const cprintf_backend* sink, const cprintf_fmt* fmt, va_list* arg) {
+	cprintf_out out;
+	cprintf_args args;
+	arg_value* values;
+	int chars_written = 0;
+	int res;
+
+	startup_for(sink);
+	out_init(&out, sink);
+	args_init(&args, arg);
+	if (fmt->layout.count) {
+		values = scratch_alloc(out.arena, fmt->layout.count * sizeof(arg_value));
+		if (!values || !args_read(&args, &fmt->layout, values)) {
+			out_close(&out);
+			return -1;
+		}
+	}
+
+	for (size_t i = 0; i < fmt->op_count; ++i) {
+		res = run_op(&out, &fmt->ops[i], fmt->text, &args, chars_written);
+		if (res < 0) {
+			out_close(&out);
+			return res;
+		}
+		chars_written += res;
+	}
+	return out_finish(&out, chars_written);
+}
+
+// ======================
+// compiled formats
+// ======================
+
+cprintf_fmt* cprintf_compile(const char* const format) {
+	cprintf_fmt* fmt;
+	cprintf_op op;
+	size_t op_count = 0;
+	size_t text_size;
+
+	if (!format)
+		return NULL;
+	startup();
+
+	// first pass to find out how much room we need
+	for (const char* ptr = format; (ptr = next_op(format, ptr, &op)) != NULL; ) {
+		if (op.type != CPRINTF_OP_NONE)
+			op_count++;
+	}
+	text_size = strlen(format) + 1;
+
+	// the ops and the text share one allocation with the header
+	fmt = mem_alloc(sizeof(cprintf_fmt) + op_count * sizeof(cprintf_op) + text_size);
+	if (!fmt)
+		return NULL;
+	fmt->op_count = op_count;
+	fmt->ops = (cprintf_op*) (fmt + 1);
+	fmt->text = (char*) (fmt->ops + op_count);
+	memcpy(fmt->text, format, text_size);
+
+	op_count = 0;
+	fmt->deferrable = true;
+	atomic_init(&fmt->announced, false);
+	for (const char* ptr = fmt->text; (ptr = next_op(fmt->text, ptr, &op)) != NULL; ) {
+		if (op.type == CPRINTF_OP_NONE)
+			continue;
+		if (op.type == CPRINTF_OP_CONVERSION && op.kind == CPRINTF_ARG_NONE)
+			fmt->deferrable = false;
+		fmt->ops[op_count++] = op;
+	}
+	layout_ops(&fmt->layout, fmt->ops, op_count);
+	if (fmt->layout.broken)
+		fmt->deferrable = false;
+	return fmt;
+}
+
+void cprintf_fmt_free(cprintf_fmt* fmt) {
+	mem_free(fmt);
+}
+
+/* The format cache.
+* An open addressing hash table from format pointer to compiled format. It only ever grows and the
+* entries are never freed, which is fine for string literals (the only thing you should hand it).
+*
+* Lookups don't take the lock. New entries are added under it with the format stored before the key, so
+* anyone who sees the key sees a finished format. Old tables are left behind when the table grows since
+* someone could still be reading them (they add up to less than the table that replaced them).
+*/
+
+typedef struct cache_entry {
+	_Atomic(const char*) key;
+	cprintf_fmt* fmt;
+} cache_entry;
+
+typedef struct cache_table {
+	size_t capacity; // always a power of 2
+	size_t count;
+	cache_entry entries[];
+} cache_table;
+
+static _Atomic(cache_table*) cache = NULL;
+
+size_t hash_pointer(const void* ptr) {
+	uint64_t x = (uint64_t) (uintptr_t) ptr;
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	return (size_t) x;
+}
+
+cprintf_fmt* cache_find(const cache_table* table, const char* key) {
+	const char* entry_key;
+	if (!table)
+		return NULL;
+	for (size_t i = hash_pointer(key) & (table->capacity - 1); ; i = (i + 1) & (table->capacity - 1)) {
+		entry_key = atomic_load_explicit(&table->entries[i].key, memory_order_acquire);
+		if (!entry_key)
+			return NULL;
+		if (entry_key == key)
+			return table->entries[i].fmt;
+	}
+}
+
+// Puts fmt in the first free slot for key. There has to be one.
+void cache_insert(cache_table* table, const char* key, cprintf_fmt* fmt) {
+	size_t i = hash_pointer(key) & (table->capacity - 1);
+	while (atomic_load_explicit(&table->entries[i].key, memory_order_relaxed))
+		i = (i + 1) & (table->capacity - 1);
+	table->entries[i].fmt = fmt;
+	atomic_store_explicit(&table->entries[i].key, key, memory_order_release);
+	table->count++;
+}
+
+// Doubles the table (keeping it at most half full so lookups stay short)
+cache_table* cache_grow(cache_table* table) {
+	size_t capacity = table ? table->capacity * 2 : 256;
+	cache_table* grown = mem_calloc(sizeof(cache_table) + capacity * sizeof(cache_entry));
+	const char* key;
+	if (!grown)
+		return NULL;
+	grown->capacity = capacity;
+	for (size_t i = 0; table && i < table->capacity; ++i) {
+		key = atomic_load_explicit(&table->entries[i].key, memory_order_relaxed);
+		if (key)
+			cache_insert(grown, key, table->entries[i].fmt);
+	}
+	return grown;
+}
+
+cprintf_fmt* cache_get(const char* format) {
+	cache_table* table;
+	cprintf_fmt* fmt;
+
+	startup();
+
+	fmt = cache_find(atomic_load_explicit(&cache, memory_order_acquire), format);
+	if (fmt)
+		return fmt;
+
+	// first time we've seen it (unless another thread beat us to it)
+	mtx_lock(&state_lock);
+	table = atomic_load_explicit(&cache, memory_order_relaxed);
+	fmt = cache_find(table, format);
+	if (!fmt) {
+		if (!table || 2 * (table->count + 1) > table->capacity) {
+			table = cache_grow(table);
+			if (table)
+				atomic_store_explicit(&cache, table, memory_order_release);
+		}
+		if (table)
+			fmt = cprintf_compile(format);
+		if (fmt)
+			cache_insert(table, format, fmt);
+	}
+	mtx_unlock(&state_lock);
+	return fmt;
+}
+
+const cprintf_fmt* cprintf_cache(const char* const format) {
+	if (!format)
+		return NULL;
+	return cache_get(format);
+}
+
+// ======================
+// deferred printing
+// ======================
+
+/* A record is a header followed by its payload, all in the byte order of the machine that wrote it:
+*   uint32_t size (of the whole record), uint8_t type, 3 bytes of padding, uint64_t id
+* A format record's payload is the format's text. An event record's payload is its arguments, in the order
+* the format uses them:
+*   %d %i %u %o %x %X %c %p: 8 bytes (already cut down to whatever the length modifier says)
+*   %f and friends: a double, or a long double for %Lf
+*   %lc: a wint_t
+*   %s %ls: a uint32_t count of chars (or wchar_ts) and then the chars, without a terminator
+* The id is the address of the format string. Only the program that wrote the record knows what it points to,
+* which is why the first event for a format comes with a format record.
+*/
+
+enum {
+	CPRINTF_RECORD_FORMAT = 1,
+	CPRINTF_RECORD_EVENT = 2
+};
+
+#define CPRINTF_RECORD_HEADER 16
+#define CPRINTF_SPEC_MAX 32
+
+typedef struct record_writer {
+	unsigned char* buf;
+	size_t size;
+	size_t len; // keeps counting past size so we can say how much room it would have taken
+	bool error;
+} record_writer;
+
+void record_put(record_writer* w, const void* bytes, size_t n) {
+	if (n <= w->size && w->len <= w->size - n)
+		memcpy(w->buf + w->len, bytes, n);
+	w->len += n;
+}
+
+void record_header(record_writer* w, unsigned char type, const char* id) {
+	unsigned char header[CPRINTF_RECORD_HEADER] = { 0 };
+	uint64_t key = (uint64_t) (uintptr_t) id;
+	header[4] = type;
+	memcpy(header + 8, &key, sizeof(key));
+	record_put(w, header, sizeof(header));
+}
+
+// Goes back and fills in the size of the record that started at start
+void record_finish(record_writer* w, size_t start) {
+	uint32_t size = (uint32_t) (w->len - start);
+	if (w->len - start > UINT32_MAX)
+		w->error = true;
+	else if (w->len <= w->size)
+		memcpy(w->buf + start, &size, sizeof(size));
+}
+
+void record_string(record_writer* w, const void* str, size_t count, size_t char_size) {
+	uint32_t len = (uint32_t) count;
+	if (count > UINT32_MAX) {
+		w->error = true;
+		return;
+	}
+	record_put(w, &len, sizeof(len));
+	record_put(w, str, count * char_size);
+}
+
+// Pulls the arguments out of the ... the same way run_op would and copies their bytes into the record
+void record_args(record_writer* w, const cprintf_fmt* fmt, cprintf_args* args) {
+	for (size_t i = 0; i < fmt->op_count; ++i) {
+		const cprintf_op* op = &fmt->ops[i];
+		if (op->type != CPRINTF_OP_CONVERSION || !take_arg(args, op))
+			continue;
+		switch (op->kind) {
+			case CPRINTF_ARG_SIGNED: {
+				int64_t v = (int64_t) read_signed(op, args);
+				record_put(w, &v, sizeof(v));
+				break;
+			}
+			case CPRINTF_ARG_UNSIGNED: {
+				uint64_t v = (uint64_t) read_unsigned(op, args);
+				record_put(w, &v, sizeof(v));
+				break;
+			}
+			case CPRINTF_ARG_DOUBLE: {
+				double v = CPRINTF_ARG(args, double, d);
+				record_put(w, &v, sizeof(v));
+				break;
+			}
+			case CPRINTF_ARG_LONG_DOUBLE: {
+				long double v = CPRINTF_ARG(args, long double, ld);
+				record_put(w, &v, sizeof(v));
+				break;
+			}
+			case CPRINTF_ARG_CHAR: {
+				int64_t v = CPRINTF_ARG(args, int, i);
+				record_put(w, &v, sizeof(v));
+				break;
+			}
+			case CPRINTF_ARG_WCHAR: {
+				wint_t v = CPRINTF_ARG(args, wint_t, i);
+				record_put(w, &v, sizeof(v));
+				break;
+			}
+			case CPRINTF_ARG_STRING: {
+				const char* str = CPRINTF_ARG(args, const char*, p);
+				size_t len = 0;
+				if (!str)
+					str = "(null)";
+				if (op->precision < 0)
+					len = strlen(str);
+				else // don't read past the precision, the string doesn't have to be terminated
+					while (len < (size_t) op->precision && str[len] != '\0')
+						len++;
+				record_string(w, str, len, sizeof(char));
+				break;
+			}
+			case CPRINTF_ARG_WSTRING: {
+				const wchar_t* str = CPRINTF_ARG(args, const wchar_t*, p);
+				size_t len = 0;
+				if (!str)
+					str = L"(null)";
+				// the precision counts bytes written, and every wchar_t is at least one of those
+				while ((op->precision < 0 || len < (size_t) op->precision) && str[len] != L'\0')
+					len++;
+				record_string(w, str, len, sizeof(wchar_t));
+				break;
+			}
+			case CPRINTF_ARG_POINTER: {
+				uint64_t v = (uint64_t) (uintptr_t) CPRINTF_ARG(args, void*, p);
+				record_put(w, &v, sizeof(v));
+				break;
+			}
+			default:
+				break;
+		}
+	}
+}
+
+size_t cprintf_deferred(void* buf, size_t size, const char* const format, ...) {
+	record_writer w = { buf, buf ? size : 0, 0, false };
+	arg_value values[CPRINTF_ARGS_MAX];
+	cprintf_args args;
+	cprintf_fmt* fmt;
+	bool announce;
+	size_t start;
+	va_list arg;
+
+	if (!format)
+		return 0;
+	fmt = cache_get(format);
+	if (!fmt || !fmt->deferrable)
+		return 0;
+
+	announce = !atomic_load_explicit(&fmt->announced, memory_order_relaxed);
+	if (announce) {
+		record_header(&w, CPRINTF_RECORD_FORMAT, format);
+		record_put(&w, fmt->text, strlen(fmt->text));
+		record_finish(&w, 0);
+	}
+
+	start = w.len;
+	record_header(&w, CPRINTF_RECORD_EVENT, format);
+	va_start(arg, format);
+	args_init(&args, &arg);
+	if (fmt->layout.count && !args_read(&args, &fmt->layout, values)) {
+		va_end(arg);
+		return 0;
+	}
+	record_args(&w, fmt, &args);
+	va_end(arg);
+	record_finish(&w, start);
+
+	if (w.error)
+		return 0;
+	if (announce && w.len <= w.size)
+		atomic_store_explicit(&fmt->announced, true, memory_order_relaxed);
+	return w.len;
+}
+
+// Prints the argument at *pArgs for op and moves past it.
+// Returns what printf did, or -1 with *pArgs set to NULL if the record ends too soon.
+int replay_arg(cprintf_out* out, const cprintf_op* op, const unsigned char** pArgs, const unsigned char* end) {
+	char spec[CPRINTF_SPEC_MAX];
+	const unsigned char* args = *pArgs;
+	size_t remaining = end - args;
+	int64_t i;
+	uint64_t u;
+	uint32_t len;
+	int res;
+
+#if defined(CPRINTF_TAKE)
+#error Macro clash!
+#endif
+	// copies the next sizeof(var) bytes of the record into var
+#define CPRINTF_TAKE(var) do { \
+		if (remaining < sizeof(var)) \
+			goto broken; \
+		memcpy(&(var), args, sizeof(var)); \
+		args += sizeof(var); \
+		remaining -= sizeof(var); \
+	} while (0)
+
+	switch (op->kind) {
+		case CPRINTF_ARG_SIGNED:
+			CPRINTF_TAKE(i);
+			deferred_spec(spec, op, op->precision, "j");
+			res = out_printf(out, spec, (intmax_t) i);
+			break;
+		case CPRINTF_ARG_UNSIGNED:
+			CPRINTF_TAKE(u);
+			deferred_spec(spec, op, op->precision, "j");
+			res = out_printf(out, spec, (uintmax_t) u);
+			break;
+		case CPRINTF_ARG_DOUBLE: {
+			double v;
+			CPRINTF_TAKE(v);
+			deferred_spec(spec, op, op->precision, "");
+			res = out_printf(out, spec, v);
+			break;
+		}
+		case CPRINTF_ARG_LONG_DOUBLE: {
+			long double v;
+			CPRINTF_TAKE(v);
+			deferred_spec(spec, op, op->precision, "L");
+			res = out_printf(out, spec, v);
+			break;
+		}
+		case CPRINTF_ARG_CHAR:
+			CPRINTF_TAKE(i);
+			deferred_spec(spec, op, op->precision, "");
+			res = out_printf(out, spec, (int) i);
+			break;
+		case CPRINTF_ARG_WCHAR: {
+			wint_t v;
+			CPRINTF_TAKE(v);
+			if (op->fast) {
+				res = out_wide_char(out, op, false, v);
 				break;
 			}
-			case CPRINTF_TEXT(dtype, '%'): // escaped the sequence
-				res = CPRINTF_PUTCHAR(dtype, *pos);
+			deferred_spec(spec, op, op->precision, "l");
+			res = out_printf(out, spec, v);
+			break;
+		}
+		case CPRINTF_ARG_STRING:
+			CPRINTF_TAKE(len);
+			if (remaining < len || len > INT_MAX)
+				goto broken;
+			deferred_spec(spec, op, (int) len, ""); // the chars aren't terminated, so the precision has to stop printf
+			res = out_printf(out, spec, (const char*) args);
+			args += len;
+			break;
+		case CPRINTF_ARG_WSTRING: {
+			wchar_t* str;
+			CPRINTF_TAKE(len);
+			if (remaining / sizeof(wchar_t) < len)
+				goto broken;
+			str = scratch_alloc(out->arena, ((size_t) len + 1) * sizeof(wchar_t)); // a copy so it's lined up and terminated
+			if (!str)
+				return -1;
+			memcpy(str, args, (size_t) len * sizeof(wchar_t));
+			str[len] = L'\0';
+			if (op->fast) {
+				res = out_wide_string(out, op, false, str);
+			}
+			else {
+				deferred_spec(spec, op, op->precision, "l");
+				res = out_printf(out, spec, str);
+			}
+			args += (size_t) len * sizeof(wchar_t);
+			break;
+		}
+		case CPRINTF_ARG_POINTER:
+			CPRINTF_TAKE(u);
+			deferred_spec(spec, op, op->precision, "");
+			res = out_printf(out, spec, (void*) (uintptr_t) u);
+			break;
+		default:
+			goto broken;
+	}
+#undef CPRINTF_TAKE
+
+	*pArgs = args;
+	return res;
+
+broken:
+	*pArgs = NULL;
+	return -1;
+}
+
+// Prints one event record's worth of arguments through fmt, as one call. Returns false if the record is broken.
+bool replay_event(const cprintf_fmt* fmt, const unsigned char* args, size_t size) {
+	const unsigned char* end = args + size;
+	cprintf_out out;
+	int chars_written = 0;
+	int res;
+
+	startup_previous();
+	out_init(&out, NULL);
+
+	for (size_t i = 0; i < fmt->op_count; ++i) {
+		if (fmt->ops[i].type == CPRINTF_OP_CONVERSION)
+			res = replay_arg(&out, &fmt->ops[i], &args, end);
+		else
+			res = run_op(&out, &fmt->ops[i], fmt->text, NULL, chars_written);
+		if (res < 0) {
+			out_close(&out);
+			return args != NULL; // a printf that failed doesn't make the record broken
+		}
+		chars_written += res;
+	}
+	out_finish(&out, chars_written);
+	return true;
+}
+
+// The formats a decoder has read out of format records, by id. Same table as the cache, but only the decoder uses it.
+struct cprintf_decoder {
+	cache_table* formats;
+};
+
+cprintf_decoder* cprintf_decoder_new(void) {
+	startup();
+	return mem_calloc(sizeof(cprintf_decoder));
+}
+
+void cprintf_decoder_free(cprintf_decoder* decoder) {
+	if (!decoder)
+		return;
+	for (size_t i = 0; decoder->formats && i < decoder->formats->capacity; ++i)
+		mem_free(decoder->formats->entries[i].fmt);
+	mem_free(decoder->formats);
+	mem_free(decoder);
+}
+
+// Compiles the text of a format record and remembers it under id
+bool decoder_learn(cprintf_decoder* decoder, const char* id, const unsigned char* text, size_t len) {
+	cache_table* table = decoder->formats;
+	cprintf_fmt* fmt;
+	char* copy;
+
+	if (cache_find(table, id)) // seen it already
+		return true;
+	if (!table || 2 * (table->count + 1) > table->capacity) {
+		table = cache_grow(table);
+		if (!table)
+			return false;
+		mem_free(decoder->formats); // nobody else reads these
+		decoder->formats = table;
+	}
+	copy = mem_alloc(len + 1);
+	if (!copy)
+		return false;
+	memcpy(copy, text, len);
+	copy[len] = '\0';
+	fmt = cprintf_compile(copy);
+	mem_free(copy);
+	if (!fmt)
+		return false;
+	cache_insert(table, id, fmt);
+	return true;
+}
+
+ptrdiff_t cprintf_decode(cprintf_decoder* decoder, const void* data, size_t size) {
+	const unsigned char* bytes = data;
+	const cprintf_fmt* fmt;
+	const char* id;
+	size_t used = 0;
+	uint32_t record_size;
+	uint64_t key;
+
+	if (!decoder || (!data && size))
+		return -1;
+
+	while (size - used >= CPRINTF_RECORD_HEADER) {
+		memcpy(&record_size, bytes + used, sizeof(record_size));
+		if (record_size < CPRINTF_RECORD_HEADER)
+			return -1;
+		if (record_size > size - used) // the rest of it isn't here yet
+			break;
+		memcpy(&key, bytes + used + 8, sizeof(key));
+		id = (const char*) (uintptr_t) key;
+
+		switch (bytes[used + 4]) {
+			case CPRINTF_RECORD_FORMAT:
+				if (!decoder_learn(decoder, id, bytes + used + CPRINTF_RECORD_HEADER, record_size - CPRINTF_RECORD_HEADER))
+					return -1;
 				break;
-			case CPRINTF_TEXT(dtype, ' '): // didn't finish the sequence
-										   // TODO: ?
+			case CPRINTF_RECORD_EVENT:
+				fmt = cache_find(decoder->formats, id);
+				if (!fmt) // maybe it was written by this program
+					fmt = cache_find(atomic_load_explicit(&cache, memory_order_acquire), id);
+				if (fmt && !replay_event(fmt, bytes + used + CPRINTF_RECORD_HEADER, record_size - CPRINTF_RECORD_HEADER))
+					return -1;
+				break; // events for formats we've never heard of are skipped
 			default:
-				break;
+				return -1;
 		}
-		ptr = pos;
-		if (res >= 0)
-			chars_written += res;
-		else
+		used += record_size;
+	}
+	return (ptrdiff_t) used;
+}
+
+// ======================
+// sinks
+// ======================
+
+/* Everything that doesn't print to the terminal goes through a backend made on the spot for the call.
+* Colors always go into the text as ANSI sequences there, so set_attributes is never called.
+*/
+
+size_t sink_encode(void* ctx, cprintf_attr_t attrs, char* buf) {
+	(void) ctx;
+	return cprintf_encode_ansi(attrs, buf);
+}
+
+typedef struct sink_call {
+	cprintf_sink sink;
+	void* ctx;
+} sink_call;
+
+int sink_write(void* ctx, const char* bytes, size_t len) {
+	sink_call* call = ctx;
+	return call->sink(call->ctx, bytes, len);
+}
+
+int file_write(void* ctx, const char* bytes, size_t len) {
+	return fwrite(bytes, 1, len, ctx) == len ? 0 : -1;
+}
+
+typedef struct string_sink {
+	char* buf;
+	size_t size;
+	size_t len; // how long the whole thing is, even the part that didn't fit
+} string_sink;
+
+int string_write(void* ctx, const char* bytes, size_t len) {
+	string_sink* str = ctx;
+	if (str->len < str->size)
+		memcpy(str->buf + str->len, bytes, CPRINTF_MIN(len, str->size - str->len));
+	str->len += len;
+	return 0;
+}
+
+// ======================
+// frames
+// ======================
+
+/* A frame is two grids of cells: back is what's being drawn and front is what the last present put on the screen.
+* Drawing is a normal call to a backend that puts the text into back instead of writing it (it has no
+* encode_attributes, so the colors come to it as set_attributes calls). Presenting is a normal call to the
+* terminal that writes only the cells where back and front differ.
+*
+* We never ask the terminal where anything is. The first present draws the frame line by line from wherever
+* the cursor is, and every present leaves the cursor at the start of the line under the frame, so the next one
+* can get to any cell with relative moves.
+*/
+
+#if defined(CPRINTF_FRAME_GAP)
+#error Macro clash!
+#endif
+// Unchanged cells between two changed ones get written again if there are at most this many of them,
+// since that's no more than the cursor move to skip them would be
+#define CPRINTF_FRAME_GAP 4
+
+typedef struct frame_cell {
+	uint32_t ch;
+	cprintf_attr_t attrs;
+} frame_cell;
+
+struct cprintf_frame {
+	int width;
+	int height;
+	frame_cell* back;
+	frame_cell* front;
+	bool drawn; // front is on the screen
+	// where the next character goes while printing
+	int row;
+	int col;
+	int left; // where a newline goes back to
+	cprintf_attr_t attrs;
+	unsigned char partial[CPRINTF_UTF8_MAX]; // a character the last write cut off
+	size_t partial_len;
+};
+
+static const frame_cell blank_cell = { ' ', CPRINTF_DEFAULT_ATTRIBUTES };
+
+bool same_cell(const frame_cell* a, const frame_cell* b) {
+	return a->ch == b->ch && a->attrs == b->attrs;
+}
+
+// Puts one character where the frame's cursor is
+void frame_put(cprintf_frame* frame, uint32_t c) {
+	switch (c) {
+		case '\n':
+			frame->row++;
+			frame->col = frame->left;
+			return;
+		case '\r':
+			frame->col = frame->left;
+			return;
+		case '\t':
+			do
+				frame_put(frame, ' ');
+			while ((frame->col - frame->left) % 8 != 0);
+			return;
+	}
+	if (c < 0x20 || c == 0x7F) // the rest of the control characters don't take up a cell
+		return;
+	if (frame->row >= 0 && frame->row < frame->height && frame->col >= 0 && frame->col < frame->width) {
+		frame_cell* cell = &frame->back[(size_t) frame->row * frame->width + frame->col];
+		cell->ch = c;
+		cell->attrs = frame->attrs;
+	}
+	frame->col++;
+}
+
+int frame_write(void* ctx, const char* bytes, size_t len) {
+	cprintf_frame* frame = ctx;
+	const unsigned char* str = (const unsigned char*) bytes;
+	uint32_t c;
+	size_t used;
+
+	while (len > 0) {
+		if (frame->partial_len > 0) { // finish the character the last write cut off
+			frame->partial[frame->partial_len++] = *str++;
+			len--;
+			while (frame->partial_len > 0 && (used = utf8_next(frame->partial, frame->partial_len, &c)) > 0) {
+				frame_put(frame, c);
+				frame->partial_len -= used;
+				memmove(frame->partial, frame->partial + used, frame->partial_len);
+			}
+			continue;
+		}
+		used = utf8_next(str, len, &c);
+		if (used == 0) { // cut off, so wait for the rest
+			memcpy(frame->partial, str, len);
+			frame->partial_len = len;
+			return 0;
+		}
+		frame_put(frame, c);
+		str += used;
+		len -= used;
+	}
+	return 0;
+}
+
+int frame_set_attributes(void* ctx, cprintf_attr_t attrs) {
+	cprintf_frame* frame = ctx;
+	frame->attrs = attrs;
+	return 0;
+}
+
+int frame_get_attributes(void* ctx, cprintf_attr_t* pAttrs) {
+	cprintf_frame* frame = ctx;
+	*pAttrs = frame->attrs;
+	return 0;
+}
+
+cprintf_frame* cprintf_frame_new(int width, int height) {
+	cprintf_frame* frame;
+	size_t count;
+
+	if (width <= 0 || height <= 0 || (size_t) width > SIZE_MAX / sizeof(frame_cell) / (size_t) height)
+		return NULL;
+	count = (size_t) width * (size_t) height;
+	frame = mem_alloc(sizeof(cprintf_frame));
+	if (!frame)
+		return NULL;
+	frame->back = mem_alloc(count * sizeof(frame_cell));
+	frame->front = mem_alloc(count * sizeof(frame_cell));
+	if (!frame->back || !frame->front) {
+		cprintf_frame_free(frame);
+		return NULL;
+	}
+	frame->width = width;
+	frame->height = height;
+	frame->drawn = false;
+	frame->partial_len = 0;
+	cprintf_frame_clear(frame);
+	return frame;
+}
+
+void cprintf_frame_free(cprintf_frame* frame) {
+	if (!frame)
+		return;
+	mem_free(frame->back);
+	mem_free(frame->front);
+	mem_free(frame);
+}
+
+void cprintf_frame_clear(cprintf_frame* frame) {
+	size_t count;
+	if (!frame)
+		return;
+	count = (size_t) frame->width * (size_t) frame->height;
+	for (size_t i = 0; i < count; ++i)
+		frame->back[i] = blank_cell;
+}
+
+void cprintf_frame_invalidate(cprintf_frame* frame) {
+	if (frame)
+		frame->drawn = false;
+}
+
+int cprintf_frame_vprintf(cprintf_frame* frame, int row, int col, const char* const format, va_list arg) {
+	const cprintf_backend backend = { frame, frame_write, frame_set_attributes, frame_get_attributes, NULL, 0 };
+	va_list copy;
+	int res;
+	if (!frame)
+		return -1;
+	frame->row = row;
+	frame->col = frame->left = col;
+	frame->attrs = CPRINTF_DEFAULT_ATTRIBUTES;
+	frame->partial_len = 0;
+	va_copy(copy, arg);
+	res = run_format(&backend, format, &copy);
+	va_end(copy);
+	if (frame->partial_len > 0) // the format ended partway through a character
+		frame_put(frame, 0xFFFD);
+	frame->partial_len = 0;
+	return res;
+}
+int cprintf_frame_printf(cprintf_frame* frame, int row, int col, const char* const format, ...) {
+	va_list arg;
+	int res;
+	va_start(arg, format);
+	res = cprintf_frame_vprintf(frame, row, col, format, arg);
+	va_end(arg);
+	return res;
+}
+
+// Writes \x1b[<n><letter>, leaving n out when it's 1
+void frame_sequence(cprintf_out* out, int n, char letter) {
+	char seq[16];
+	int len = n == 1 ? snprintf(seq, sizeof(seq), "\x1b[%c", letter) : snprintf(seq, sizeof(seq), "\x1b[%d%c", n, letter);
+	out_write(out, seq, (size_t) len);
+}
+
+/* Moves the cursor from (*pRow, *pCol) to (row, col), both from the frame's top left. A column of -1 means we don't
+* know which column it's in, which is the case after writing the last column (terminals wait there to wrap).
+*/
+void frame_move(cprintf_out* out, int* pRow, int* pCol, int row, int col) {
+	if (row > *pRow)
+		frame_sequence(out, row - *pRow, 'B');
+	else if (row < *pRow)
+		frame_sequence(out, *pRow - row, 'A');
+	if (col == *pCol) {
+		// already there
+	}
+	else if (*pCol < 0 || col == 0 || *pCol - col > col) { // going back to the start of the line is shorter
+		out_write(out, "\r", 1);
+		if (col > 0)
+			frame_sequence(out, col, 'C');
+	}
+	else if (col > *pCol) {
+		frame_sequence(out, col - *pCol, 'C');
+	}
+	else {
+		frame_sequence(out, *pCol - col, 'D');
+	}
+	*pRow = row;
+	*pCol = col;
+}
+
+// Switches what the text is drawn in, the same way a color sequence would
+void frame_attributes(cprintf_out* out, cprintf_attr_t attrs) {
+	if (!out->colors || out->attributes == attrs)
+		return;
+	out->attributes = attrs;
+	out->pending_colors++;
+}
+
+// Writes the cells from first to last in a row and moves *pCol along with them
+void frame_cells(cprintf_out* out, const cprintf_frame* frame, const frame_cell* cells, int first, int last, int* pCol) {
+	char text[256];
+	size_t len = 0;
+	for (int i = first; i < last; ++i) {
+		if (len > sizeof(text) - CPRINTF_UTF8_MAX || (out->colors && cells[i].attrs != out->attributes)) {
+			out_write(out, text, len); // the text so far goes out in the colors it was drawn in
+			len = 0;
+		}
+		frame_attributes(out, cells[i].attrs);
+		len += utf8_put(text + len, cells[i].ch);
+	}
+	out_write(out, text, len);
+	*pCol = last >= frame->width ? -1 : last;
+}
+
+// Where the blank cells at the end of a row start
+int frame_blank_tail(const frame_cell* cells, int width) {
+	while (width > 0 && same_cell(&cells[width - 1], &blank_cell))
+		--width;
+	return width;
+}
+
+// Blanks the rest of the line, in the default colors (that's what the erased cells get)
+void frame_erase_line(cprintf_out* out) {
+	frame_attributes(out, CPRINTF_DEFAULT_ATTRIBUTES);
+	out_write(out, "\x1b[K", 3);
+}
+
+int cprintf_frame_present(cprintf_frame* frame) {
+	cprintf_out out;
+	int row = 0;
+	int col = 0;
+	cprintf_attr_t before;
+
+	if (!frame)
+		return -1;
+	startup_previous();
+	out_init(&out, NULL);
+	before = out.attributes;
+
+	if (!frame->drawn) { // nothing of ours on the screen, so draw everything on fresh lines
+		for (int r = 0; r < frame->height; ++r) {
+			const frame_cell* cells = frame->back + (size_t) r * frame->width;
+			int tail = frame_blank_tail(cells, frame->width);
+			frame_cells(&out, frame, cells, 0, tail, &col);
+			if (tail < frame->width)
+				frame_erase_line(&out);
+			out_write(&out, "\r\n", 2);
+		}
+		row = frame->height;
+		col = 0;
+	}
+	else {
+		row = frame->height;
+		for (int r = 0; r < frame->height; ++r) {
+			const frame_cell* cells = frame->back + (size_t) r * frame->width;
+			const frame_cell* shown = frame->front + (size_t) r * frame->width;
+			int tail = -1; // worked out when we need it
+			int c = 0;
+
+			while (c < frame->width) {
+				int last;
+				if (same_cell(&cells[c], &shown[c])) {
+					++c;
+					continue;
+				}
+				// take the run as far as it goes, over short gaps of cells that didn't change
+				last = c + 1;
+				for (int i = c + 1; i < frame->width && i - last < CPRINTF_FRAME_GAP; ++i) {
+					if (!same_cell(&cells[i], &shown[i]))
+						last = i + 1;
+				}
+				if (tail < 0)
+					tail = frame_blank_tail(cells, frame->width);
+				frame_move(&out, &row, &col, r, c);
+				if (last > tail && tail < frame->width) { // everything from here on is blank, so erase it instead
+					frame_cells(&out, frame, cells, c, CPRINTF_MAX(c, tail), &col);
+					frame_erase_line(&out);
+					break;
+				}
+				frame_cells(&out, frame, cells, c, last, &col);
+				c = last;
+			}
+		}
+		frame_move(&out, &row, &col, frame->height, 0);
+	}
+
+	frame_attributes(&out, before); // whatever gets printed after this shouldn't come out in the frame's colors
+	memcpy(frame->front, frame->back, (size_t) frame->width * (size_t) frame->height * sizeof(frame_cell));
+	frame->drawn = true;
+	return out_finish(&out, 0);
+}
+
+// ======================
+// builders
+// ======================
+
+/* A builder is text plus a list of runs: where each run starts and ends in the text, and what colors it's drawn in.
+* A run's colors are kept as what happened to the attributes since the start of the builder (every color
+* sequence folded together), not as attributes, because what %[0m goes back to and what's showing beforehand
+* aren't known until it's printed. So appending another builder is copying its text and folding our colors in
+* front of each of its runs, and nothing has to be read again.
+* Both arrays double when they're full and cprintf_builder_clear keeps them, so once a builder has been as big
+* as it's going to get, building it again doesn't allocate.
+*/
+
+typedef struct builder_run {
+	size_t start; // where its text starts
+	size_t len;
+	cprintf_color color; // what the color sequences before it did, from the start of the builder
+} builder_run;
+
+struct cprintf_builder {
+	char* text;
+	size_t len;
+	size_t capacity;
+	builder_run* runs;
+	size_t run_count;
+	size_t run_capacity;
+	cprintf_color color; // what the next text gets drawn in (everything so far, folded)
+};
+
+// Doubles *pData (of capacity items of size bytes each) until count more fit
+bool builder_grow(void** pData, size_t* pCapacity, size_t used, size_t count, size_t size) {
+	size_t capacity = CPRINTF_MAX(*pCapacity, 16);
+	void* data;
+
+	if (*pCapacity - used >= count)
+		return true;
+	while (capacity - used < count) {
+		if (capacity > SIZE_MAX / 2 / size)
+			return false;
+		capacity *= 2;
+	}
+	data = mem_grow(*pData, capacity * size);
+	if (!data)
+		return false;
+	*pData = data;
+	*pCapacity = capacity;
+	return true;
+}
+
+bool same_color(const cprintf_color* a, const cprintf_color* b) {
+	return a->clear == b->clear && a->set == b->set && a->reset == b->reset;
+}
+
+// Adds text in color, to the last run if that's in the same colors
+bool builder_text(cprintf_builder* builder, const char* text, size_t len, const cprintf_color* color) {
+	builder_run* last = builder->run_count ? &builder->runs[builder->run_count - 1] : NULL;
+
+	if (len == 0)
+		return true;
+	if (!builder_grow((void**) &builder->text, &builder->capacity, builder->len, len, 1))
+		return false;
+	if (!last || !same_color(&last->color, color)) {
+		if (!builder_grow((void**) &builder->runs, &builder->run_capacity, builder->run_count, 1, sizeof(builder_run)))
+			return false;
+		last = &builder->runs[builder->run_count++];
+		last->start = builder->len;
+		last->len = 0;
+		last->color = *color;
+	}
+	memcpy(builder->text + builder->len, text, len);
+	builder->len += len;
+	last->len += len;
+	return true;
+}
+
+// what a builder's out hands it
+int builder_write(void* ctx, const char* bytes, size_t len) {
+	cprintf_builder* builder = ctx;
+	return builder_text(builder, bytes, len, &builder->color) ? 0 : -1;
+}
+
+cprintf_builder* cprintf_builder_new(void) {
+	return mem_calloc(sizeof(cprintf_builder));
+}
+
+void cprintf_builder_free(cprintf_builder* builder) {
+	if (!builder)
+		return;
+	mem_free(builder->text);
+	mem_free(builder->runs);
+	mem_free(builder);
+}
+
+void cprintf_builder_clear(cprintf_builder* builder) {
+	if (!builder)
+		return;
+	builder->len = 0;
+	builder->run_count = 0;
+	builder->color = (cprintf_color) { 0, 0, false };
+}
+
+int cprintf_builder_vprintf(cprintf_builder* builder, const char* const format, va_list arg) {
+	const cprintf_backend backend = { builder, builder_write, NULL, NULL, NULL, 0 };
+	cprintf_out out;
+	cprintf_op op;
+	cprintf_args args;
+	va_list copy;
+	int chars_written = 0;
+	int res;
+
+	if (!builder || !format)
+		return -1;
+	startup();
+	out_init(&out, &backend);
+	va_copy(copy, arg);
+	args_init(&args, &copy);
+	for (const char* ptr = format; (ptr = next_op(format, ptr, &op)) != NULL; ) {
+		if (op.type == CPRINTF_OP_COLOR) { // colors go in the runs, so the text before it has to be in first
+			CPRINTF_STAT(stats_color(&out));
+			out_flush(&out);
+			fold_color(&builder->color, &op.color);
+			continue;
+		}
+		res = run_op(&out, &op, format, &args, chars_written);
+		if (res < 0) {
+			va_end(copy);
+			out_close(&out);
 			return res;
+		}
+		chars_written += res;
+	}
+	va_end(copy);
+	return out_finish(&out, chars_written);
+}
+
+int cprintf_builder_printf(cprintf_builder* builder, const char* const format, ...) {
+	va_list arg;
+	int res;
+	va_start(arg, format);
+	res = cprintf_builder_vprintf(builder, format, arg);
+	va_end(arg);
+	return res;
+}
+
+int cprintf_builder_write(cprintf_builder* builder, const char* text, size_t len) {
+	if (!builder || (!text && len > 0))
+		return -1;
+	return builder_text(builder, text, len, &builder->color) ? 0 : -1;
+}
+
+int cprintf_builder_append(cprintf_builder* builder, const cprintf_builder* other) {
+	cprintf_color color;
+
+	if (!builder || !other || builder == other)
+		return -1;
+	// room for all of it first, so it goes in whole or not at all
+	if (!builder_grow((void**) &builder->text, &builder->capacity, builder->len, other->len, 1)
+		|| !builder_grow((void**) &builder->runs, &builder->run_capacity, builder->run_count, other->run_count, sizeof(builder_run)))
+		return -1;
+	for (size_t i = 0; i < other->run_count; ++i) {
+		color = builder->color;
+		fold_color(&color, &other->runs[i].color);
+		builder_text(builder, other->text + other->runs[i].start, other->runs[i].len, &color);
+	}
+	fold_color(&builder->color, &other->color);
+	return 0;
+}
+
+// Switches out over to what color does to start (if that's a change), the way a color sequence would
+void builder_color(cprintf_out* out, cprintf_attr_t start, const cprintf_color* color) {
+	cprintf_attr_t attributes = start;
+	apply_color(color, out->reset, &attributes);
+	if (attributes != out->attributes) {
+		out->attributes = attributes;
+		out->pending_colors++;
+	}
+}
+
+// Prints builder to sink (NULL for the terminal) as one call
+int builder_print(const cprintf_builder* builder, const cprintf_backend* sink) {
+	cprintf_out out;
+	cprintf_attr_t start;
+
+	if (!builder)
+		return -1;
+	startup_for(sink);
+	out_init(&out, sink);
+	start = out.attributes;
+	for (size_t i = 0; i < builder->run_count; ++i) {
+		if (out.colors)
+			builder_color(&out, start, &builder->runs[i].color);
+		out_write(&out, builder->text + builder->runs[i].start, builder->runs[i].len);
+	}
+	if (out.colors) // colors at the end stick, like they do for a format
+		builder_color(&out, start, &builder->color);
+	return out_finish(&out, (int) CPRINTF_MIN(builder->len, (size_t) INT_MAX));
+}
+
+int cprintf_builder_print(const cprintf_builder* builder) {
+	return builder_print(builder, NULL);
+}
+
+int cprintf_builder_print_to(const cprintf_builder* builder, cprintf_sink sink, void* ctx) {
+	sink_call call = { sink, ctx };
+	const cprintf_backend backend = { &call, sink_write, NULL, NULL, sink_encode, 0 };
+	if (!sink)
+		return -1;
+	return builder_print(builder, &backend);
+}
+
+// ======================
+// calls in pieces
+// ======================
+
+// A call that's put together from outside (cprintf.hpp). Each thread keeps one around.
+struct cprintf_call {
+	cprintf_out out;
+	bool busy; // a call is going on in it right now
+};
+
+cprintf_call* cprintf_call_begin(void) {
+	cprintf_call* call;
+	cprintf_call* fresh;
+
+	startup_previous();
+	call = tss_get(call_key);
+	if (!call) {
+		call = mem_alloc(sizeof(cprintf_call));
+		if (!call)
+			return NULL;
+		tss_set(call_key, call);
 	}
+	else if (call->busy) { // a call inside a call, so it only has to last as long as the one it's in
+		fresh = scratch_alloc(call->out.arena, sizeof(cprintf_call));
+		if (!fresh)
+			return NULL;
+		call = fresh;
+	}
+	call->busy = true;
+	out_init(&call->out, NULL);
+	return call;
+}
+
+void cprintf_call_write(cprintf_call* call, const char* bytes, size_t len) {
+	out_write(&call->out, bytes, len);
+}
+
+void cprintf_call_color(cprintf_call* call, cprintf_attr_t clear, cprintf_attr_t set, bool reset) {
+	const cprintf_color color = { clear, set, reset };
+	CPRINTF_STAT(stats_color(&call->out));
+	if (!call->out.colors)
+		return;
+	apply_color(&color, call->out.reset, &call->out.attributes);
+	call->out.pending_colors++;
+}
+
+int cprintf_call_printf(cprintf_call* call, const char* const spec, ...) {
+	va_list arg;
+	cprintf_args args;
+	cprintf_op op;
+	int chars_written = 0;
+	int res = 0;
+
+	va_start(arg, spec);
+	args_init(&args, &arg);
+	for (const char* ptr = spec; (ptr = next_op(spec, ptr, &op)) != NULL; ) {
+		res = run_op(&call->out, &op, spec, &args, chars_written);
+		if (res < 0)
+			break;
+		chars_written += res;
+	}
+	va_end(arg);
+	return res < 0 ? res : chars_written;
+}
+
+int cprintf_call_end(cprintf_call* call, int chars_written) {
+	int res = out_finish(&call->out, chars_written);
+	call->busy = false;
+	return res;
+}
+
+// ======================
+// entry points
+// ======================
+
+int cprintf(const char* const format, ...) {
+	va_list arg;
+	int res;
+	va_start(arg, format);
+	res = run_format(NULL, format, &arg);
+	va_end(arg);
+	return res;
+}
+int cwprintf(const wchar_t* const format, ...) {
+	va_list arg;
+	int res;
+	va_start(arg, format);
+	res = wrun_format(NULL, format, &arg);
+	va_end(arg);
+	return res;
+}
+
+int cvprintf(const char* const format, va_list arg) {
+	va_list copy;
+	int res;
+	va_copy(copy, arg);
+	res = run_format(NULL, format, &copy);
+	va_end(copy);
+	return res;
+}
+int cvwprintf(const wchar_t* const format, va_list arg) {
+	va_list copy;
+	int res;
+	va_copy(copy, arg);
+	res = wrun_format(NULL, format, &copy);
+	va_end(copy);
+	return res;
+}
+
+int cvprintf_to(cprintf_sink sink, void* ctx, const char* const format, va_list arg) {
+	sink_call call = { sink, ctx };
+	const cprintf_backend backend = { &call, sink_write, NULL, NULL, sink_encode, 0 };
+	va_list copy;
+	int res;
+	if (!sink)
+		return -1;
+	va_copy(copy, arg);
+	res = run_format(&backend, format, &copy);
+	va_end(copy);
+	return res;
+}
+int cprintf_to(cprintf_sink sink, void* ctx, const char* const format, ...) {
+	va_list arg;
+	int res;
+	va_start(arg, format);
+	res = cvprintf_to(sink, ctx, format, arg);
+	va_end(arg);
+	return res;
+}
+
+int cvfprintf(FILE* file, const char* const format, va_list arg) {
+	const cprintf_backend backend = { file, file_write, NULL, NULL, sink_encode, 0 };
+	va_list copy;
+	int res;
+	if (!file)
+		return -1;
+	va_copy(copy, arg);
+	res = run_format(&backend, format, &copy);
+	va_end(copy);
+	return res;
+}
+int cfprintf(FILE* file, const char* const format, ...) {
+	va_list arg;
+	int res;
+	va_start(arg, format);
+	res = cvfprintf(file, format, arg);
+	va_end(arg);
+	return res;
+}
+
+int cvsnprintf(char* buf, size_t size, const char* const format, va_list arg) {
+	string_sink str = { buf, buf ? size : 0, 0 };
+	const cprintf_backend backend = { &str, string_write, NULL, NULL, sink_encode, 0 };
+	va_list copy;
+	int res;
+	va_copy(copy, arg);
+	res = run_format(&backend, format, &copy);
+	va_end(copy);
+	if (str.size > 0) // always terminated, even if it got cut short
+		buf[CPRINTF_MIN(str.len, str.size - 1)] = '\0';
+	if (res < 0 || str.len > INT_MAX)
+		return -1;
+	return (int) str.len;
+}
+int csnprintf(char* buf, size_t size, const char* const format, ...) {
+	va_list arg;
+	int res;
+	va_start(arg, format);
+	res = cvsnprintf(buf, size, format, arg);
+	va_end(arg);
+	return res;
+}
+
+int cprintf_compiled(const cprintf_fmt* fmt, ...) {
+	va_list arg;
+	int res;
+	if (!fmt)
+		return -1;
+	va_start(arg, fmt);
+	res = run_compiled(NULL, fmt, &arg);
 	va_end(arg);
-	return (int) chars_written;
-}
\ No newline at end of file
+	return res;
+}
@@ -1,16 +1,502 @@
-#if defined(_MSC_VER) // only windows
 #if !defined(__CPRINTF_H__)
 #define __CPRINTF_H__
 #include <wchar.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdint.h>
+#if defined(_WIN32)
 #include <windows.h>
 #include <wincon.h>
-#include <stdbool.h>
+#endif
+
+/* Text attributes are stored as a Windows console attribute word (see wincon.h) on every platform, in the low 16 bits.
+* Non-Windows builds get the same bit names so backends can decode the word the same way everywhere.
+* 256-color and 24-bit colors ride along in the rest (see CPRINTF_FG_256 below).
+*/
+typedef uint64_t cprintf_attr_t;
+
+#if !defined(_WIN32)
+#define FOREGROUND_BLUE 0x0001
+#define FOREGROUND_GREEN 0x0002
+#define FOREGROUND_RED 0x0004
+#define FOREGROUND_INTENSITY 0x0008
+#define BACKGROUND_BLUE 0x0010
+#define BACKGROUND_GREEN 0x0020
+#define BACKGROUND_RED 0x0040
+#define BACKGROUND_INTENSITY 0x0080
+#define COMMON_LVB_REVERSE_VIDEO 0x4000
+#define COMMON_LVB_UNDERSCORE 0x8000
+#endif
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/* What each SGR number in a color sequence does: optionally go back to the previous attributes (reset), then
+* clear some bits, then set some. Numbers that aren't listed do nothing. cprintf.hpp reads this too.
+*/
+#define CPRINTF_SGR_TABLE(X) \
+	X(0, 0, 0, true) /* reset */ \
+	X(1, 0, FOREGROUND_INTENSITY, false) /* bold (intensity), only foreground */ \
+	X(4, 0, COMMON_LVB_UNDERSCORE, false) /* underline */ \
+	X(7, 0, COMMON_LVB_REVERSE_VIDEO, false) /* inverse */ \
+	X(21, FOREGROUND_INTENSITY, 0, false) /* bold off (intensity) */ \
+	X(22, FOREGROUND_INTENSITY, 0, false) /* normal intensity */ \
+	X(24, COMMON_LVB_UNDERSCORE, 0, false) /* underline off */ \
+	X(27, COMMON_LVB_REVERSE_VIDEO, 0, false) /* inverse off */ \
+	X(30, CPRINTF_FG_ALL | CPRINTF_FG_EXTENDED, 0, false) /* black */ \
+	X(31, CPRINTF_FG_ALL | CPRINTF_FG_EXTENDED, FOREGROUND_RED, false) /* red */ \
+	X(32, CPRINTF_FG_ALL | CPRINTF_FG_EXTENDED, FOREGROUND_GREEN, false) /* green */ \
+	X(33, CPRINTF_FG_ALL | CPRINTF_FG_EXTENDED, FOREGROUND_RED | FOREGROUND_GREEN, false) /* yellow */ \
+	X(34, CPRINTF_FG_ALL | CPRINTF_FG_EXTENDED, FOREGROUND_BLUE, false) /* blue */ \
+	X(35, CPRINTF_FG_ALL | CPRINTF_FG_EXTENDED, FOREGROUND_RED | FOREGROUND_BLUE, false) /* magenta */ \
+	X(36, CPRINTF_FG_ALL | CPRINTF_FG_EXTENDED, FOREGROUND_GREEN | FOREGROUND_BLUE, false) /* cyan */ \
+	X(37, CPRINTF_FG_ALL | CPRINTF_FG_EXTENDED, CPRINTF_FG_ALL, false) /* white */ \
+	X(40, CPRINTF_BG_ALL | BACKGROUND_INTENSITY | CPRINTF_BG_EXTENDED, 0, false) /* black */ \
+	X(41, CPRINTF_BG_ALL | BACKGROUND_INTENSITY | CPRINTF_BG_EXTENDED, BACKGROUND_RED, false) /* red */ \
+	X(42, CPRINTF_BG_ALL | BACKGROUND_INTENSITY | CPRINTF_BG_EXTENDED, BACKGROUND_GREEN, false) /* green */ \
+	X(43, CPRINTF_BG_ALL | BACKGROUND_INTENSITY | CPRINTF_BG_EXTENDED, BACKGROUND_RED | BACKGROUND_GREEN, false) /* yellow */ \
+	X(44, CPRINTF_BG_ALL | BACKGROUND_INTENSITY | CPRINTF_BG_EXTENDED, BACKGROUND_BLUE, false) /* blue */ \
+	X(45, CPRINTF_BG_ALL | BACKGROUND_INTENSITY | CPRINTF_BG_EXTENDED, BACKGROUND_RED | BACKGROUND_BLUE, false) /* magenta */ \
+	X(46, CPRINTF_BG_ALL | BACKGROUND_INTENSITY | CPRINTF_BG_EXTENDED, BACKGROUND_GREEN | BACKGROUND_BLUE, false) /* cyan */ \
+	X(47, CPRINTF_BG_ALL | BACKGROUND_INTENSITY | CPRINTF_BG_EXTENDED, CPRINTF_BG_ALL, false) /* white */ \
+	X(90, CPRINTF_FG_ALL | CPRINTF_FG_EXTENDED, FOREGROUND_INTENSITY, false) /* bright black */ \
+	X(91, CPRINTF_FG_ALL | CPRINTF_FG_EXTENDED, FOREGROUND_RED | FOREGROUND_INTENSITY, false) /* bright red */ \
+	X(92, CPRINTF_FG_ALL | CPRINTF_FG_EXTENDED, FOREGROUND_GREEN | FOREGROUND_INTENSITY, false) /* bright green */ \
+	X(93, CPRINTF_FG_ALL | CPRINTF_FG_EXTENDED, FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_INTENSITY, false) /* bright yellow */ \
+	X(94, CPRINTF_FG_ALL | CPRINTF_FG_EXTENDED, FOREGROUND_BLUE | FOREGROUND_INTENSITY, false) /* bright blue */ \
+	X(95, CPRINTF_FG_ALL | CPRINTF_FG_EXTENDED, FOREGROUND_RED | FOREGROUND_BLUE | FOREGROUND_INTENSITY, false) /* bright magenta */ \
+	X(96, CPRINTF_FG_ALL | CPRINTF_FG_EXTENDED, FOREGROUND_GREEN | FOREGROUND_BLUE | FOREGROUND_INTENSITY, false) /* bright cyan */ \
+	X(97, CPRINTF_FG_ALL | CPRINTF_FG_EXTENDED, CPRINTF_FG_ALL | FOREGROUND_INTENSITY, false) /* bright white */ \
+	X(100, CPRINTF_BG_ALL | BACKGROUND_INTENSITY | CPRINTF_BG_EXTENDED, BACKGROUND_INTENSITY, false) /* bright black */ \
+	X(101, CPRINTF_BG_ALL | BACKGROUND_INTENSITY | CPRINTF_BG_EXTENDED, BACKGROUND_RED | BACKGROUND_INTENSITY, false) /* bright red */ \
+	X(102, CPRINTF_BG_ALL | BACKGROUND_INTENSITY | CPRINTF_BG_EXTENDED, BACKGROUND_GREEN | BACKGROUND_INTENSITY, false) /* bright green */ \
+	X(103, CPRINTF_BG_ALL | BACKGROUND_INTENSITY | CPRINTF_BG_EXTENDED, BACKGROUND_RED | BACKGROUND_GREEN | BACKGROUND_INTENSITY, false) /* bright yellow */ \
+	X(104, CPRINTF_BG_ALL | BACKGROUND_INTENSITY | CPRINTF_BG_EXTENDED, BACKGROUND_BLUE | BACKGROUND_INTENSITY, false) /* bright blue */ \
+	X(105, CPRINTF_BG_ALL | BACKGROUND_INTENSITY | CPRINTF_BG_EXTENDED, BACKGROUND_RED | BACKGROUND_BLUE | BACKGROUND_INTENSITY, false) /* bright magenta */ \
+	X(106, CPRINTF_BG_ALL | BACKGROUND_INTENSITY | CPRINTF_BG_EXTENDED, BACKGROUND_GREEN | BACKGROUND_BLUE | BACKGROUND_INTENSITY, false) /* bright cyan */ \
+	X(107, CPRINTF_BG_ALL | BACKGROUND_INTENSITY | CPRINTF_BG_EXTENDED, CPRINTF_BG_ALL | BACKGROUND_INTENSITY, false) /* bright white */
+
+#if defined(CPRINTF_FG_ALL) || defined(CPRINTF_BG_ALL) || defined(CPRINTF_SGR_COUNT) || defined(CPRINTF_SGR_FIELD_MAX)
+#error Macro clash!
+#endif
+#define CPRINTF_FG_ALL (FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE)
+#define CPRINTF_BG_ALL (BACKGROUND_RED | BACKGROUND_GREEN | BACKGROUND_BLUE)
+// numbers at or past this do nothing (38 and 48 aren't in the table, they start an extended color)
+#define CPRINTF_SGR_COUNT 108
+// numbers in a color sequence stop being read at this size, anything bigger is ignored
+#define CPRINTF_SGR_FIELD_MAX 1000
+
+/* Extended colors: 38;5;n picks one of the 256 xterm colors and 38;2;r;g;b a 24-bit one (48 instead of 38 for the background).
+* The color goes in bits 16-39 (foreground) or 40-63 (background) of the attribute word, as the index or 0xRRGGBB,
+* with a flag in bits 8-11 saying which. Those bits are the console's DBCS and grid bits, which cprintf never uses.
+* While a flag is set, the word's own bits for that color don't mean anything (but the intensity bit is still bold).
+*/
+#if defined(CPRINTF_FG_256) || defined(CPRINTF_FG_RGB) || defined(CPRINTF_BG_256) || defined(CPRINTF_BG_RGB) \
+	|| defined(CPRINTF_FG_SHIFT) || defined(CPRINTF_BG_SHIFT) || defined(CPRINTF_FG_EXTENDED) || defined(CPRINTF_BG_EXTENDED) \
+	|| defined(CPRINTF_FG_VALUE) || defined(CPRINTF_BG_VALUE)
+#error Macro clash!
+#endif
+#define CPRINTF_FG_256 0x0100
+#define CPRINTF_FG_RGB 0x0200
+#define CPRINTF_BG_256 0x0400
+#define CPRINTF_BG_RGB 0x0800
+#define CPRINTF_FG_SHIFT 16
+#define CPRINTF_BG_SHIFT 40
+// everything that says what extended foreground/background there is
+#define CPRINTF_FG_EXTENDED (CPRINTF_FG_256 | CPRINTF_FG_RGB | ((cprintf_attr_t) 0xFFFFFF << CPRINTF_FG_SHIFT))
+#define CPRINTF_BG_EXTENDED (CPRINTF_BG_256 | CPRINTF_BG_RGB | ((cprintf_attr_t) 0xFFFFFF << CPRINTF_BG_SHIFT))
+#define CPRINTF_FG_VALUE(attrs) ((uint32_t) ((attrs) >> CPRINTF_FG_SHIFT) & 0xFFFFFF)
+#define CPRINTF_BG_VALUE(attrs) ((uint32_t) ((attrs) >> CPRINTF_BG_SHIFT) & 0xFFFFFF)
+
+/* Where cprintf sends its output. Every callback returns 0 on success and -1 on failure.
+* write: writes len bytes
+* set_attributes: makes attrs the attributes of everything written afterwards
+* get_attributes: reports the attributes currently in effect
+* encode_attributes (optional, can be NULL): puts the bytes that would switch to attrs into buf (at most
+*   CPRINTF_ENCODE_MAX of them) and returns how many. Backends that draw colors in-band (escape sequences)
+*   should have one so atomic writes can keep the colors in the same write as the text.
+* mark (optional, 0 for none): a byte that starts what encode_attributes writes and that the backend looks for
+*   in what it's given. cprintf writes that byte twice wherever it shows up in the text itself, so the backend
+*   can tell the two apart (the console backend's is 0xFF).
+*/
+#define CPRINTF_ENCODE_MAX 64
+
+typedef struct cprintf_backend {
+	void* ctx;
+	int (*write)(void* ctx, const char* bytes, size_t len);
+	int (*set_attributes)(void* ctx, cprintf_attr_t attrs);
+	int (*get_attributes)(void* ctx, cprintf_attr_t* pAttrs);
+	size_t (*encode_attributes)(void* ctx, cprintf_attr_t attrs, char* buf);
+	unsigned char mark;
+} cprintf_backend;
+
+/* What a Windows console does, as far as cprintf is concerned, so the console backend can be pointed at something
+* other than the real thing (like a mock that records the calls, on any platform). Each returns 0 or -1 on failure.
+* set_attribute: SetConsoleTextAttribute
+* get_info: GetConsoleScreenBufferInfo (the attribute, where the cursor is and how wide the buffer is)
+* write_text: WriteConsoleW, len is in UTF-16 units
+* write_cells (optional, can be NULL): WriteConsoleOutputW of count cells, from (x, y) along one row. It doesn't
+*   move the cursor or change the attribute.
+*/
+typedef struct cprintf_console_info {
+	unsigned short attr;
+	int x;
+	int y;
+	int width;
+} cprintf_console_info;
+
+typedef struct cprintf_console_cell {
+	uint16_t ch;
+	unsigned short attr;
+} cprintf_console_cell;
 
+typedef struct cprintf_console {
+	void* ctx;
+	int (*set_attribute)(void* ctx, unsigned short attr);
+	int (*get_info)(void* ctx, cprintf_console_info* pInfo);
+	int (*write_text)(void* ctx, const uint16_t* text, size_t len);
+	int (*write_cells)(void* ctx, const cprintf_console_cell* cells, size_t count, int x, int y);
+} cprintf_console;
+
+/* Fills in *pBackend to draw to console. Text is converted from UTF-8, and extended colors are brought down to the 16.
+* That goes for narrow text too: it has to be UTF-8, since anything else (like text in the ANSI code page, which
+* printf used to leave to the console) comes out as U+FFFD.
+* It can encode attributes, so with atomic writes (or in async mode) a whole call reaches it in one write: that's
+* cut into runs of text in one attribute, and each run costs one set_attribute and one write_text. A whole line
+* with a few color changes in it goes out in one write_cells instead (get_info, write_cells and the newline).
+* Without atomic writes, every color change is its own set_attribute call like any other backend.
+* The backend points at console, so keep that around while it's in use.
+*/
+void cprintf_console_backend(const cprintf_console* console, cprintf_backend* pBackend);
+
+#if defined(_WIN32)
+// The console backend on the real console (STD_OUTPUT_HANDLE), or plain UTF-8 with WriteFile if that isn't a console
+const cprintf_backend* cprintf_win32_backend(void);
+#else
+// ANSI/VT escape sequences written to STDOUT_FILENO with write(2)
+const cprintf_backend* cprintf_posix_backend(void);
+#endif
+
+// The ANSI sequence for attrs (treating light gray on black as the terminal's default), for backends that want one.
+// Extended colors are written as they are, so cprintf_downgrade them first if the terminal can't show that many.
+// buf needs room for CPRINTF_ENCODE_MAX chars. Returns how many it used.
+size_t cprintf_encode_ansi(cprintf_attr_t attrs, char* buf);
+
+/* How many colors the terminal can show. It's worked out once, the first time it's needed:
+* - nothing if NO_COLOR is set, or stdout isn't a terminal (redirected to a file or a pipe, running under
+*   systemd...), or TERM is missing or dumb
+* - truecolor if COLORTERM says truecolor or 24bit, 256 if TERM mentions 256color, 16 otherwise
+* - on Windows: nothing if stdout isn't a console, truecolor if the console takes VT sequences, 16 otherwise
+* With no colors, color sequences are dropped and the backend never hears about them (no get or set calls).
+*
+* What's detected only goes for the default backend, since it's about stdout. cprintf_set_color_level overrides
+* it for any backend, and CPRINTF_COLOR_AUTO goes back to detecting. cprintf_get_color_level says what the
+* terminal output is getting right now. cprintf_detect_color_level does the checks again and returns what it finds.
+* Sinks (cfprintf, csnprintf...) always get colors.
+*/
+typedef enum cprintf_color_level {
+	CPRINTF_COLOR_AUTO = -1,
+	CPRINTF_COLOR_NONE,
+	CPRINTF_COLOR_16,
+	CPRINTF_COLOR_256,
+	CPRINTF_COLOR_TRUECOLOR
+} cprintf_color_level;
+
+cprintf_color_level cprintf_detect_color_level(void);
+void cprintf_set_color_level(cprintf_color_level level);
+cprintf_color_level cprintf_get_color_level(void);
+
+/* Which loop looks for the next % in a format. The best one for the CPU is picked the first time it's needed
+* (AVX2, then SSE2 on x86, and strcspn/wcscspn everywhere else), so this is only for comparing them, like
+* cprintf_bench does. Returns -1 if the CPU or the build doesn't have that one (the one in use stays).
+* It isn't synchronized with printing, so call it while nothing else is printing.
+*/
+typedef enum cprintf_scanner {
+	CPRINTF_SCANNER_AUTO,
+	CPRINTF_SCANNER_SCALAR,
+	CPRINTF_SCANNER_SSE2,
+	CPRINTF_SCANNER_AVX2
+} cprintf_scanner;
+
+int cprintf_set_scanner(cprintf_scanner scanner);
+
+/* attrs with its extended colors brought down to what level can show: 24-bit colors become the closest of the
+* 256 at CPRINTF_COLOR_256, and at CPRINTF_COLOR_16 (or below) everything becomes the closest of the 16 in the
+* word's own bits. The 16-color match is a lookup in a table of every 15-bit color, built the first time it's needed.
+* The default backends do this themselves, call it from yours if it can't show everything.
+*/
+cprintf_attr_t cprintf_downgrade(cprintf_attr_t attrs, cprintf_color_level level);
+
+// Passing NULL restores the platform's default backend. Don't switch backends while other threads are printing.
+void cprintf_set_backend(const cprintf_backend* backend);
+const cprintf_backend* cprintf_get_backend(void);
+
+#if defined(_WIN32)
 extern CONSOLE_SCREEN_BUFFER_INFO cprintf_previous_screen_buffer_info;
+#endif
+// the attributes that were in effect before the first call (what %[0m goes back to)
+extern cprintf_attr_t cprintf_previous_attributes;
 extern bool cprintf_set_previous;
 
+/* How often cprintf has had to talk to the backend about attributes.
+* cprintf keeps its own copy of the current attributes (read once, when cprintf_set_previous is false),
+* so a color sequence that doesn't change anything never reaches the backend. Color sequences with no
+* text between them are merged into one change.
+* If something other than cprintf changes the colors, set cprintf_set_previous back to false.
+*/
+typedef struct cprintf_counters {
+	unsigned long long get_attributes_calls;
+	unsigned long long set_attributes_calls;
+	unsigned long long set_attributes_elided; // color sequences that didn't change anything
+	unsigned long long async_dropped; // calls thrown away because the async ring was full
+} cprintf_counters;
+
+void cprintf_get_counters(cprintf_counters* pCounters);
+void cprintf_reset_counters(void);
+
+/* Wide text (cwprintf, and %ls/%lc anywhere) always comes out as UTF-8, whatever the locale is.
+* Arguments can be numbered like POSIX printf's (%2$s, counting from 1, up to 32 of them), so one can be used more
+* than once. The first conversion decides: if it has a number, a conversion without one takes the argument after
+* the one before it; if it doesn't, a numbered one later on is an error. So is skipping a number or using one
+* argument as two different types. The call stops at the error and returns -1.
+* A width or precision can come from the arguments too (%*.*f, or %3$*1$.*2$f), as an int before the value. A
+* negative width means -, and a negative precision means there isn't one.
+*/
 int cprintf(const char* const format, ...);
 int cwprintf(const wchar_t* const format, ...);
+int cvprintf(const char* const format, va_list arg);
+int cvwprintf(const wchar_t* const format, va_list arg);
+
+/* Printing somewhere other than the terminal.
+* The output starts out in the default colors every time and colors are written into it as ANSI sequences,
+* whatever the backend is. These return what cprintf would, except csnprintf which works like snprintf: it
+* returns the length of the whole output (escape sequences included) even if buf was too small for it, and
+* always terminates buf when size isn't 0. It doesn't allocate anything after a thread's first call (which sets up
+* its scratch arena). A single conversion that's left to printf and comes out longer than 4 KiB is formatted in
+* that arena first, though, and one longer than what the arena keeps (see Memory below) allocates every time.
+* A sink gets the bytes a piece at a time and returns 0, or -1 to fail the call.
+*/
+typedef int (*cprintf_sink)(void* ctx, const char* bytes, size_t len);
+
+int cfprintf(FILE* file, const char* const format, ...);
+int cvfprintf(FILE* file, const char* const format, va_list arg);
+int csnprintf(char* buf, size_t size, const char* const format, ...);
+int cvsnprintf(char* buf, size_t size, const char* const format, va_list arg);
+int cprintf_to(cprintf_sink sink, void* ctx, const char* const format, ...);
+int cvprintf_to(cprintf_sink sink, void* ctx, const char* const format, va_list arg);
+
+/* Stats, for finding out how much time goes into printing without attaching a profiler.
+* They're only kept if cprintf.c is built with CPRINTF_STATS defined (the CPRINTF_STATS option in CMakeLists.txt).
+* Otherwise none of it is compiled in, and a snapshot is all zeros and returns -1.
+* Every thread counts into its own shard, and a snapshot adds them all up, so reading them while other threads
+* print is fine (the numbers are just a moment old). They only ever go up.
+*
+* Call latency (from the start of the call to its output being handed over) goes in a log-linear histogram:
+* below CPRINTF_STATS_SUB ns every ns gets its own bucket, and after that every power of two is split into
+* CPRINTF_STATS_SUB buckets, so a bucket is never more than about 6% wide. Anything from about 18 minutes up
+* goes in the last one.
+*/
+#if defined(CPRINTF_STATS_SUB_BITS) || defined(CPRINTF_STATS_SUB) || defined(CPRINTF_STATS_BUCKETS)
+#error Macro clash!
+#endif
+#define CPRINTF_STATS_SUB_BITS 4
+#define CPRINTF_STATS_SUB (1 << CPRINTF_STATS_SUB_BITS)
+#define CPRINTF_STATS_BUCKETS ((40 - CPRINTF_STATS_SUB_BITS + 1) * CPRINTF_STATS_SUB)
+
+// what a conversion is, by its ending character
+typedef enum cprintf_conversion_type {
+	CPRINTF_CONVERSION_SIGNED, // d i
+	CPRINTF_CONVERSION_UNSIGNED, // u o x X
+	CPRINTF_CONVERSION_FLOAT, // f F e E g G a A
+	CPRINTF_CONVERSION_CHAR, // c
+	CPRINTF_CONVERSION_STRING, // s
+	CPRINTF_CONVERSION_POINTER, // p
+	CPRINTF_CONVERSION_COUNT, // n
+	CPRINTF_CONVERSION_TYPES
+} cprintf_conversion_type;
+
+typedef struct cprintf_stats {
+	unsigned long long calls; // calls that printed something (including to sinks and frames)
+	unsigned long long bytes; // bytes handed to the backend or a sink
+	unsigned long long writes; // times bytes were handed over (backend or sink writes, async slots)
+	unsigned long long conversions[CPRINTF_CONVERSION_TYPES];
+	unsigned long long color_sequences; // color sequences carried out (whether or not they changed anything)
+	unsigned long long get_attributes_calls; // the same as in cprintf_counters
+	unsigned long long set_attributes_calls;
+	unsigned long long flushes; // cprintf_flush calls
+	unsigned long long latency_sum_ns;
+	unsigned long long latency_max_ns;
+	unsigned long long latency[CPRINTF_STATS_BUCKETS]; // how many calls took each bucket's time
+} cprintf_stats;
+
+int cprintf_stats_snapshot(cprintf_stats* pStats);
+// The first latency (in ns) that's too much for bucket i, so bucket i holds calls that took less than this
+unsigned long long cprintf_stats_bucket_limit(int bucket);
+// The latency q (0 to 1) of the calls took no more than, to within a bucket (0.99 for p99)
+unsigned long long cprintf_stats_percentile(const cprintf_stats* stats, double q);
+/* Writes a snapshot to sink in the Prometheus text format: counters named cprintf_*_total and the latency as
+* the histogram cprintf_call_duration_seconds (with a bucket at every power of two ns). Returns -1 if the sink failed.
+*/
+int cprintf_stats_dump(cprintf_sink sink, void* ctx);
+
+/* Frames, for status panels and progress bars that get redrawn over and over.
+* A frame is a grid of cells (a character and its attributes) that you print into instead of the terminal.
+* cprintf_frame_printf prints at a row and column of the grid (starting from 0), in the default colors like a sink.
+* A newline goes down a row and back to that column, and whatever falls outside the grid is cut off.
+* Every character takes one cell, so East Asian wide characters will throw the columns off.
+* cprintf_frame_clear blanks the whole grid. Cells keep what was printed into them until it's printed over.
+*
+* cprintf_frame_present puts the grid on the terminal. The first time it draws every line, starting from
+* where the cursor is. After that it only writes the cells that changed since the last present, moving the
+* cursor to them with ANSI sequences, so the terminal has to understand those (on Windows, a console with
+* VT processing). It leaves the cursor at the start of the line under the frame, so don't print anything
+* else in between presents, and the frame has to fit on the screen. cprintf_frame_invalidate makes the next
+* present draw the whole frame again from wherever the cursor is.
+* With atomic writes on, a present goes out in one write.
+* new returns NULL if it's out of memory. present returns 0, or -1 if the backend failed.
+*/
+typedef struct cprintf_frame cprintf_frame;
+
+cprintf_frame* cprintf_frame_new(int width, int height);
+void cprintf_frame_free(cprintf_frame* frame);
+void cprintf_frame_clear(cprintf_frame* frame);
+int cprintf_frame_printf(cprintf_frame* frame, int row, int col, const char* const format, ...);
+int cprintf_frame_vprintf(cprintf_frame* frame, int row, int col, const char* const format, va_list arg);
+int cprintf_frame_present(cprintf_frame* frame);
+void cprintf_frame_invalidate(cprintf_frame* frame);
+
+/* Builders, for output that's put together from pieces, like a colored prefix that's the same every time.
+* A builder keeps the text and which colors each part of it is in, so a piece that's been built once can be
+* copied into another builder (cprintf_builder_append) without reading its format again.
+* cprintf_builder_printf reads a format into the builder like cprintf would print it, and cprintf_builder_write
+* adds plain text. Printing a builder is one call, and leaves the colors it ends in for whatever comes next
+* (just like a format). Colors are only worked out then, so %[0m in a builder goes back to whatever the
+* terminal (or sink) goes back to.
+* cprintf_builder_clear empties a builder but keeps its memory, so a builder that's reused doesn't allocate once
+* it's been as big as it gets. Everything that can fail returns -1 (and leaves the builder as it was, except printf).
+* A builder isn't safe to change from two threads at once, but printing the same one from several is fine.
+*/
+typedef struct cprintf_builder cprintf_builder;
+
+cprintf_builder* cprintf_builder_new(void);
+void cprintf_builder_free(cprintf_builder* builder);
+void cprintf_builder_clear(cprintf_builder* builder);
+int cprintf_builder_printf(cprintf_builder* builder, const char* const format, ...);
+int cprintf_builder_vprintf(cprintf_builder* builder, const char* const format, va_list arg);
+int cprintf_builder_write(cprintf_builder* builder, const char* text, size_t len);
+int cprintf_builder_append(cprintf_builder* builder, const cprintf_builder* other);
+int cprintf_builder_print(const cprintf_builder* builder);
+int cprintf_builder_print_to(const cprintf_builder* builder, cprintf_sink sink, void* ctx);
+
+/* Threads.
+* Every function here can be called from any thread. By default a call can still be split into several writes
+* (when the buffer fills up or, on the Win32 backend, at every color change), so lines from different threads
+* can end up mixed together.
+*
+* With atomic writes on, each call is formatted into a buffer that belongs to the calling thread and goes out
+* in a single write, colors and all, so lines never get mixed up. If the backend can't encode colors
+* the calls take turns instead.
+*/
+void cprintf_set_atomic_writes(bool enabled);
+
+/* Async mode.
+* cprintf_start_async starts a thread that does all the writing. A call formats its output, puts it in a ring
+* of slots (rounded up to a power of 2) and returns without waiting for the backend. The writer thread writes
+* everything in the order it was queued, batching as much as it can into one write.
+* When the ring is full, overflow decides what happens: the call waits for room, the new output is dropped,
+* or the oldest queued output is dropped to make room. Drops are counted in cprintf_counters.
+*
+* cprintf_flush returns once everything queued before it was called has been written.
+* cprintf_stop_async writes what's left and stops the thread (it also runs at exit). Don't start or stop async
+* mode while other threads are printing.
+* Starting fails (-1) if it's already running or the backend can't encode colors.
+*/
+typedef enum cprintf_overflow {
+	CPRINTF_OVERFLOW_BLOCK,
+	CPRINTF_OVERFLOW_DROP_NEWEST,
+	CPRINTF_OVERFLOW_DROP_OLDEST
+} cprintf_overflow;
+
+int cprintf_start_async(size_t slots, cprintf_overflow overflow);
+void cprintf_stop_async(void);
+void cprintf_flush(void);
+
+/* Memory.
+* Everything cprintf allocates (compiled formats, frames, builders, each thread's buffers...) comes from the
+* allocator set here, or malloc, realloc and free if it's NULL. Set it before anything else and leave it (cprintf
+* keeps the pointer, not a copy): memory goes back to whichever allocator is set when it's freed. resize gets a
+* ptr that isn't NULL, and release a ptr from alloc or resize.
+*
+* What a call only needs while it's going on comes out of a scratch arena each thread keeps and takes back when
+* the call's done, so once a thread has made a few calls, printing doesn't allocate anything. Building with
+* CPRINTF_NO_MALLOC defined makes sure of it: an allocation in the middle of a call asserts, once the thread's
+* finished its first one. The only thing that still allocates is async mode with a call whose output doesn't
+* fit in a slot (more than 224 bytes), so keep those short in that build.
+*/
+typedef struct cprintf_allocator {
+	void* ctx;
+	void* (*alloc)(void* ctx, size_t size);
+	void* (*resize)(void* ctx, void* ptr, size_t size);
+	void (*release)(void* ctx, void* ptr);
+} cprintf_allocator;
+
+void cprintf_set_allocator(const cprintf_allocator* allocator);
+
+/* Compiled formats.
+* cprintf_compile reads a format once so cprintf_compiled can print it as many times as you want without
+* reading it again. The compiled format keeps its own copy of the string. Free it with cprintf_fmt_free.
+*
+* cprintf_cache compiles a format the first time it sees that *pointer* and hands back the same compiled
+* format every time after that. Only give it strings that never change (string literals), and don't free
+* what it gives you.
+*/
+typedef struct cprintf_fmt cprintf_fmt;
+
+cprintf_fmt* cprintf_compile(const char* const format);
+void cprintf_fmt_free(cprintf_fmt* fmt);
+const cprintf_fmt* cprintf_cache(const char* const format);
+int cprintf_compiled(const cprintf_fmt* fmt, ...);
+
+/* Deferred printing.
+* cprintf_deferred doesn't print anything. It writes a binary record of the call into buf (which format, plus
+* the raw bytes of the arguments, strings included) and returns how many bytes that took. If that's more than
+* size then buf doesn't hold anything useful, so try again with a bigger one. It returns 0 for formats it can't
+* record (%n, or a * width or precision). Like cprintf_cache, only give it strings that never change.
+*
+* A decoder prints records later, colors and all, exactly like cprintf would have. The first record for each
+* format carries the format's text, so a decoder in another program can make sense of the rest as long as it
+* gets every record in the order they were made (see tools/cprintf_decode.c).
+* cprintf_decode prints every whole record in data and returns how many bytes it used (a record cut off at the
+* end is left for the next call), or -1 if the data is broken. Records are only readable on the same kind of
+* machine that wrote them.
+*/
+size_t cprintf_deferred(void* buf, size_t size, const char* const format, ...);
+
+typedef struct cprintf_decoder cprintf_decoder;
+
+cprintf_decoder* cprintf_decoder_new(void);
+void cprintf_decoder_free(cprintf_decoder* decoder);
+ptrdiff_t cprintf_decode(cprintf_decoder* decoder, const void* data, size_t size);
+
+/* One call, a piece at a time, for front ends that read their formats ahead of time (like cprintf.hpp).
+* cprintf_call_begin starts a call to the terminal just like cprintf would, and cprintf_call_end finishes it and
+* returns what cprintf would have, given how many characters were written. In between, text and color changes
+* (see CPRINTF_SGR_TABLE) can be added, and cprintf_call_printf runs a format through it and returns how many
+* characters that wrote. begin returns NULL if it's out of memory. A call belongs to the thread that started it.
+*/
+typedef struct cprintf_call cprintf_call;
+
+cprintf_call* cprintf_call_begin(void);
+void cprintf_call_write(cprintf_call* call, const char* bytes, size_t len);
+void cprintf_call_color(cprintf_call* call, cprintf_attr_t clear, cprintf_attr_t set, bool reset);
+int cprintf_call_printf(cprintf_call* call, const char* const spec, ...);
+int cprintf_call_end(cprintf_call* call, int chars_written);
+
+#if defined(__cplusplus)
+}
+#endif
 
 #endif // __CPRINTF_H__
-#endif // _MSC_VER
\ No newline at end of file
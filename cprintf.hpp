@@ -0,0 +1,679 @@
+/* A C++20 front end for cprintf that reads the format while compiling.
+*
+*     cprint::format<"%[1;31merror:%[0m %s (code %d)\n">(message, code);
+*
+* The format string is read at compile time with the same rules cprintf uses. Color sequences are folded into
+* the attribute bits they change, the arguments are checked against their conversions (a mismatch, a missing
+* argument or an extra one doesn't compile), and each call turns into a straight run of writes with nothing left
+* to parse. Integers, chars and strings are formatted right here. Everything else (floats, pointers, wide text,
+* precision on integers, #) goes to the C side one conversion at a time, so it comes out exactly like cprintf's.
+*
+* The output goes wherever cprintf's goes (backends, atomic writes and async mode included). On top of what
+* cprintf takes, %s takes std::string and std::string_view. %n, * widths and numbered arguments (%2$s) aren't
+* supported.
+*/
+
+#if !defined(__CPRINTF_HPP__)
+#define __CPRINTF_HPP__
+#include "cprintf.h"
+#include <array>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cwchar>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace cprint {
+
+// A string literal that can be a template argument
+template <std::size_t N>
+struct fixed_string {
+	char text[N] {};
+
+	consteval fixed_string(const char (&str)[N]) {
+		for (std::size_t i = 0; i < N; ++i)
+			text[i] = str[i];
+	}
+
+	// up to the first terminator, like cprintf reads it
+	constexpr std::size_t size() const {
+		std::size_t len = 0;
+		while (len < N && text[len] != '\0')
+			++len;
+		return len;
+	}
+};
+
+namespace detail {
+
+enum class op_type : unsigned char {
+	none, // nothing to do (an unfinished or unknown sequence)
+	literal,
+	color,
+	conversion
+};
+
+enum class length : unsigned char { none, hh, h, l, ll, j, z, t, big_l };
+
+// what a conversion takes
+enum class arg_kind : unsigned char {
+	none,
+	signed_int,
+	unsigned_int,
+	floating,
+	character,
+	wide_character,
+	string,
+	wide_string,
+	pointer
+};
+
+// The same thing cprintf.c's ops are, worked out at compile time
+struct op {
+	op_type type = op_type::none;
+	std::size_t start = 0; // where its text starts in the format
+	std::size_t size = 0;
+
+	// colors
+	cprintf_attr_t clear = 0;
+	cprintf_attr_t set = 0;
+	bool reset = false;
+
+	// conversions
+	char conversion = 0;
+	length len = length::none;
+	bool left = false;
+	bool plus = false;
+	bool space = false;
+	bool alt = false;
+	bool zero = false;
+	int width = -1;
+	int precision = -1;
+	arg_kind kind = arg_kind::none;
+	bool local = false; // formatted here instead of on the C side
+	std::size_t arg = 0; // which argument it takes
+};
+
+// Never defined on purpose. Reaching it while reading a format stops the compile, and the error shows why.
+void fail(const char* why);
+
+consteval bool is_ending(char c) {
+	for (char ending : std::string_view("diuoxXfFeEgGaAcspnm"))
+		if (c == ending)
+			return true;
+	return false;
+}
+
+consteval bool is_length(char c) {
+	return c == 'h' || c == 'l' || c == 'j' || c == 'z' || c == 't' || c == 'L';
+}
+
+consteval length length_modifier(char c, char next) {
+	switch (c) {
+		case 'h':
+			return next == 'h' ? length::hh : length::h;
+		case 'l':
+			return next == 'l' ? length::ll : length::l;
+		case 'j':
+			return length::j;
+		case 'z':
+			return length::z;
+		case 't':
+			return length::t;
+		case 'L':
+			return length::big_l;
+		default:
+			return length::none;
+	}
+}
+
+// Folds one clear and set into a color op, like fold_color does
+consteval void fold_color(op& o, cprintf_attr_t clear, cprintf_attr_t set, bool reset) {
+	if (reset) {
+		o.clear = 0;
+		o.set = 0;
+		o.reset = true;
+	}
+	o.set = (cprintf_attr_t) ((o.set & ~clear) | set);
+	o.clear = (cprintf_attr_t) (o.clear | clear);
+}
+
+// Folds one SGR number into a color op, like add_sgr does
+consteval void add_sgr(op& o, unsigned int code) {
+	switch (code) {
+#define CPRINTF_SGR_CASE(number, clear_bits, set_bits, resets) \
+		case number: \
+			fold_color(o, (cprintf_attr_t) (clear_bits), (cprintf_attr_t) (set_bits), resets); \
+			break;
+		CPRINTF_SGR_TABLE(CPRINTF_SGR_CASE)
+#undef CPRINTF_SGR_CASE
+		default:
+			return;
+	}
+}
+
+// Same as add_extended
+consteval void add_extended(op& o, bool background, bool rgb, std::uint32_t value) {
+	if (background)
+		fold_color(o, CPRINTF_BG_ALL | BACKGROUND_INTENSITY | CPRINTF_BG_EXTENDED,
+			(rgb ? CPRINTF_BG_RGB : CPRINTF_BG_256) | (cprintf_attr_t) value << CPRINTF_BG_SHIFT, false);
+	else
+		fold_color(o, CPRINTF_FG_ALL | CPRINTF_FG_EXTENDED,
+			(rgb ? CPRINTF_FG_RGB : CPRINTF_FG_256) | (cprintf_attr_t) value << CPRINTF_FG_SHIFT, false);
+}
+
+// Same as parse_color_sequence (and add_sgr_field, for 38;5;n and 38;2;r;g;b). pos is the % and m is the m.
+consteval void parse_color(const char* s, std::size_t pos, std::size_t m, op& o) {
+	enum { plain, kind, index, rgb } state = plain;
+	unsigned int code = 0;
+	bool has_digits = false;
+	bool valid = true;
+	bool background = false;
+	int components = 0;
+	std::uint32_t value = 0;
+
+	for (std::size_t i = pos + 2; i <= m; ++i) {
+		if (s[i] >= '0' && s[i] <= '9') {
+			if (code < CPRINTF_SGR_FIELD_MAX)
+				code = code * 10 + (unsigned int) (s[i] - '0');
+			has_digits = true;
+			continue;
+		}
+		if (s[i] != ';' && i != m) {
+			valid = false;
+			continue;
+		}
+		// end of a field
+		valid = valid && has_digits;
+		switch (state) {
+			case plain:
+				if (valid && (code == 38 || code == 48)) {
+					state = kind;
+					background = code == 48;
+				}
+				else if (valid) {
+					add_sgr(o, code);
+				}
+				break;
+			case kind:
+				state = !valid ? plain : code == 5 ? index : code == 2 ? rgb : plain;
+				components = 0;
+				value = 0;
+				break;
+			case index:
+				state = plain;
+				if (valid && code < 256)
+					add_extended(o, background, false, code);
+				break;
+			case rgb:
+				if (!valid || code > 255) {
+					state = plain;
+					break;
+				}
+				value = value << 8 | code;
+				if (++components == 3) {
+					state = plain;
+					add_extended(o, background, true, value);
+				}
+				break;
+		}
+		code = 0;
+		has_digits = false;
+		valid = true;
+	}
+}
+
+// Same as read_spec, except that anything it doesn't understand is an error instead of being left to printf
+consteval void read_spec(const char* s, std::size_t pos, std::size_t end, op& o) {
+	std::size_t i = pos + 1;
+
+	for (std::size_t digits = i; digits < end && s[digits] >= '0' && s[digits] <= '9'; ++digits)
+		if (s[digits + 1] == '$')
+			fail("cprint::format: numbered arguments (%1$d) aren't supported, put the arguments in order instead");
+	for (; i < end; ++i) {
+		if (s[i] == '-')
+			o.left = true;
+		else if (s[i] == '+')
+			o.plus = true;
+		else if (s[i] == ' ')
+			o.space = true;
+		else if (s[i] == '#')
+			o.alt = true;
+		else if (s[i] == '0')
+			o.zero = true;
+		else
+			break;
+	}
+	for (; i < end && s[i] >= '0' && s[i] <= '9'; ++i)
+		o.width = (o.width < 0 ? 0 : o.width) * 10 + (s[i] - '0');
+	if (i < end && s[i] == '.') {
+		o.precision = 0;
+		for (++i; i < end && s[i] >= '0' && s[i] <= '9'; ++i)
+			o.precision = o.precision * 10 + (s[i] - '0');
+	}
+	if (i < end && is_length(s[i])) {
+		o.len = length_modifier(s[i], s[i + 1]);
+		i += (o.len == length::hh || o.len == length::ll) ? 2 : 1;
+	}
+	if (i != end)
+		fail("cprint::format: a conversion has something cprint doesn't understand in it (a * width or precision?)");
+	if (o.width > (1 << 20) || o.precision > (1 << 20))
+		fail("cprint::format: that width or precision is too big");
+}
+
+// Works out what a conversion takes, the same way run_op picks its va_arg type
+consteval arg_kind kind_of(const op& o) {
+	switch (o.conversion) {
+		case 'd':
+		case 'i':
+			return arg_kind::signed_int;
+		case 'u':
+		case 'o':
+		case 'x':
+		case 'X':
+			return arg_kind::unsigned_int;
+		case 'f':
+		case 'F':
+		case 'e':
+		case 'E':
+		case 'g':
+		case 'G':
+		case 'a':
+		case 'A':
+			if (o.len == length::none || o.len == length::l || o.len == length::big_l) // (l does nothing to these)
+				return arg_kind::floating;
+			break;
+		case 'c':
+			if (o.len == length::none)
+				return arg_kind::character;
+			if (o.len == length::l)
+				return arg_kind::wide_character;
+			break;
+		case 's':
+			if (o.len == length::none)
+				return arg_kind::string;
+			if (o.len == length::l)
+				return arg_kind::wide_string;
+			break;
+		case 'p':
+			return arg_kind::pointer;
+		case 'n':
+			fail("cprint::format: %n isn't supported");
+	}
+	fail("cprint::format: that length doesn't go with that conversion");
+	return arg_kind::none;
+}
+
+/* Reads the op starting at pos into o, the same way next_op does.
+* Returns where the op after it starts.
+*/
+consteval std::size_t read_op(const char* s, std::size_t n, std::size_t pos, op& o) {
+	std::size_t end = pos;
+
+	o = op {};
+	o.start = pos;
+	if (s[pos] != '%') {
+		while (end < n && s[end] != '%')
+			++end;
+		o.type = op_type::literal;
+		o.size = end - pos;
+		return end;
+	}
+	if (pos + 1 < n && s[pos + 1] == '%') {
+		o.type = op_type::literal;
+		o.start++;
+		o.size = 1;
+		return pos + 2;
+	}
+
+	// like find_ending: a space in the flags is the space flag, anywhere else it ends an unfinished sequence
+	for (++end; end < n && s[end] >= '0' && s[end] <= '9'; ++end)
+		;
+	end = end < n && s[end] == '$' ? end + 1 : pos + 1;
+	while (end < n && (s[end] == '-' || s[end] == '+' || s[end] == ' ' || s[end] == '#' || s[end] == '0'))
+		++end;
+	for (; end < n && !is_ending(s[end]) && s[end] != ' '; ++end)
+		;
+	if (end >= n) { // drop the %
+		o.size = 1;
+		return pos + 1;
+	}
+	o.size = 1 + end - pos;
+	o.conversion = s[end];
+
+	if (s[end] == 'm') {
+		if (s[pos + 1] == '[') {
+			o.type = op_type::color;
+			parse_color(s, pos, end, o);
+		}
+	}
+	else if (s[end] != ' ') {
+		o.type = op_type::conversion;
+		read_spec(s, pos, end, o);
+		o.kind = kind_of(o);
+		switch (o.kind) {
+			case arg_kind::signed_int:
+			case arg_kind::unsigned_int:
+				o.local = o.precision < 0 && !o.alt;
+				break;
+			case arg_kind::character:
+			case arg_kind::string:
+				o.local = true;
+				break;
+			default:
+				break;
+		}
+	}
+	return end + 1;
+}
+
+// How many ops F turns into once the ones that do nothing are dropped and colors next to each other are merged
+template <fixed_string F>
+consteval std::size_t op_count() {
+	std::size_t count = 0;
+	op_type last = op_type::none;
+	op o;
+	for (std::size_t pos = 0; pos < F.size(); ) {
+		pos = read_op(F.text, F.size(), pos, o);
+		if (o.type == op_type::none || (o.type == op_type::color && last == op_type::color))
+			continue;
+		last = o.type;
+		++count;
+	}
+	return count;
+}
+
+template <fixed_string F>
+consteval std::array<op, op_count<F>()> parse() {
+	std::array<op, op_count<F>()> ops {};
+	std::size_t count = 0;
+	std::size_t args = 0;
+	op o;
+
+	for (std::size_t pos = 0; pos < F.size(); ) {
+		pos = read_op(F.text, F.size(), pos, o);
+		if (o.type == op_type::none)
+			continue;
+		if (o.type == op_type::color && count > 0 && ops[count - 1].type == op_type::color) {
+			// one after the other is the same as one that does both
+			op& prev = ops[count - 1];
+			if (o.reset) {
+				prev.clear = o.clear;
+				prev.set = o.set;
+				prev.reset = true;
+			}
+			else {
+				prev.set = (cprintf_attr_t) ((prev.set & ~o.clear) | o.set);
+				prev.clear = (cprintf_attr_t) (prev.clear | o.clear);
+			}
+			continue;
+		}
+		if (o.type == op_type::conversion)
+			o.arg = args++;
+		ops[count++] = o;
+	}
+	return ops;
+}
+
+template <std::size_t N>
+consteval std::size_t arg_count(const std::array<op, N>& ops) {
+	std::size_t count = 0;
+	for (const op& o : ops)
+		if (o.type == op_type::conversion)
+			++count;
+	return count;
+}
+
+// The sequence by itself, terminated, for the C side
+template <fixed_string F, std::size_t Start, std::size_t Size>
+inline constexpr auto spec = [] {
+	std::array<char, Size + 1> text {};
+	for (std::size_t i = 0; i < Size; ++i)
+		text[i] = F.text[Start + i];
+	return text;
+}();
+
+// What each length turns an integer argument into on its way through the ... (smaller than int becomes int)
+template <length L, bool Signed>
+struct int_type {
+	using type = std::conditional_t<Signed, int, unsigned int>;
+};
+template <bool Signed>
+struct int_type<length::l, Signed> {
+	using type = std::conditional_t<Signed, long, unsigned long>;
+};
+template <bool Signed>
+struct int_type<length::ll, Signed> {
+	using type = std::conditional_t<Signed, long long, unsigned long long>;
+};
+template <bool Signed>
+struct int_type<length::j, Signed> {
+	using type = std::conditional_t<Signed, std::intmax_t, std::uintmax_t>;
+};
+template <bool Signed>
+struct int_type<length::z, Signed> {
+	using type = std::conditional_t<Signed, std::make_signed_t<std::size_t>, std::size_t>;
+};
+template <bool Signed>
+struct int_type<length::t, Signed> {
+	using type = std::conditional_t<Signed, std::ptrdiff_t, std::make_unsigned_t<std::ptrdiff_t>>;
+};
+
+// What the value is cut down to before it's printed (%hhd prints a signed char)
+template <length L, bool Signed>
+struct narrow_type {
+	using type = typename int_type<L, Signed>::type;
+};
+template <bool Signed>
+struct narrow_type<length::h, Signed> {
+	using type = std::conditional_t<Signed, short, unsigned short>;
+};
+template <bool Signed>
+struct narrow_type<length::hh, Signed> {
+	using type = std::conditional_t<Signed, signed char, unsigned char>;
+};
+
+// Whether T can go with a conversion. Integers can't be bigger than the length says (that would cut them short).
+template <op O, typename T>
+constexpr bool accepts() {
+	using U = std::remove_cvref_t<T>;
+	if constexpr (O.kind == arg_kind::signed_int || O.kind == arg_kind::unsigned_int)
+		return std::is_integral_v<U> && sizeof(U) <= sizeof(typename int_type<O.len, O.kind == arg_kind::signed_int>::type);
+	else if constexpr (O.kind == arg_kind::floating)
+		return std::is_floating_point_v<U> && (O.len == length::big_l || sizeof(U) <= sizeof(double));
+	else if constexpr (O.kind == arg_kind::character)
+		return std::is_integral_v<U> && sizeof(U) <= sizeof(int);
+	else if constexpr (O.kind == arg_kind::wide_character)
+		return std::is_integral_v<U> && sizeof(U) <= sizeof(std::wint_t);
+	else if constexpr (O.kind == arg_kind::string)
+		return std::is_convertible_v<const U&, const char*> || std::is_convertible_v<const U&, std::string_view>;
+	else if constexpr (O.kind == arg_kind::wide_string)
+		return std::is_convertible_v<const U&, const wchar_t*>;
+	else if constexpr (O.kind == arg_kind::pointer)
+		return std::is_pointer_v<U> || std::is_array_v<U> || std::is_null_pointer_v<U>;
+	else
+		return false;
+}
+
+// Writes prefix and body padded out to the op's width, like out_padded. Returns how many characters that was.
+inline int put_padded(cprintf_call* call, const op& o, std::string_view prefix, std::string_view body) {
+	static constexpr char spaces[] = "                                ";
+	static constexpr char zeros[] = "00000000000000000000000000000000";
+	const std::size_t total = prefix.size() + body.size();
+	const std::size_t pad = o.width > 0 && (std::size_t) o.width > total ? (std::size_t) o.width - total : 0;
+	const bool zero_fill = o.zero && !o.left && o.conversion != 's' && o.conversion != 'c';
+	const char* fill = zero_fill ? zeros : spaces;
+	char field[64];
+
+	if (total + pad <= sizeof(field)) { // small enough to hand over in one go
+		std::size_t len = 0;
+		auto put = [&](const char* text, std::size_t n) {
+			for (std::size_t i = 0; i < n; ++i)
+				field[len++] = text[i];
+		};
+		if (o.left) {
+			put(prefix.data(), prefix.size());
+			put(body.data(), body.size());
+			put(fill, pad);
+		}
+		else if (zero_fill) {
+			put(prefix.data(), prefix.size());
+			put(fill, pad);
+			put(body.data(), body.size());
+		}
+		else {
+			put(fill, pad);
+			put(prefix.data(), prefix.size());
+			put(body.data(), body.size());
+		}
+		cprintf_call_write(call, field, len);
+		return (int) len;
+	}
+
+	auto fill_out = [&](std::size_t count) {
+		while (count > 0) {
+			std::size_t chunk = count < sizeof(spaces) - 1 ? count : sizeof(spaces) - 1;
+			cprintf_call_write(call, fill, chunk);
+			count -= chunk;
+		}
+	};
+	if (!o.left && !zero_fill)
+		fill_out(pad);
+	cprintf_call_write(call, prefix.data(), prefix.size());
+	if (zero_fill)
+		fill_out(pad);
+	cprintf_call_write(call, body.data(), body.size());
+	if (o.left)
+		fill_out(pad);
+	return (int) (total + pad);
+}
+
+template <op O, typename T>
+int put_integer(cprintf_call* call, const T& value) {
+	constexpr bool is_signed = O.kind == arg_kind::signed_int;
+	constexpr int base = O.conversion == 'o' ? 8 : (O.conversion == 'x' || O.conversion == 'X') ? 16 : 10;
+	const auto v = static_cast<typename narrow_type<O.len, is_signed>::type>(value);
+	char digits[sizeof(std::uintmax_t) * 3];
+	char sign = 0;
+	std::uintmax_t magnitude;
+
+	if constexpr (std::is_signed_v<decltype(v)>) {
+		magnitude = v < 0 ? 0 - (std::uintmax_t) v : (std::uintmax_t) v;
+		if (v < 0)
+			sign = '-';
+		else if (O.plus)
+			sign = '+';
+		else if (O.space)
+			sign = ' ';
+	}
+	else {
+		magnitude = (std::uintmax_t) v;
+	}
+
+	char* end = std::to_chars(digits, digits + sizeof(digits), magnitude, base).ptr;
+	if constexpr (O.conversion == 'X')
+		for (char* c = digits; c < end; ++c)
+			if (*c >= 'a' && *c <= 'f')
+				*c = (char) (*c - 'a' + 'A');
+	return put_padded(call, O, std::string_view(&sign, sign ? 1 : 0), std::string_view(digits, end - digits));
+}
+
+template <op O, typename T>
+int put_string(cprintf_call* call, const T& value) {
+	std::string_view str;
+	if constexpr (std::is_convertible_v<const T&, const char*>) {
+		const char* ptr = value;
+		std::size_t len = 0;
+		if (!ptr)
+			ptr = "(null)";
+		if constexpr (O.precision < 0)
+			len = std::char_traits<char>::length(ptr);
+		else // don't read past the precision, the string doesn't have to be terminated
+			while (len < (std::size_t) O.precision && ptr[len] != '\0')
+				++len;
+		str = std::string_view(ptr, len);
+	}
+	else {
+		str = std::string_view(value);
+		if constexpr (O.precision >= 0)
+			str = str.substr(0, (std::size_t) O.precision);
+	}
+	return put_padded(call, O, std::string_view(), str);
+}
+
+// One conversion handed to the C side, with the argument turned into what run_op will va_arg it as
+template <fixed_string F, op O, typename T>
+int put_other(cprintf_call* call, const T& value) {
+	const char* text = spec<F, O.start, O.size>.data();
+	if constexpr (O.kind == arg_kind::signed_int || O.kind == arg_kind::unsigned_int)
+		return cprintf_call_printf(call, text, static_cast<typename int_type<O.len, O.kind == arg_kind::signed_int>::type>(value));
+	else if constexpr (O.kind == arg_kind::floating)
+		return cprintf_call_printf(call, text, static_cast<std::conditional_t<O.len == length::big_l, long double, double>>(value));
+	else if constexpr (O.kind == arg_kind::wide_character)
+		return cprintf_call_printf(call, text, static_cast<std::wint_t>(value));
+	else if constexpr (O.kind == arg_kind::wide_string)
+		return cprintf_call_printf(call, text, static_cast<const wchar_t*>(value));
+	else
+		return cprintf_call_printf(call, text, static_cast<const void*>(value));
+}
+
+// Carries out one op. Returns how many characters it wrote, or a negative number if something went wrong.
+template <fixed_string F, op O, typename Args>
+int run(cprintf_call* call, const Args& args) {
+	if constexpr (O.type == op_type::literal) {
+		cprintf_call_write(call, F.text + O.start, O.size);
+		return (int) O.size;
+	}
+	else if constexpr (O.type == op_type::color) {
+		cprintf_call_color(call, O.clear, O.set, O.reset);
+		return 0;
+	}
+	else {
+		const auto& value = std::get<O.arg>(args);
+		using T = std::remove_cvref_t<decltype(value)>;
+		static_assert(accepts<O, T>(), "cprint::format: an argument doesn't match its conversion");
+		if constexpr (!O.local)
+			return put_other<F, O>(call, value);
+		else if constexpr (O.kind == arg_kind::string)
+			return put_string<O>(call, value);
+		else if constexpr (O.kind == arg_kind::character) {
+			const char c = (char) value;
+			return put_padded(call, O, std::string_view(), std::string_view(&c, 1));
+		}
+		else
+			return put_integer<O>(call, value);
+	}
+}
+
+} // namespace detail
+
+/* Prints args with the format F, exactly like cprintf(F, args...) would, and returns what it would have.
+* F is read while compiling, so only string literals go in the angle brackets.
+*/
+template <fixed_string F, typename... Args>
+int format(const Args&... args) {
+	static constexpr auto ops = detail::parse<F>();
+	static_assert(detail::arg_count(ops) == sizeof...(Args), "cprint::format: the number of arguments doesn't match the format");
+
+	const auto tuple = std::forward_as_tuple(args...);
+	cprintf_call* call = cprintf_call_begin();
+	int chars_written = 0;
+	int error = 0;
+	int res;
+
+	if (!call)
+		return -1;
+	[&]<std::size_t... I>(std::index_sequence<I...>) {
+		// stops at the first one that fails, like cprintf does
+		(((res = detail::run<F, ops[I]>(call, tuple)) >= 0 ? (chars_written += res, true) : (error = res, false)) && ...);
+	}(std::make_index_sequence<ops.size()>());
+	res = cprintf_call_end(call, chars_written);
+	return error < 0 ? error : res;
+}
+
+} // namespace cprint
+
+#endif // __CPRINTF_HPP__
@@ -0,0 +1,725 @@
+/* Contains the output backends cprintf can draw to.
+* Windows gets the console API, everything else gets ANSI/VT escape sequences.
+*/
+
+#include "cprintf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <threads.h>
+
+// ======================
+// color quantisation
+// ======================
+
+// xterm's first 16 colors, in ANSI order (red is bit 0, green bit 1, blue bit 2, bright bit 3)
+static const unsigned char ansi16_rgb[16][3] = {
+	{ 0, 0, 0 }, { 205, 0, 0 }, { 0, 205, 0 }, { 205, 205, 0 },
+	{ 0, 0, 238 }, { 205, 0, 205 }, { 0, 205, 205 }, { 229, 229, 229 },
+	{ 127, 127, 127 }, { 255, 0, 0 }, { 0, 255, 0 }, { 255, 255, 0 },
+	{ 92, 92, 255 }, { 255, 0, 255 }, { 0, 255, 255 }, { 255, 255, 255 }
+};
+
+// the levels each channel of the 6x6x6 cube in 16-231 can have
+static const unsigned char cube_levels[6] = { 0, 95, 135, 175, 215, 255 };
+
+/* Which of the 16 is closest to each 15-bit color (5 bits of red, green and blue), so matching a 24-bit color is
+* one lookup instead of 16 distance checks every time. 32K, filled the first time anything needs it.
+*/
+static unsigned char rgb555_nearest[1 << 15];
+static once_flag rgb555_once = ONCE_FLAG_INIT;
+
+// how different two colors look, near enough (green counts most, blue least)
+static unsigned int color_distance(int r1, int g1, int b1, int r2, int g2, int b2) {
+	return (unsigned int) (3 * (r1 - r2) * (r1 - r2) + 4 * (g1 - g2) * (g1 - g2) + 2 * (b1 - b2) * (b1 - b2));
+}
+
+static void fill_rgb555(void) {
+	for (unsigned int i = 0; i < (1u << 15); ++i) {
+		// spread 5 bits back over 0-255
+		int r = (int) ((i >> 10 & 31) * 255 / 31);
+		int g = (int) ((i >> 5 & 31) * 255 / 31);
+		int b = (int) ((i & 31) * 255 / 31);
+		unsigned int best = 0;
+		unsigned int best_distance = UINT_MAX;
+		for (unsigned int c = 0; c < 16; ++c) {
+			unsigned int distance = color_distance(r, g, b, ansi16_rgb[c][0], ansi16_rgb[c][1], ansi16_rgb[c][2]);
+			if (distance < best_distance) {
+				best = c;
+				best_distance = distance;
+			}
+		}
+		rgb555_nearest[i] = (unsigned char) best;
+	}
+}
+
+// 0xRRGGBB -> which of the 16 (in ANSI order)
+static unsigned int nearest_16(uint32_t rgb) {
+	call_once(&rgb555_once, fill_rgb555);
+	return rgb555_nearest[(rgb >> 19 & 0x1F) << 10 | (rgb >> 11 & 0x1F) << 5 | (rgb >> 3 & 0x1F)];
+}
+
+// 256-color index -> 0xRRGGBB
+static uint32_t xterm_rgb(unsigned int index) {
+	if (index < 16)
+		return (uint32_t) ansi16_rgb[index][0] << 16 | (uint32_t) ansi16_rgb[index][1] << 8 | ansi16_rgb[index][2];
+	if (index < 232) {
+		index -= 16;
+		return (uint32_t) cube_levels[index / 36] << 16 | (uint32_t) cube_levels[index / 6 % 6] << 8 | cube_levels[index % 6];
+	}
+	index = 8 + (index - 232) * 10; // the gray ramp
+	return index << 16 | index << 8 | index;
+}
+
+// which cube level a channel is closest to
+static unsigned int cube_step(int v) {
+	return v < 48 ? 0 : v < 115 ? 1 : (unsigned int) (v - 35) / 40;
+}
+
+// 0xRRGGBB -> the closest 256-color index, either from the cube or the gray ramp, whichever is nearer
+static unsigned int nearest_256(uint32_t rgb) {
+	int r = (int) (rgb >> 16 & 0xFF), g = (int) (rgb >> 8 & 0xFF), b = (int) (rgb & 0xFF);
+	unsigned int cr = cube_step(r), cg = cube_step(g), cb = cube_step(b);
+	int average = (r + g + b) / 3;
+	int gray_step = average > 238 ? 23 : average < 8 ? 0 : (average - 3) / 10;
+	int gray = 8 + gray_step * 10;
+
+	if (color_distance(r, g, b, gray, gray, gray)
+		< color_distance(r, g, b, cube_levels[cr], cube_levels[cg], cube_levels[cb]))
+		return 232 + (unsigned int) gray_step;
+	return 16 + cr * 36 + cg * 6 + cb;
+}
+
+// one of the 16 (in ANSI order) -> the word's bits for it, as a foreground
+static cprintf_attr_t ansi16_word(unsigned int c) {
+	return ((c & 1) ? FOREGROUND_RED : 0) | ((c & 2) ? FOREGROUND_GREEN : 0)
+		| ((c & 4) ? FOREGROUND_BLUE : 0) | ((c & 8) ? FOREGROUND_INTENSITY : 0);
+}
+
+cprintf_attr_t cprintf_downgrade(cprintf_attr_t attrs, cprintf_color_level level) {
+	uint32_t fg = CPRINTF_FG_VALUE(attrs);
+	uint32_t bg = CPRINTF_BG_VALUE(attrs);
+
+	if (level >= CPRINTF_COLOR_TRUECOLOR)
+		return attrs;
+	if (level == CPRINTF_COLOR_256) {
+		if (attrs & CPRINTF_FG_RGB)
+			attrs = (attrs & ~CPRINTF_FG_EXTENDED) | CPRINTF_FG_256 | (cprintf_attr_t) nearest_256(fg) << CPRINTF_FG_SHIFT;
+		if (attrs & CPRINTF_BG_RGB)
+			attrs = (attrs & ~CPRINTF_BG_EXTENDED) | CPRINTF_BG_256 | (cprintf_attr_t) nearest_256(bg) << CPRINTF_BG_SHIFT;
+		return attrs;
+	}
+	// the 16 of them go in the word's own bits, where a bright foreground also means bold
+	if (attrs & (CPRINTF_FG_256 | CPRINTF_FG_RGB)) {
+		unsigned int c = (attrs & CPRINTF_FG_RGB) ? nearest_16(fg) : fg < 16 ? fg : nearest_16(xterm_rgb(fg));
+		attrs = (attrs & ~CPRINTF_FG_EXTENDED) | ansi16_word(c);
+	}
+	if (attrs & (CPRINTF_BG_256 | CPRINTF_BG_RGB)) {
+		unsigned int c = (attrs & CPRINTF_BG_RGB) ? nearest_16(bg) : bg < 16 ? bg : nearest_16(xterm_rgb(bg));
+		attrs = (attrs & ~CPRINTF_BG_EXTENDED) | ansi16_word(c) << 4;
+	}
+	return attrs;
+}
+
+// ======================
+// ANSI sequences
+// ======================
+
+// Windows stores colors as BGR bits, ANSI numbers them as RGB bits.
+static int ansi_color_index(cprintf_attr_t rgb) {
+	return ((rgb & FOREGROUND_RED) ? 1 : 0) | ((rgb & FOREGROUND_GREEN) ? 2 : 0) | ((rgb & FOREGROUND_BLUE) ? 4 : 0);
+}
+
+// Writes ";n" into buf and returns how long it was
+static size_t ansi_number(char* buf, unsigned int n) {
+	size_t len = 0;
+	buf[len++] = ';';
+	if (n >= 100)
+		buf[len++] = (char) ('0' + n / 100);
+	if (n >= 10)
+		buf[len++] = (char) ('0' + n / 10 % 10);
+	buf[len++] = (char) ('0' + n % 10);
+	return len;
+}
+
+// Writes ";38;5;n" or ";38;2;r;g;b" (base is 38 or 48) into buf and returns how long it was
+static size_t ansi_extended(char* buf, unsigned int base, bool rgb, uint32_t value) {
+	size_t len = ansi_number(buf, base);
+	if (!rgb) {
+		len += ansi_number(buf + len, 5);
+		return len + ansi_number(buf + len, value);
+	}
+	len += ansi_number(buf + len, 2);
+	len += ansi_number(buf + len, value >> 16);
+	len += ansi_number(buf + len, value >> 8 & 0xFF);
+	return len + ansi_number(buf + len, value & 0xFF);
+}
+
+// Writes the SGR sequence for attrs into buf and returns its length. buf needs at least CPRINTF_ENCODE_MAX chars.
+static size_t ansi_sequence(char* buf, cprintf_attr_t attrs, cprintf_attr_t defaults) {
+	size_t len = 0;
+	cprintf_attr_t fg = attrs & (FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE);
+	cprintf_attr_t bg = (attrs >> 4) & (FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE);
+
+	// always start from a reset so we don't have to know what the terminal had before
+	buf[len++] = '\x1b';
+	buf[len++] = '[';
+	buf[len++] = '0';
+
+	if (attrs & FOREGROUND_INTENSITY) {
+		memcpy(buf + len, ";1", 2);
+		len += 2;
+	}
+	if (attrs & COMMON_LVB_UNDERSCORE) {
+		memcpy(buf + len, ";4", 2);
+		len += 2;
+	}
+	if (attrs & COMMON_LVB_REVERSE_VIDEO) {
+		memcpy(buf + len, ";7", 2);
+		len += 2;
+	}
+	if (attrs & (CPRINTF_FG_256 | CPRINTF_FG_RGB)) {
+		len += ansi_extended(buf + len, 38, attrs & CPRINTF_FG_RGB, CPRINTF_FG_VALUE(attrs));
+	}
+	else if (fg != (defaults & (FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE))) {
+		buf[len++] = ';';
+		buf[len++] = '3';
+		buf[len++] = (char) ('0' + ansi_color_index(fg));
+	}
+	if (attrs & (CPRINTF_BG_256 | CPRINTF_BG_RGB)) {
+		len += ansi_extended(buf + len, 48, attrs & CPRINTF_BG_RGB, CPRINTF_BG_VALUE(attrs));
+	}
+	else if (attrs & BACKGROUND_INTENSITY) { // bright backgrounds are 100-107
+		memcpy(buf + len, ";10", 3);
+		len += 3;
+		buf[len++] = (char) ('0' + ansi_color_index(bg));
+	}
+	else if (bg != ((defaults >> 4) & (FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE))) {
+		buf[len++] = ';';
+		buf[len++] = '4';
+		buf[len++] = (char) ('0' + ansi_color_index(bg));
+	}
+	buf[len++] = 'm';
+	return len;
+}
+
+size_t cprintf_encode_ansi(cprintf_attr_t attrs, char* buf) {
+	return ansi_sequence(buf, attrs, FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE);
+}
+
+// ======================
+// console runs
+// ======================
+
+/* The Windows console can't take colors in the text, so for atomic writes and async mode its backend puts a little
+* marker of its own there instead: CPRINTF_CONSOLE_MARK, then the attribute word in three bytes of 6 bits each
+* (0x80 to 0xBF, lowest first). The bytes after it are never 0xFF or a newline themselves. It's the backend's mark,
+* so a 0xFF in the text (which isn't UTF-8, but %s will pass anything) reaches us twice in a row, and reads as
+* one byte of text.
+* A write is cut up into runs of text between the markers, and each run is converted to UTF-16 and goes to the
+* console in one write_text, after one set_attribute for the marker in front of it. Markers with no text between
+* them, or that don't change anything, don't cost a call. A whole line with a lot of colors in it goes out as
+* cells instead (WriteConsoleOutputW), which is the same few calls however many colors there are.
+*/
+
+#if defined(CPRINTF_CONSOLE_MARK) || defined(CPRINTF_CONSOLE_MARK_SIZE) || defined(CPRINTF_CONSOLE_RUN) \
+	|| defined(CPRINTF_CONSOLE_CELL_MARKS) || defined(CPRINTF_MIN)
+#error Macro clash!
+#endif
+#define CPRINTF_CONSOLE_MARK 0xFF
+#define CPRINTF_CONSOLE_MARK_SIZE 4
+// how many UTF-16 units are converted at a time (a longer run takes more than one write_text)
+#define CPRINTF_CONSOLE_RUN 1024
+// a line with at least this many color changes goes out as cells (with fewer, runs take about as many calls)
+#define CPRINTF_CONSOLE_CELL_MARKS 2
+#define CPRINTF_MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static size_t console_encode(cprintf_attr_t attrs, char* buf) {
+	unsigned int word = (unsigned int) (cprintf_downgrade(attrs, CPRINTF_COLOR_16) & 0xFFFF);
+	buf[0] = (char) CPRINTF_CONSOLE_MARK;
+	buf[1] = (char) (0x80 | (word & 0x3F));
+	buf[2] = (char) (0x80 | (word >> 6 & 0x3F));
+	buf[3] = (char) (0x80 | word >> 12);
+	return CPRINTF_CONSOLE_MARK_SIZE;
+}
+
+// Whether the 0xFF at mark (before end) is an escaped one from the text rather than the start of a marker
+static bool console_literal(const unsigned char* mark, const unsigned char* end) {
+	return end - mark >= 2 && mark[1] == CPRINTF_CONSOLE_MARK;
+}
+
+// the attribute word in the marker at mark
+static long console_mark(const unsigned char* mark) {
+	return (mark[1] & 0x3F) | (long) (mark[2] & 0x3F) << 6 | (long) (mark[3] & 0x3F) << 12;
+}
+
+/* Reads one character from the UTF-8 at str (len bytes of it) and returns how many bytes it took. Anything that
+* isn't a real character, including one that's cut off at the end, reads as U+FFFD. cprintf only cuts its
+* output between whole characters, so that's only ever text that was broken to begin with.
+*/
+static size_t console_next(const unsigned char* str, size_t len, uint32_t* pChar) {
+	uint32_t c = str[0];
+	size_t size = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : 2;
+	uint32_t least = size == 4 ? 0x10000 : size == 3 ? 0x800 : 0x80;
+
+	*pChar = 0xFFFD;
+	if (c < 0xC2 || c > 0xF4)
+		return 1;
+	c &= 0x3F >> (size - 1);
+	for (size_t i = 1; i < size; ++i) {
+		if (i >= len || (str[i] & 0xC0) != 0x80)
+			return i;
+		c = c << 6 | (str[i] & 0x3F);
+	}
+	if (c >= least && c <= 0x10FFFF && (c < 0xD800 || c > 0xDFFF))
+		*pChar = c;
+	return size;
+}
+
+// One run of text, converted to UTF-16 and written in as few write_text calls as it fits in
+static int console_text(const cprintf_console* console, const unsigned char* str, size_t len) {
+	uint16_t units[CPRINTF_CONSOLE_RUN];
+	size_t count = 0;
+	uint32_t c;
+
+	for (size_t i = 0; i < len; ) {
+		if (str[i] < 0x80)
+			c = str[i++];
+		else
+			i += console_next(str + i, len - i, &c);
+		if (c >= 0x10000) { // a surrogate pair
+			units[count++] = (uint16_t) (0xD800 | (c - 0x10000) >> 10);
+			units[count++] = (uint16_t) (0xDC00 | (c & 0x3FF));
+		}
+		else {
+			units[count++] = (uint16_t) c;
+		}
+		if (count > CPRINTF_CONSOLE_RUN - 2) {
+			if (console->write_text(console->ctx, units, count) < 0)
+				return -1;
+			count = 0;
+		}
+	}
+	if (count > 0 && console->write_text(console->ctx, units, count) < 0)
+		return -1;
+	return 0;
+}
+
+// What a write knows about the console's attribute: what it's showing and what the text should be in (-1 if unknown)
+typedef struct console_state {
+	long shown;
+	long wanted;
+} console_state;
+
+// One run of text in what the marker before it asked for: a set_attribute when it's needed, then the text
+static int console_run(const cprintf_console* console, console_state* state, const unsigned char* str, size_t len) {
+	if (state->wanted >= 0 && state->wanted != state->shown) {
+		if (console->set_attribute(console->ctx, (unsigned short) state->wanted) < 0)
+			return -1;
+		state->shown = state->wanted;
+	}
+	return console_text(console, str, len);
+}
+
+// Text (between start and end, markers and all) as runs: a set_attribute when it's needed and a write_text for each
+static int console_runs(const cprintf_console* console, console_state* state, const unsigned char* str, const unsigned char* end) {
+	const unsigned char* mark;
+
+	while (str < end) {
+		mark = memchr(str, CPRINTF_CONSOLE_MARK, (size_t) (end - str));
+		if (mark && console_literal(mark, end)) { // the text goes up to the first of the two and carries on after them
+			if (console_run(console, state, str, (size_t) (mark + 1 - str)) < 0)
+				return -1;
+			str = mark + 2;
+			continue;
+		}
+		if (mark != str && console_run(console, state, str, (size_t) ((mark ? mark : end) - str)) < 0)
+			return -1;
+		if (!mark || end - mark < CPRINTF_CONSOLE_MARK_SIZE)
+			break;
+		state->wanted = console_mark(mark);
+		str = mark + CPRINTF_CONSOLE_MARK_SIZE;
+	}
+	return 0;
+}
+
+/* A whole line (str up to the newline at end) with lots of colors in it is cheaper as cells: one write_cells at the
+* cursor, then the newline. Returns 1 if it did that, 0 if the line doesn't suit it (nothing's been written then)
+* and -1 if the console failed. It only takes lines that fit on what's left of the cursor's row and that are
+* nothing but characters that take one cell each.
+*/
+static int console_line(const cprintf_console* console, console_state* state, const unsigned char* str, const unsigned char* end) {
+	cprintf_console_cell cells[CPRINTF_CONSOLE_RUN];
+	cprintf_console_info info;
+	const unsigned char* mark = str;
+	size_t count = 0;
+	size_t room;
+	int marks = 0;
+	long attr;
+	uint32_t c;
+
+	while ((mark = memchr(mark, CPRINTF_CONSOLE_MARK, (size_t) (end - mark))) != NULL && marks < CPRINTF_CONSOLE_CELL_MARKS) {
+		if (console_literal(mark, end)) {
+			mark += 2;
+			continue;
+		}
+		++marks;
+		++mark;
+	}
+	if (marks < CPRINTF_CONSOLE_CELL_MARKS) // as runs it's only a few calls anyway
+		return 0;
+	if (console->get_info(console->ctx, &info) < 0)
+		return -1;
+	state->shown = info.attr;
+	if (info.x < 0 || info.width <= info.x)
+		return 0;
+	room = CPRINTF_MIN((size_t) (info.width - info.x - 1), (size_t) CPRINTF_CONSOLE_RUN); // the newline goes in the last column
+	attr = state->wanted >= 0 ? state->wanted : info.attr;
+
+	for (const unsigned char* p = str; p < end; ) {
+		if (*p == CPRINTF_CONSOLE_MARK && !console_literal(p, end)) {
+			if (end - p < CPRINTF_CONSOLE_MARK_SIZE)
+				return 0;
+			attr = console_mark(p);
+			p += CPRINTF_CONSOLE_MARK_SIZE;
+			continue;
+		}
+		if (*p == CPRINTF_CONSOLE_MARK) { // a 0xFF from the text, which isn't a character
+			c = 0xFFFD;
+			p += 2;
+		}
+		else {
+			p += *p < 0x80 ? (c = *p, 1) : console_next(p, (size_t) (end - p), &c);
+		}
+		if (c < 0x20 || c == 0x7F || c >= 0x300 || count == room) // control characters, anything that might not be one cell, or too long
+			return 0;
+		cells[count].ch = (uint16_t) c;
+		cells[count].attr = (unsigned short) attr;
+		++count;
+	}
+
+	if (count > 0 && console->write_cells(console->ctx, cells, count, info.x, info.y) < 0)
+		return -1;
+	state->wanted = attr;
+	if (attr != state->shown) { // a new line scrolled in gets the current attribute, same as with runs
+		if (console->set_attribute(console->ctx, (unsigned short) attr) < 0)
+			return -1;
+		state->shown = attr;
+	}
+	if (console->write_text(console->ctx, u"\n", 1) < 0)
+		return -1;
+	return 1;
+}
+
+static int console_write(const cprintf_console* console, const char* bytes, size_t len) {
+	const unsigned char* str = (const unsigned char*) bytes;
+	const unsigned char* end = str + len;
+	const unsigned char* newline;
+	const unsigned char* stop;
+	console_state state = { -1, -1 }; // nothing known until something's set or looked up
+	int res;
+
+	while (str < end) {
+		newline = memchr(str, '\n', (size_t) (end - str));
+		stop = newline ? newline + 1 : end;
+		res = newline && console->write_cells ? console_line(console, &state, str, newline) : 0;
+		if (res == 0)
+			res = console_runs(console, &state, str, stop);
+		if (res < 0)
+			return -1;
+		str = stop;
+	}
+	// colors at the very end still have to stick for whatever comes next
+	if (state.wanted >= 0 && state.wanted != state.shown && console->set_attribute(console->ctx, (unsigned short) state.wanted) < 0)
+		return -1;
+	return 0;
+}
+
+static int console_backend_write(void* ctx, const char* bytes, size_t len) {
+	return console_write(ctx, bytes, len);
+}
+
+static int console_set_attributes(void* ctx, cprintf_attr_t attrs) {
+	const cprintf_console* console = ctx;
+	// the console only has the 16 colors, and the extended ones' flags would mean something else to it
+	return console->set_attribute(console->ctx, (unsigned short) (cprintf_downgrade(attrs, CPRINTF_COLOR_16) & 0xFFFF));
+}
+
+static int console_get_attributes(void* ctx, cprintf_attr_t* pAttrs) {
+	const cprintf_console* console = ctx;
+	cprintf_console_info info;
+	if (console->get_info(console->ctx, &info) < 0)
+		return -1;
+	*pAttrs = info.attr;
+	return 0;
+}
+
+static size_t console_encode_attributes(void* ctx, cprintf_attr_t attrs, char* buf) {
+	(void) ctx;
+	return console_encode(attrs, buf);
+}
+
+void cprintf_console_backend(const cprintf_console* console, cprintf_backend* pBackend) {
+	pBackend->ctx = (void*) console;
+	pBackend->write = console_backend_write;
+	pBackend->set_attributes = console_set_attributes;
+	pBackend->get_attributes = console_get_attributes;
+	pBackend->encode_attributes = console_encode_attributes;
+	pBackend->mark = CPRINTF_CONSOLE_MARK;
+}
+
+#if defined(_WIN32)
+
+// ======================
+// Win32 console backend
+// ======================
+
+// Looked up once. If you SetStdHandle after the first call, cprintf won't notice.
+static HANDLE win32_handle = NULL;
+static int win32_is_console = -1; // -1 until we know
+
+static HANDLE win32_stdout(void) {
+	DWORD mode;
+	if (!win32_handle) {
+		win32_handle = GetStdHandle(STD_OUTPUT_HANDLE);
+		win32_is_console = GetConsoleMode(win32_handle, &mode) ? 1 : 0;
+	}
+	return win32_handle;
+}
+
+static int win32_set_attribute(void* ctx, unsigned short attr) {
+	(void) ctx;
+	if (!SetConsoleTextAttribute(win32_stdout(), attr))
+		return -1;
+	return 0;
+}
+
+static int win32_get_info(void* ctx, cprintf_console_info* pInfo) {
+	(void) ctx;
+	CONSOLE_SCREEN_BUFFER_INFO info;
+	if (!GetConsoleScreenBufferInfo(win32_stdout(), &info))
+		return -1;
+	pInfo->attr = info.wAttributes;
+	pInfo->x = info.dwCursorPosition.X;
+	pInfo->y = info.dwCursorPosition.Y;
+	pInfo->width = info.dwSize.X;
+	return 0;
+}
+
+static int win32_write_text(void* ctx, const uint16_t* text, size_t len) {
+	(void) ctx;
+	HANDLE handle = win32_stdout();
+	DWORD written;
+	while (len > 0) {
+		if (!WriteConsoleW(handle, (const WCHAR*) text, (DWORD) len, &written, NULL))
+			return -1;
+		text += written;
+		len -= written;
+	}
+	return 0;
+}
+
+static int win32_write_cells(void* ctx, const cprintf_console_cell* cells, size_t count, int x, int y) {
+	(void) ctx;
+	CHAR_INFO info[CPRINTF_CONSOLE_RUN];
+	COORD size = { (SHORT) count, 1 };
+	COORD origin = { 0, 0 };
+	SMALL_RECT rect = { (SHORT) x, (SHORT) y, (SHORT) (x + (int) count - 1), (SHORT) y };
+	if (count > CPRINTF_CONSOLE_RUN)
+		return -1;
+	for (size_t i = 0; i < count; ++i) {
+		info[i].Char.UnicodeChar = (WCHAR) cells[i].ch;
+		info[i].Attributes = cells[i].attr;
+	}
+	if (!WriteConsoleOutputW(win32_stdout(), info, size, origin, &rect))
+		return -1;
+	return 0;
+}
+
+static const cprintf_console win32_console = {
+	NULL,
+	win32_set_attribute,
+	win32_get_info,
+	win32_write_text,
+	win32_write_cells
+};
+
+// Output that isn't going to a console (a file or a pipe) is written as the UTF-8 it is, minus the markers
+static int win32_write_file(HANDLE handle, const char* bytes, size_t len) {
+	const char* end = bytes + len;
+	const char* mark;
+	DWORD written;
+	bool literal;
+
+	while (bytes < end) {
+		mark = memchr(bytes, CPRINTF_CONSOLE_MARK, (size_t) (end - bytes));
+		if (!mark)
+			mark = end;
+		literal = mark < end && console_literal((const unsigned char*) mark, (const unsigned char*) end);
+		while (bytes < mark + literal) { // (an escaped 0xFF is written once)
+			if (!WriteFile(handle, bytes, (DWORD) (mark + literal - bytes), &written, NULL))
+				return -1;
+			bytes += written;
+		}
+		bytes = mark + (literal ? 2 : CPRINTF_CONSOLE_MARK_SIZE);
+	}
+	return 0;
+}
+
+static int win32_write(void* ctx, const char* bytes, size_t len) {
+	HANDLE handle = win32_stdout();
+	fflush(stdout); // anything the program printf'd before us has to come out first
+	if (win32_is_console)
+		return console_write(ctx, bytes, len);
+	return win32_write_file(handle, bytes, len);
+}
+
+static const cprintf_backend win32_backend = {
+	(void*) &win32_console,
+	win32_write,
+	console_set_attributes,
+	console_get_attributes,
+	console_encode_attributes,
+	CPRINTF_CONSOLE_MARK
+};
+
+const cprintf_backend* cprintf_win32_backend(void) {
+	return &win32_backend;
+}
+
+#else
+
+#include <unistd.h>
+#include <errno.h>
+
+// =============================
+// POSIX (ANSI/VT) backend
+// =============================
+
+/* A terminal can't tell us what colors it is using, so we keep a shadow copy of what we last set.
+* We start from the Windows default (light gray on black) and treat those colors as "whatever the
+* terminal's default is" when translating, so %[0m doesn't paint the background black.
+*/
+typedef struct posix_state {
+	int fd;
+	cprintf_attr_t current;
+	cprintf_attr_t defaults;
+} posix_state;
+
+static posix_state posix_stdout = {
+	STDOUT_FILENO,
+	FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE,
+	FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE
+};
+
+static int posix_write(void* ctx, const char* bytes, size_t len) {
+	posix_state* state = ctx;
+	ssize_t written;
+	if (state->fd == STDOUT_FILENO)
+		fflush(stdout); // anything the program printf'd before us has to come out first
+	while (len > 0) {
+		written = write(state->fd, bytes, len);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		bytes += written;
+		len -= (size_t) written;
+	}
+	return 0;
+}
+
+static int posix_set_attributes(void* ctx, cprintf_attr_t attrs) {
+	posix_state* state = ctx;
+	char buf[CPRINTF_ENCODE_MAX];
+	size_t len = ansi_sequence(buf, cprintf_downgrade(attrs, cprintf_get_color_level()), state->defaults);
+	if (posix_write(ctx, buf, len) < 0)
+		return -1;
+	state->current = attrs;
+	return 0;
+}
+
+static int posix_get_attributes(void* ctx, cprintf_attr_t* pAttrs) {
+	posix_state* state = ctx;
+	*pAttrs = state->current;
+	return 0;
+}
+
+// state->current isn't updated here. It's only read before the first call, and cprintf keeps track after that.
+static size_t posix_encode_attributes(void* ctx, cprintf_attr_t attrs, char* buf) {
+	posix_state* state = ctx;
+	return ansi_sequence(buf, cprintf_downgrade(attrs, cprintf_get_color_level()), state->defaults);
+}
+
+static const cprintf_backend posix_backend = {
+	&posix_stdout,
+	posix_write,
+	posix_set_attributes,
+	posix_get_attributes,
+	posix_encode_attributes,
+	0
+};
+
+const cprintf_backend* cprintf_posix_backend(void) {
+	return &posix_backend;
+}
+
+#endif // _WIN32
+
+// ======================
+// color detection
+// ======================
+
+#if defined(_WIN32) && !defined(ENABLE_VIRTUAL_TERMINAL_PROCESSING)
+#define ENABLE_VIRTUAL_TERMINAL_PROCESSING 0x0004 // older SDKs don't have it
+#endif
+
+cprintf_color_level cprintf_detect_color_level(void) {
+	const char* no_color = getenv("NO_COLOR"); // https://no-color.org
+#if defined(_WIN32)
+	DWORD mode;
+#else
+	const char* term = getenv("TERM");
+	const char* colorterm = getenv("COLORTERM");
+#endif
+
+	if (no_color && no_color[0] != '\0')
+		return CPRINTF_COLOR_NONE;
+#if defined(_WIN32)
+	if (!GetConsoleMode(GetStdHandle(STD_OUTPUT_HANDLE), &mode)) // not a console
+		return CPRINTF_COLOR_NONE;
+	return (mode & ENABLE_VIRTUAL_TERMINAL_PROCESSING) ? CPRINTF_COLOR_TRUECOLOR : CPRINTF_COLOR_16;
+#else
+	if (!isatty(STDOUT_FILENO) || !term || term[0] == '\0' || strcmp(term, "dumb") == 0)
+		return CPRINTF_COLOR_NONE;
+	if (colorterm && (strcmp(colorterm, "truecolor") == 0 || strcmp(colorterm, "24bit") == 0))
+		return CPRINTF_COLOR_TRUECOLOR;
+	if (strstr(term, "256color"))
+		return CPRINTF_COLOR_256;
+	return CPRINTF_COLOR_16;
+#endif
+}
+
+// ======================
+// backend selection
+// ======================
+
+static const cprintf_backend* current_backend = NULL;
+
+void cprintf_set_backend(const cprintf_backend* backend) {
+	current_backend = backend;
+	cprintf_set_previous = false; // the new backend may be showing different attributes
+}
+
+const cprintf_backend* cprintf_get_backend(void) {
+	if (current_backend)
+		return current_backend;
+#if defined(_WIN32)
+	return cprintf_win32_backend();
+#else
+	return cprintf_posix_backend();
+#endif
+}
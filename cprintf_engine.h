@@ -0,0 +1,482 @@
+/* The part of cprintf that reads a format and carries it out, written once for both kinds of format.
+* cprintf.c includes this twice: once with CPRINTF_CHAR as char and once as wchar_t. CPRINTF_NAME puts a w in
+* front of the wide versions' names (next_op and wnext_op), CPRINTF_LIT makes a character literal the right
+* width, and CPRINTF_WIDE says which one this is.
+*
+* There's no include guard on purpose. Don't include this anywhere else.
+*/
+
+#if !defined(CPRINTF_CHAR) || !defined(CPRINTF_NAME) || !defined(CPRINTF_LIT) || !defined(CPRINTF_WIDE)
+#error cprintf_engine.h needs CPRINTF_CHAR, CPRINTF_NAME, CPRINTF_LIT and CPRINTF_WIDE
+#endif
+
+/* Works out what a color sequence like %[1;31;40m does, in one pass.
+* ptr points at the % and m_ptr at the m. The numbers can come in any order and there can be any number of
+* them. Empty fields and fields that aren't numbers are skipped.
+*/
+void CPRINTF_NAME(parse_color_sequence)(const CPRINTF_CHAR* ptr, const CPRINTF_CHAR* m_ptr, cprintf_color* color) {
+	unsigned int code = 0;
+	bool has_digits = false;
+	bool valid = true;
+	sgr_reader reader = { CPRINTF_SGR_PLAIN, 0, false, 0 };
+
+	color->clear = 0;
+	color->set = 0;
+	color->reset = false;
+	if (!ptr || !m_ptr || ptr[1] != CPRINTF_LIT('['))
+		return;
+
+	for (ptr += 2; ptr <= m_ptr; ++ptr) {
+		if (*ptr >= CPRINTF_LIT('0') && *ptr <= CPRINTF_LIT('9')) {
+			if (code < CPRINTF_SGR_FIELD_MAX) // anything bigger doesn't do anything anyway, so stop before it overflows
+				code = code * 10 + (unsigned int) (*ptr - CPRINTF_LIT('0'));
+			has_digits = true;
+		}
+		else if (*ptr == CPRINTF_LIT(';') || ptr == m_ptr) { // end of a field
+			add_sgr_field(color, &reader, has_digits && valid, code);
+			code = 0;
+			has_digits = false;
+			valid = true;
+		}
+		else {
+			valid = false;
+		}
+	}
+}
+
+/* Finds the character that ends the sequence starting at the % in ptr, or NULL if the string ends first.
+* A space in the flags (% d, %2$ d) is the space flag like printf says, anywhere else it ends a sequence that
+* wasn't finished.
+*/
+const CPRINTF_CHAR* CPRINTF_NAME(find_ending)(const CPRINTF_CHAR* ptr) {
+	const CPRINTF_CHAR* flags = ++ptr;
+
+	while (*flags >= CPRINTF_LIT('0') && *flags <= CPRINTF_LIT('9'))
+		++flags;
+	flags = *flags == CPRINTF_LIT('$') ? flags + 1 : ptr;
+	while (*flags == CPRINTF_LIT('-') || *flags == CPRINTF_LIT('+') || *flags == CPRINTF_LIT(' ') ||
+		*flags == CPRINTF_LIT('#') || *flags == CPRINTF_LIT('0'))
+		++flags;
+	for (ptr = flags; *ptr != CPRINTF_LIT('\0'); ++ptr) {
+		if (CPRINTF_CLASS_OF(*ptr) & CPRINTF_CLASS_ENDING)
+			return ptr;
+	}
+	return NULL;
+}
+
+/* Reads an argument number (digits and a $) at *pPtr, stopping before pos, and moves past it. Returns 0 (and
+* doesn't move) if there isn't one there, and CPRINTF_ARGS_MAX + 1 for one that's out of range.
+*/
+unsigned int CPRINTF_NAME(read_arg_number)(const CPRINTF_CHAR** pPtr, const CPRINTF_CHAR* pos) {
+	const CPRINTF_CHAR* ptr = *pPtr;
+	unsigned int number = 0;
+
+	for (; ptr < pos && *ptr >= CPRINTF_LIT('0') && *ptr <= CPRINTF_LIT('9'); ++ptr)
+		number = CPRINTF_MIN(number * 10 + (unsigned int) (*ptr - CPRINTF_LIT('0')), CPRINTF_ARGS_MAX + 1);
+	if (ptr == *pPtr || ptr == pos || *ptr != CPRINTF_LIT('$')) // just digits, so they're a width or precision
+		return 0;
+	*pPtr = ptr + 1;
+	return number ? number : CPRINTF_ARGS_MAX + 1; // (there's no argument 0)
+}
+
+/* Reads the argument number, flags, width, precision and length of the sequence between the % at ptr and the
+* ending character at pos, never looking at pos or past it. A width or precision can be a * (or *2$) that takes
+* it from the arguments. Anything it doesn't understand sets CPRINTF_FLAG_OTHER, and the length is then looked
+* for anywhere in the sequence.
+* Returns false if the sequence can't be printed at all (a * we couldn't make sense of, which would take an
+* argument nobody knows about).
+*/
+bool CPRINTF_NAME(read_spec)(const CPRINTF_CHAR* ptr, const CPRINTF_CHAR* pos, cprintf_op* op) {
+	const CPRINTF_CHAR* start;
+
+	++ptr;
+	op->arg = (unsigned short) CPRINTF_NAME(read_arg_number)(&ptr, pos);
+	start = ptr;
+
+	// flags
+	for (; ptr < pos; ++ptr) {
+		if (*ptr == CPRINTF_LIT('-'))
+			op->flags |= CPRINTF_FLAG_LEFT;
+		else if (*ptr == CPRINTF_LIT('+'))
+			op->flags |= CPRINTF_FLAG_PLUS;
+		else if (*ptr == CPRINTF_LIT(' '))
+			op->flags |= CPRINTF_FLAG_SPACE;
+		else if (*ptr == CPRINTF_LIT('#'))
+			op->flags |= CPRINTF_FLAG_ALT;
+		else if (*ptr == CPRINTF_LIT('0'))
+			op->flags |= CPRINTF_FLAG_ZERO;
+		else
+			break;
+	}
+	// width
+	if (ptr < pos && *ptr == CPRINTF_LIT('*')) {
+		++ptr;
+		op->flags |= CPRINTF_FLAG_STAR_WIDTH;
+		op->width_arg = (unsigned char) CPRINTF_NAME(read_arg_number)(&ptr, pos);
+	}
+	else {
+		for (; ptr < pos && *ptr >= CPRINTF_LIT('0') && *ptr <= CPRINTF_LIT('9'); ++ptr)
+			op->width = CPRINTF_MIN(CPRINTF_MAX(op->width, 0) * 10 + (int) (*ptr - CPRINTF_LIT('0')), 1 << 20);
+	}
+	// precision
+	if (ptr < pos && *ptr == CPRINTF_LIT('.')) {
+		op->precision = 0;
+		if (++ptr < pos && *ptr == CPRINTF_LIT('*')) {
+			++ptr;
+			op->flags |= CPRINTF_FLAG_STAR_PRECISION;
+			op->precision = -1; // until the argument says
+			op->precision_arg = (unsigned char) CPRINTF_NAME(read_arg_number)(&ptr, pos);
+		}
+		else {
+			for (; ptr < pos && *ptr >= CPRINTF_LIT('0') && *ptr <= CPRINTF_LIT('9'); ++ptr)
+				op->precision = CPRINTF_MIN(op->precision * 10 + (int) (*ptr - CPRINTF_LIT('0')), 1 << 20);
+		}
+	}
+	// length
+	if (ptr < pos && (CPRINTF_CLASS_OF(*ptr) & CPRINTF_CLASS_LENGTH)) {
+		op->length = length_modifier(ptr[0], ptr + 1 < pos ? ptr[1] : 0);
+		ptr += (op->length == CPRINTF_LENGTH_HH || op->length == CPRINTF_LENGTH_LL) ? 2 : 1;
+		if (op->length == CPRINTF_LENGTH_L && is_float_conversion((int) *pos)) // %lf is just %f
+			op->length = CPRINTF_LENGTH_NONE;
+	}
+
+	if (ptr == pos)
+		return true;
+
+	// leftovers, so fall back to finding the length anywhere in the sequence
+	op->flags |= CPRINTF_FLAG_OTHER;
+	for (const CPRINTF_CHAR* length_pos = start; length_pos < pos; ++length_pos) {
+		if (CPRINTF_CLASS_OF(*length_pos) & CPRINTF_CLASS_LENGTH) {
+			op->length = length_modifier(length_pos[0], length_pos + 1 < pos ? length_pos[1] : 0);
+			break;
+		}
+	}
+	for (; ptr < pos; ++ptr) {
+		if (*ptr == CPRINTF_LIT('*'))
+			return false;
+	}
+	return true;
+}
+
+/* Reads the op starting at ptr into op.
+* Returns where the op after it starts, or NULL if we're at the end of the format.
+*/
+const CPRINTF_CHAR* CPRINTF_NAME(next_op)(const CPRINTF_CHAR* format, const CPRINTF_CHAR* ptr, cprintf_op* op) {
+	const CPRINTF_CHAR* pos = NULL;
+
+	if (*ptr == CPRINTF_LIT('\0'))
+		return NULL;
+
+	op->start = ptr - format;
+	op->conversion = 0;
+	op->length = CPRINTF_LENGTH_NONE;
+	op->flags = 0;
+	op->fast = false;
+	op->kind = CPRINTF_ARG_NONE;
+	op->arg = 0;
+	op->width_arg = 0;
+	op->precision_arg = 0;
+	op->width = -1;
+	op->precision = -1;
+
+	// Everything up to the next % (or the end of the string) is literal text
+	if (*ptr != CPRINTF_LIT('%')) {
+		pos = CPRINTF_NAME(find_percent)(ptr);
+		op->type = CPRINTF_OP_LITERAL;
+		op->size = pos - ptr;
+		return pos;
+	}
+
+	// check if the % isn't an escaped %
+	if (ptr[1] == CPRINTF_LIT('%')) {
+		op->type = CPRINTF_OP_LITERAL;
+		op->start++;
+		op->size = 1;
+		return ptr + 2;
+	}
+
+	// If we get here, then we have come across a printf escape sequence
+
+	// Find any character in that string. These characters are the "ending characters"
+	pos = CPRINTF_NAME(find_ending)(ptr);
+	if (!pos) { // if we didn't find one, then drop the %
+		op->type = CPRINTF_OP_NONE;
+		op->size = 1;
+		return ptr + 1;
+	}
+	op->size = 1 + pos - ptr;
+	op->conversion = (unsigned char) *pos;
+
+	switch (*pos) {
+		case CPRINTF_LIT('m'): // our color escape sequence
+			if (ptr[1] != CPRINTF_LIT('[')) { // not the escape character we're looking for
+				op->type = CPRINTF_OP_NONE;
+				break;
+			}
+			op->type = CPRINTF_OP_COLOR;
+			CPRINTF_NAME(parse_color_sequence)(ptr, pos, &op->color);
+			break;
+		case CPRINTF_LIT(' '): // didn't finish the sequence
+			op->type = CPRINTF_OP_NONE;
+			break;
+		default:
+			if (!CPRINTF_NAME(read_spec)(ptr, pos, op)) { // drop it rather than guess what the * takes
+				op->type = CPRINTF_OP_NONE;
+				break;
+			}
+			op->type = CPRINTF_OP_CONVERSION;
+			op->fast = can_go_fast(op, CPRINTF_WIDE);
+			op->kind = deferred_kind(op);
+			break;
+	}
+	return pos + 1;
+}
+
+#if defined(CPRINTF_PRINT_ARG)
+#error Macro clash!
+#endif
+// hands one argument and the sequence in buf to the right printf
+#define CPRINTF_PRINT_ARG(value) CPRINTF_NAME(out_printf)(out, buf, value)
+
+/* Reads all of a format's arguments ahead of time, once its first conversion turns out to have a number.
+* False if arguments were already taken in order or the format's layout is broken.
+*/
+bool CPRINTF_NAME(read_numbered)(cprintf_out* out, const CPRINTF_CHAR* format, cprintf_args* args) {
+	arg_layout layout;
+	cprintf_op op;
+	unsigned next = 1;
+	arg_value* values;
+
+	if (args->next != 1)
+		return false;
+	memset(&layout, 0, sizeof(layout));
+	for (const CPRINTF_CHAR* ptr = format; (ptr = CPRINTF_NAME(next_op)(format, ptr, &op)) != NULL; ) {
+		if (op.type == CPRINTF_OP_CONVERSION)
+			layout_add(&layout, &next, &op);
+	}
+	values = scratch_alloc(out->arena, CPRINTF_MAX(layout.count, 1) * sizeof(arg_value));
+	return values && args_read(args, &layout, values);
+}
+
+/* Carries out one op. format is the string the op points into and chars_written is how much the call has
+* written so far (for %n).
+* Returns how many characters the op wrote, or a negative number if something went wrong.
+*/
+int CPRINTF_NAME(run_op)(cprintf_out* out, const cprintf_op* op, const CPRINTF_CHAR* format, cprintf_args* args, int chars_written) {
+	CPRINTF_CHAR buf[CPRINTF_BUF_SIZE];
+	cprintf_op starred;
+	const CPRINTF_CHAR* seq = format + op->start;
+	size_t skip = 0;
+	size_t size;
+	int res = 0;
+
+	switch (op->type) {
+		case CPRINTF_OP_LITERAL:
+			CPRINTF_NAME(out_write)(out, format + op->start, op->size);
+			return (int) op->size;
+		case CPRINTF_OP_COLOR: // the backend finds out in out_sync
+			CPRINTF_STAT(stats_color(out));
+			if (!out->colors)
+				return 0;
+			apply_color(&op->color, out->reset, &out->attributes);
+			out->pending_colors++;
+			return 0;
+		case CPRINTF_OP_CONVERSION:
+			CPRINTF_STAT(stats_conversion(out, op->conversion));
+			if (op->arg && !args->values && !CPRINTF_NAME(read_numbered)(out, format, args))
+				return -1;
+			if (op->flags & (CPRINTF_FLAG_STAR_WIDTH | CPRINTF_FLAG_STAR_PRECISION)) {
+				if (!take_stars(args, op, &starred))
+					return -1;
+				op = &starred;
+			}
+			if (!take_arg(args, op))
+				return -1;
+			if (op->fast)
+				return run_fast(out, op, CPRINTF_WIDE, args);
+			break;
+		default:
+			return 0;
+	}
+
+	if (op == &starred) {
+		// the *s were already read, so printf gets the sequence written back out with what they said
+		char spec[CPRINTF_BUF_SIZE];
+
+		deferred_spec(spec, op, op->precision, length_names[op->length]);
+		for (size = 0; spec[size]; ++size)
+			buf[size] = (CPRINTF_CHAR) spec[size];
+		buf[size] = CPRINTF_LIT('\0');
+	}
+	else {
+		// copy the sequence into a buffer for printf (truncated at CPRINTF_BUF_SIZE - 1 and always null terminated),
+		// minus the argument number: printf only ever gets the one argument (and not every printf knows %2$d)
+		if (op->arg) {
+			while (seq[skip] != CPRINTF_LIT('$'))
+				++skip;
+		}
+		buf[0] = CPRINTF_LIT('%');
+		size = CPRINTF_MIN(op->size - skip - 1, CPRINTF_BUF_SIZE - 2);
+		memcpy(buf + 1, seq + skip + 1, size * sizeof(CPRINTF_CHAR));
+		buf[size + 1] = CPRINTF_LIT('\0');
+	}
+
+	// Now we decipher what the user wants to do
+	// (anything smaller than an int gets promoted to an int on its way through the ...)
+	switch (op->conversion) {
+		case 'd': // signed decimal integer
+		case 'i': // signed decimal integer
+			switch (op->length) {
+				case CPRINTF_LENGTH_NONE:
+				case CPRINTF_LENGTH_BIG_L: // N/A but we will do default
+					res = CPRINTF_PRINT_ARG(CPRINTF_ARG(args, int, i));
+					break;
+				case CPRINTF_LENGTH_H:
+					res = CPRINTF_PRINT_ARG((short int) CPRINTF_ARG(args, int, i));
+					break;
+				case CPRINTF_LENGTH_HH:
+					res = CPRINTF_PRINT_ARG((signed char) CPRINTF_ARG(args, int, i));
+					break;
+				case CPRINTF_LENGTH_L:
+					res = CPRINTF_PRINT_ARG(CPRINTF_ARG(args, long int, i));
+					break;
+				case CPRINTF_LENGTH_LL:
+					res = CPRINTF_PRINT_ARG(CPRINTF_ARG(args, long long int, i));
+					break;
+				case CPRINTF_LENGTH_J:
+					res = CPRINTF_PRINT_ARG(CPRINTF_ARG(args, intmax_t, i));
+					break;
+				case CPRINTF_LENGTH_Z:
+					res = CPRINTF_PRINT_ARG(CPRINTF_ARG(args, size_t, i));
+					break;
+				case CPRINTF_LENGTH_T:
+					res = CPRINTF_PRINT_ARG(CPRINTF_ARG(args, ptrdiff_t, i));
+					break;
+				default:
+					break;
+			}
+			break;
+		case 'u': // unsigned decimal integer
+		case 'o': // unsigned octal
+		case 'x': // unsigned hexadecimal integer
+		case 'X': // unsigned hexadecimal integer (uppercase)
+			switch (op->length) {
+				case CPRINTF_LENGTH_NONE:
+				case CPRINTF_LENGTH_BIG_L: // N/A but we will do default
+					res = CPRINTF_PRINT_ARG(CPRINTF_ARG(args, unsigned int, i));
+					break;
+				case CPRINTF_LENGTH_H:
+					res = CPRINTF_PRINT_ARG((unsigned short int) CPRINTF_ARG(args, unsigned int, i));
+					break;
+				case CPRINTF_LENGTH_HH:
+					res = CPRINTF_PRINT_ARG((unsigned char) CPRINTF_ARG(args, unsigned int, i));
+					break;
+				case CPRINTF_LENGTH_L:
+					res = CPRINTF_PRINT_ARG(CPRINTF_ARG(args, unsigned long int, i));
+					break;
+				case CPRINTF_LENGTH_LL:
+					res = CPRINTF_PRINT_ARG(CPRINTF_ARG(args, unsigned long long int, i));
+					break;
+				case CPRINTF_LENGTH_J:
+					res = CPRINTF_PRINT_ARG(CPRINTF_ARG(args, uintmax_t, i));
+					break;
+				case CPRINTF_LENGTH_Z:
+					res = CPRINTF_PRINT_ARG(CPRINTF_ARG(args, size_t, i));
+					break;
+				case CPRINTF_LENGTH_T:
+					res = CPRINTF_PRINT_ARG(CPRINTF_ARG(args, ptrdiff_t, i));
+					break;
+				default:
+					break;
+			}
+			break;
+		case 'f': // decimal floating point
+		case 'F': // decimal floating point (uppercase)
+		case 'e': // scientific notation (mantissa/exponent)
+		case 'E': // scientific notation (mantissa/exponent) (uppercase)
+		case 'g': // Use the shortest representation: %e or %f
+		case 'G': // Use the shortest representation: %E or %F
+		case 'a': // hexadecimal floating point
+		case 'A': // Hexadecimal floating point (uppercase)
+			if (op->length == CPRINTF_LENGTH_NONE)
+				res = CPRINTF_PRINT_ARG(CPRINTF_ARG(args, double, d));
+			else if (op->length == CPRINTF_LENGTH_BIG_L)
+				res = CPRINTF_PRINT_ARG(CPRINTF_ARG(args, long double, ld));
+			break;
+		case 'c': // character
+			if (op->length == CPRINTF_LENGTH_NONE)
+				res = CPRINTF_PRINT_ARG(CPRINTF_ARG(args, int, i));
+			else if (op->length == CPRINTF_LENGTH_L)
+				res = CPRINTF_PRINT_ARG(CPRINTF_ARG(args, wint_t, i));
+			break;
+		case 's': // string of characters
+			if (op->length == CPRINTF_LENGTH_NONE)
+				res = CPRINTF_PRINT_ARG(CPRINTF_ARG(args, char*, p));
+			else if (op->length == CPRINTF_LENGTH_L)
+				res = CPRINTF_PRINT_ARG(CPRINTF_ARG(args, wchar_t*, p));
+			break;
+		case 'p': // pointer address
+			res = CPRINTF_PRINT_ARG(CPRINTF_ARG(args, void*, p));
+			break;
+		case 'n': // number of characters written so far
+			switch (op->length) {
+				case CPRINTF_LENGTH_NONE:
+					*CPRINTF_ARG(args, int*, p) = (int) chars_written;
+					break;
+				case CPRINTF_LENGTH_H:
+					*CPRINTF_ARG(args, short int*, p) = (short int) chars_written;
+					break;
+				case CPRINTF_LENGTH_HH:
+					*CPRINTF_ARG(args, signed char*, p) = (signed char) chars_written;
+					break;
+				case CPRINTF_LENGTH_L:
+					*CPRINTF_ARG(args, long int*, p) = (long int) chars_written;
+					break;
+				case CPRINTF_LENGTH_LL:
+					*CPRINTF_ARG(args, long long int*, p) = (long long int) chars_written;
+					break;
+				case CPRINTF_LENGTH_J:
+					*CPRINTF_ARG(args, intmax_t*, p) = (intmax_t) chars_written;
+					break;
+				case CPRINTF_LENGTH_Z:
+					*CPRINTF_ARG(args, size_t*, p) = (size_t) chars_written;
+					break;
+				case CPRINTF_LENGTH_T:
+					*CPRINTF_ARG(args, ptrdiff_t*, p) = (ptrdiff_t) chars_written;
+					break;
+				case CPRINTF_LENGTH_BIG_L: // N/A
+				default:
+					break;
+			}
+			res = 0;
+			break;
+		default:
+			break;
+	}
+	return res;
+}
+
+#undef CPRINTF_PRINT_ARG
+
+// Reads and carries out a whole format, as one call. sink is NULL for the terminal.
+int CPRINTF_NAME(run_format)(const cprintf_backend* sink, const CPRINTF_CHAR* format, va_list* arg) {
+	cprintf_out out;
+	cprintf_args args;
+	cprintf_op op;
+	int chars_written = 0;
+	int res;
+
+	startup_for(sink);
+	out_init(&out, sink);
+	args_init(&args, arg);
+
+	for (const CPRINTF_CHAR* ptr = format; (ptr = CPRINTF_NAME(next_op)(format, ptr, &op)) != NULL; ) {
+		res = CPRINTF_NAME(run_op)(&out, &op, format, &args, chars_written);
+		if (res < 0) {
+			out_close(&out);
+			return res;
+		}
+		chars_written += res;
+	}
+	return out_finish(&out, chars_written);
+}
@@ -0,0 +1,88 @@
+/* Times cprint::format against cprintf (and cprintf_compiled through the cache) on the same formats.
+* The output goes to a backend that throws it away, so this is just the cost of the call itself.
+* First it checks that cprint::format prints the same thing as cprintf for a few formats, and exits with 1 if not.
+* Build it with the library: c++ -std=c++20 -O2 tools/cprint_format_bench.cpp cprintf.o cprintf_backend.o -I. -o cprint_format_bench
+* (with cprintf.c and cprintf_backend.c compiled as C11 first).
+*/
+
+#include "cprintf.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+static int discard_write(void*, const char*, size_t) {
+	return 0;
+}
+static int discard_set(void*, cprintf_attr_t) {
+	return 0;
+}
+static int discard_get(void*, cprintf_attr_t* pAttrs) {
+	*pAttrs = FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE;
+	return 0;
+}
+static const cprintf_backend discard = { nullptr, discard_write, discard_set, discard_get, nullptr, 0 };
+
+// keeps the text (colors still go to discard_set, they aren't compared)
+static int capture_write(void* ctx, const char* bytes, size_t len) {
+	static_cast<std::string*>(ctx)->append(bytes, len);
+	return 0;
+}
+
+static int mismatches = 0;
+
+#define CPRINT_CHECK(FMT, ...) do { \
+		std::string c; \
+		std::string cpp; \
+		const cprintf_backend c_capture = { &c, capture_write, discard_set, discard_get, nullptr, 0 }; \
+		const cprintf_backend cpp_capture = { &cpp, capture_write, discard_set, discard_get, nullptr, 0 }; \
+		cprintf_set_backend(&c_capture); \
+		int c_res = cprintf(FMT __VA_OPT__(,) __VA_ARGS__); \
+		cprintf_set_backend(&cpp_capture); \
+		int cpp_res = cprint::format<FMT>(__VA_ARGS__); \
+		cprintf_set_backend(nullptr); \
+		if (c != cpp || c_res != cpp_res) { \
+			std::printf("mismatch for %s: cprintf gave \"%s\" (%d), format<> gave \"%s\" (%d)\n", #FMT, c.c_str(), c_res, \
+				cpp.c_str(), cpp_res); \
+			mismatches++; \
+		} \
+	} while (0)
+
+template <typename F>
+static double time_it(long iterations, F&& call) {
+	auto start = std::chrono::steady_clock::now();
+	for (long i = 0; i < iterations; ++i)
+		call(i);
+	std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count() / (double) iterations;
+}
+
+#define CPRINT_BENCH(FMT, ...) do { \
+		double c = time_it(iterations, [&](long i) { (void) i; cprintf(FMT __VA_OPT__(,) __VA_ARGS__); }); \
+		double compiled = time_it(iterations, [&](long i) { (void) i; cprintf_compiled(cprintf_cache(FMT) __VA_OPT__(,) __VA_ARGS__); }); \
+		double cpp = time_it(iterations, [&](long i) { (void) i; cprint::format<FMT>(__VA_ARGS__); }); \
+		std::printf("%-40s %10.1f %10.1f %10.1f\n", #FMT, c, compiled, cpp); \
+	} while (0)
+
+int main(int argc, char** argv) {
+	long iterations = argc > 1 ? std::atol(argv[1]) : 1000000;
+
+	CPRINT_CHECK("[%d|%-5x|%+d|%05d]\n", -42, 255u, 7, -3);
+	CPRINT_CHECK("[% d|% d|% 5d|%- 5d|% 05d]\n", 5, -5, 42, 42, 42);
+	CPRINT_CHECK("[%lf|%lg|%.2le]\n", 1.5, 0.1, 12345.678);
+	CPRINT_CHECK("[%5 d]\n");
+	CPRINT_CHECK("%[1;31m[%8s|%-3c]%[0m\n", "text", 'x');
+	if (mismatches)
+		return 1;
+
+	cprintf_set_backend(&discard);
+	std::printf("%-40s %10s %10s %10s (ns per call)\n", "format", "cprintf", "compiled", "format<>");
+	CPRINT_BENCH("just some literal text here\n");
+	CPRINT_BENCH("%d\n", (int) i);
+	CPRINT_BENCH("%5d|%-8x|%s\n", (int) i, (unsigned) i, "text");
+	CPRINT_BENCH("%[1;31mred%[0m %[32m%s%[0m\n", "green");
+	CPRINT_BENCH("[%s] %[33m%d%[0m items, %lu bytes\n", "info", (int) i, (unsigned long) i * 3);
+	CPRINT_BENCH("%.3f %s\n", (double) i * 0.5, "float");
+	cprintf_set_backend(nullptr);
+	return 0;
+}
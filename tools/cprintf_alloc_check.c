@@ -0,0 +1,224 @@
+/* Checks that printing doesn't allocate once a thread's warmed up. It runs a mix of formats (colors, %s, %ls,
+* floats, and conversions too big for the output buffer) through cprintf, cwprintf and csnprintf, with atomic
+* writes off and on, and counts every allocation made while they run two ways:
+* - through a cprintf_allocator that counts what cprintf asks for
+* - with glibc, by replacing malloc, calloc, realloc and free themselves, which also catches anything the C
+*   library does for us (vsnprintf, vswprintf...)
+* It prints the counts and exits with 1 if either one isn't 0.
+* Then it makes a few calls far bigger than anything cprintf keeps around for next time (a %4000000.2f and the
+* like) and checks that what the thread holds on to afterwards goes back to about what it was, instead of
+* growing by the size of the biggest call.
+* Build it with the library: cc -std=c11 -O2 tools/cprintf_alloc_check.c cprintf.c cprintf_backend.c -I. -o cprintf_alloc_check
+* (add -lpthread where threads.h needs it), or use the cprintf_alloc_check target in CMakeLists.txt. Building the
+* library with CPRINTF_NO_MALLOC too makes it assert at the allocation instead.
+* Run it with how many times to go through the mix (1000 by default).
+*/
+
+#include "cprintf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <wchar.h>
+
+static bool counting = false;
+static unsigned long libc_allocs = 0;
+static unsigned long libc_frees = 0;
+static unsigned long hook_allocs = 0;
+static unsigned long hook_frees = 0;
+static size_t live_bytes = 0; // what cprintf has from the allocator right now
+
+// ======================
+// malloc, replaced
+// ======================
+
+#if defined(__GLIBC__)
+#define HAVE_LIBC_COUNTS 1
+
+// glibc's own versions, which are still there under these names when we replace the usual ones
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void __libc_free(void* ptr);
+
+void* malloc(size_t size) {
+	if (counting)
+		libc_allocs++;
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+	if (counting)
+		libc_allocs++;
+	return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+	if (counting)
+		libc_allocs++;
+	return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr) {
+	if (counting && ptr)
+		libc_frees++;
+	__libc_free(ptr);
+}
+#else
+#define HAVE_LIBC_COUNTS 0
+#endif
+
+// ======================
+// an allocator that counts
+// ======================
+
+// each allocation has its size in front of it, so live_bytes can keep up
+#define HEADER sizeof(max_align_t)
+
+static void* count_alloc(void* ctx, size_t size) {
+	char* base = malloc(HEADER + size);
+	(void) ctx;
+	if (counting)
+		hook_allocs++;
+	if (!base)
+		return NULL;
+	memcpy(base, &size, sizeof(size));
+	live_bytes += size;
+	return base + HEADER;
+}
+
+static void* count_resize(void* ctx, void* ptr, size_t size) {
+	char* base = (char*) ptr - HEADER;
+	size_t old;
+	(void) ctx;
+	if (counting)
+		hook_allocs++;
+	memcpy(&old, base, sizeof(old));
+	base = realloc(base, HEADER + size);
+	if (!base)
+		return NULL;
+	memcpy(base, &size, sizeof(size));
+	live_bytes += size - old;
+	return base + HEADER;
+}
+
+static void count_release(void* ctx, void* ptr) {
+	char* base = (char*) ptr - HEADER;
+	size_t size;
+	(void) ctx;
+	if (counting)
+		hook_frees++;
+	memcpy(&size, base, sizeof(size));
+	live_bytes -= size;
+	free(base);
+}
+
+// ======================
+// a backend that throws everything away
+// ======================
+
+static int null_write(void* ctx, const char* bytes, size_t len) {
+	(void) ctx;
+	(void) bytes;
+	(void) len;
+	return 0;
+}
+static int null_set(void* ctx, cprintf_attr_t attrs) {
+	(void) ctx;
+	(void) attrs;
+	return 0;
+}
+static int null_get(void* ctx, cprintf_attr_t* pAttrs) {
+	(void) ctx;
+	*pAttrs = FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE;
+	return 0;
+}
+static size_t null_encode(void* ctx, cprintf_attr_t attrs, char* buf) {
+	(void) ctx;
+	return cprintf_encode_ansi(attrs, buf);
+}
+
+// ======================
+// the workload
+// ======================
+
+static char buf[256];
+static char big[8192]; // more than a call's output buffer holds
+
+static void workload(long i) {
+	cprintf("%[1;30m12:00:%02ld%[0m [%[1;32m%-5s%[0m] worker %[36m%ld%[0m took %[33m%.3f%[0m ms\n", i % 60, "INFO",
+		i % 8, (double) (i % 1000) / 7.0);
+	cprintf("%[38;5;208m%ls%[0m %[48;2;20;40;60m%10.4e%[0m %g %s\n", L"wide \x00e9t\x00e9", (double) i * 1.5e7, 0.1 * (double) i,
+		"narrow");
+	cprintf("%[31m%s%[0m\n", big); // bigger than the buffer all at once
+	cprintf("%[32m%*.*s%[0m\n", 6000, 6000, "padded"); // a conversion bigger than the buffer
+	cwprintf(L"%[1;34m%ls%[0m %s %8.2f %lc\n", L"\x00fcber", "utf-8 \xc3\xa9", (double) i / 3.0, (wint_t) L'\x263a');
+	cwprintf(L"%[35m%-400.3f%[0m|\n", (double) i); // more than vswprintf's first try holds
+	csnprintf(buf, sizeof(buf), "%[1;31merror%[0m: %s at %p (%.2f%%)", "oops", (void*) buf, 99.5);
+}
+
+static int report(const char* name, long rounds) {
+	int failed = hook_allocs || hook_frees || libc_allocs || libc_frees;
+	printf("%-18s %8ld rounds: cprintf allocator %lu allocs %lu frees", name, rounds, hook_allocs, hook_frees);
+	if (HAVE_LIBC_COUNTS)
+		printf(", malloc %lu allocs %lu frees", libc_allocs, libc_frees);
+	printf("%s\n", failed ? "  FAILED" : "");
+	hook_allocs = hook_frees = libc_allocs = libc_frees = 0;
+	return failed;
+}
+
+static int run(const char* name, long rounds) {
+	workload(0); // warm up: the thread's buffers and arena get made here
+	workload(1);
+	counting = true;
+	for (long i = 0; i < rounds; ++i)
+		workload(i);
+	counting = false;
+	return report(name, rounds);
+}
+
+// Makes calls that need megabytes while they run and checks the thread doesn't keep that much afterwards
+static int run_big(const char* name) {
+	const size_t limit = 1 << 20; // what it's allowed to keep on top of what it had, a lot less than the calls took
+	size_t before;
+	size_t after;
+	int failed;
+
+	workload(0);
+	before = live_bytes;
+	cprintf("%4000000d\n", 1); // one conversion bigger than any buffer
+	cprintf("%[32m%*s%[0m\n", 4000000, "padded");
+	cprintf("%#4000000.2f\n", 1.5); // one that goes through snprintf (# isn't done fast), so it needs scratch space that big
+	cwprintf(L"%-3000000ls|%#3000000.3e\n", L"wide \x00fcber", 2.5); // and vswprintf's room
+	after = live_bytes;
+	failed = after > before + limit;
+	printf("%-18s big calls: kept %zu bytes before, %zu after%s\n", name, before, after, failed ? "  FAILED" : "");
+	return failed;
+}
+
+int main(int argc, char** argv) {
+	static const cprintf_allocator allocator = { NULL, count_alloc, count_resize, count_release };
+	cprintf_backend backend = { NULL, null_write, null_set, null_get, null_encode, 0 };
+	long rounds = argc > 1 ? atol(argv[1]) : 1000;
+	int failed = 0;
+
+	if (rounds <= 0)
+		return 1;
+	memset(big, 'x', sizeof(big) - 1);
+	cprintf_set_allocator(&allocator);
+	cprintf_set_backend(&backend);
+	cprintf_set_color_level(CPRINTF_COLOR_TRUECOLOR);
+	if (!HAVE_LIBC_COUNTS)
+		printf("(not glibc, so only what goes through the cprintf allocator is counted)\n");
+
+	failed |= run("atomic writes off", rounds);
+	failed |= run_big("atomic writes off");
+	cprintf_set_atomic_writes(true);
+	failed |= run("atomic writes on", rounds);
+	failed |= run_big("atomic writes on");
+	cprintf_set_atomic_writes(false);
+
+	cprintf_set_color_level(CPRINTF_COLOR_AUTO);
+	cprintf_set_backend(NULL);
+	return failed;
+}
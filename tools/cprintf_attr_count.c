@@ -0,0 +1,116 @@
+/* Counts the set_attributes and get_attributes calls a handful of real-world styled log lines cost, against how many
+* color sequences they have, to check that back-to-back sequences (%[0m%[1;32m), ones that put back the color that's
+* already there and ones with no text after them don't each turn into a backend call. The backend has no
+* encode_attributes, so every color change has to go through set_attributes, like on a Windows console.
+* Build it with the library: cc -std=c11 -O2 tools/cprintf_attr_count.c cprintf.c cprintf_backend.c -I. -o cprintf_attr_count
+* (add -lpthread where threads.h needs it). Run it with how many times to print each line (1000 by default).
+* It exits with 1 if a line took more set_attributes calls than it should.
+*/
+
+#include "cprintf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned long set_calls = 0;
+static unsigned long get_calls = 0;
+static cprintf_attr_t shown = FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE;
+
+static int count_write(void* ctx, const char* bytes, size_t len) {
+	(void) ctx;
+	(void) bytes;
+	(void) len;
+	return 0;
+}
+static int count_set(void* ctx, cprintf_attr_t attrs) {
+	(void) ctx;
+	shown = attrs;
+	set_calls++;
+	return 0;
+}
+static int count_get(void* ctx, cprintf_attr_t* pAttrs) {
+	(void) ctx;
+	*pAttrs = shown;
+	get_calls++;
+	return 0;
+}
+static const cprintf_backend counter = { NULL, count_write, count_set, count_get, NULL, 0 };
+
+// One line of the corpus and the most set_attributes calls printing it should take
+typedef struct corpus_line {
+	const char* name;
+	const char* format;
+	unsigned long most_sets;
+} corpus_line;
+
+// Every line takes the same arguments (three strings, an int and a double), and uses however many of them it wants
+static void print_line(const corpus_line* line, long i) {
+	cprintf(line->format, "12:00:01", "INFO", "worker finished", (int) (i % 100), (double) (i % 1000) / 10.0);
+}
+
+static const corpus_line corpus[] = {
+	{ "log line", "%[1;30m%s%[0m [%[1;32m%-5s%[0m] %s %d in %.1f ms\n", 4 },
+	{ "reset then color", "%[0m%[1;32m%s%[0m%[0m [%s] %s\n", 2 },
+	{ "same color twice", "%[1;31m%s %[1;31m%s%[0m %s\n", 2 },
+	{ "color, no text", "%[1;33m%[0m%s %s %s\n", 0 },
+	{ "color back to start", "%[36m%[0m%[1m%[0m%s\n", 0 },
+	{ "diagnostic", "%[1m%s:%[0m %[1;31m%s:%[0m%[1m %s%[0m\n", 5 },
+	{ "progress", "%[32m[%-20s]%[0m %s %s %3d%%\n", 2 },
+	{ "plain", "%s [%s] %s %d\n", 0 },
+	{ "trailing color", "%s [%[1;34m%s%[0m]%[1;35m\n", 3 },
+};
+
+// How many color sequences are in format
+static unsigned long sequences(const char* format) {
+	unsigned long count = 0;
+	for (const char* ptr = format; (ptr = strstr(ptr, "%[")) != NULL; ptr += 2)
+		count++;
+	return count;
+}
+
+int main(int argc, char** argv) {
+	long rounds = argc > 1 ? atol(argv[1]) : 1000;
+	size_t lines = sizeof(corpus) / sizeof(corpus[0]);
+	unsigned long total_sequences = 0;
+	unsigned long total_sets = 0;
+	unsigned long total_gets;
+	int failed = 0;
+
+	if (rounds <= 0)
+		return 1;
+	cprintf_set_backend(&counter);
+	cprintf_set_color_level(CPRINTF_COLOR_16);
+	cprintf("%[0m"); // so the attributes it starts from have already been asked for
+	get_calls = 0;
+	set_calls = 0;
+
+	printf("%-20s %10s %10s %10s\n", "per line", "sequences", "set", "get");
+	for (size_t i = 0; i < lines; ++i) {
+		unsigned long sets = set_calls;
+		unsigned long gets = get_calls;
+		unsigned long count = sequences(corpus[i].format);
+		for (long j = 0; j < rounds; ++j) {
+			print_line(&corpus[i], j);
+			// puts back the colors the line started in, like whatever gets printed after it would (not counted)
+			if (shown != (FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE)) {
+				cprintf("%[0m");
+				set_calls--;
+			}
+		}
+		sets = set_calls - sets;
+		gets = get_calls - gets;
+		total_sequences += count * rounds;
+		total_sets += sets;
+		printf("%-20s %10lu %10.2f %10.2f%s\n", corpus[i].name, count, (double) sets / rounds, (double) gets / rounds,
+			sets > corpus[i].most_sets * rounds ? "  too many" : "");
+		if (sets > corpus[i].most_sets * rounds)
+			failed = 1;
+	}
+	total_gets = get_calls;
+	printf("%-20s %10.2f %10.2f %10.2f\n", "all", (double) total_sequences / (rounds * lines),
+		(double) total_sets / (rounds * lines), (double) total_gets / (rounds * lines));
+
+	cprintf_set_color_level(CPRINTF_COLOR_AUTO);
+	cprintf_set_backend(NULL);
+	return failed;
+}
@@ -0,0 +1,580 @@
+/* Times the formatter's hot paths against snprintf/printf and prints the results as JSON, to keep track of them over time:
+* - literal text, each family of conversions, color sequences, wide against narrow, compiled formats
+* - csnprintf (just the formatter, into memory), cprintf (through a backend that throws the output away) and
+*   cfprintf to /dev/null (NUL on Windows), next to snprintf and fprintf to the same place
+* - how a log line scales from 1 to N threads (csnprintf, atomic writes and async mode, against snprintf), with
+*   a count of writes that weren't exactly one whole line
+* - how long a call takes to queue in async mode with 1 and N threads at once (p50/p99/p999)
+* - how fast the % scanner gets through formats of 16 bytes to 64 KiB of literal text, with each scanner this CPU has
+* Build it with the library: cc -std=c11 -O2 tools/cprintf_bench.c cprintf.c cprintf_backend.c -I. -o cprintf_bench
+* (add -lpthread where threads.h needs it), or use the cprintf_bench target in CMakeLists.txt.
+* Options: -o file writes the JSON there instead of stdout, -t n is the most threads (4 by default), -m ms is how
+* long each measurement runs for (100 by default) and -f text only runs the cases with text in their group/name/impl.
+*/
+
+#include "cprintf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <threads.h>
+#include <stdatomic.h>
+
+#define MAX_THREADS 64
+#define LATENCY_CALLS 100000 // per thread, for the async latency
+
+static double min_seconds = 0.1;
+static const char* filter = NULL;
+static FILE* devnull;
+static FILE* out;
+
+// every call formats into the calling thread's own buffer, so the threads don't share (or fight over) one
+static thread_local char buf[256];
+static thread_local wchar_t wbuf[256];
+static thread_local volatile int keep; // so the compiler can't decide the calls don't matter
+
+static double now(void) {
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+// ======================
+// a backend that throws everything away
+// ======================
+
+static atomic_bool check_lines = false;
+static atomic_ulong torn_writes = 0; // writes that weren't one whole line, while check_lines is on
+
+static int null_write(void* ctx, const char* bytes, size_t len) {
+	(void) ctx;
+	if (atomic_load_explicit(&check_lines, memory_order_relaxed)) {
+		const char* newline = memchr(bytes, '\n', len);
+		if (newline != bytes + len - 1)
+			atomic_fetch_add_explicit(&torn_writes, 1, memory_order_relaxed);
+	}
+	return 0;
+}
+static int null_set(void* ctx, cprintf_attr_t attrs) {
+	(void) ctx;
+	(void) attrs;
+	return 0;
+}
+static int null_get(void* ctx, cprintf_attr_t* pAttrs) {
+	(void) ctx;
+	*pAttrs = FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE;
+	return 0;
+}
+static size_t null_encode(void* ctx, cprintf_attr_t attrs, char* buf) {
+	(void) ctx;
+	return cprintf_encode_ansi(attrs, buf);
+}
+static const cprintf_backend null_backend = { NULL, null_write, null_set, null_get, null_encode, 0 };
+
+// ======================
+// the cases
+// ======================
+
+// A case does its call n times (i is the iteration, for arguments that change) and returns what the calls returned, added up
+#define BENCH(id, call) static long id(long n) { \
+		long total = 0; \
+		for (long i = 0; i < n; ++i) \
+			total += (call); \
+		keep = buf[0]; \
+		return total; \
+	}
+
+#define LITERAL "a line of plain text with no conversions and no colors in it at all, like a banner\n"
+#define LOG_FORMAT "[%s] %s:%d request %lu took %.2f ms\n"
+#define LOG_ARGS "INFO", "server.c", (int) (i & 1023), (unsigned long) i, (double) (i & 4095) / 7.0
+#define COLOR_LOG "%[1;32m[%s]%[0m %[36m%s%[0m:%d request %[1m%lu%[0m took %[33m%.2f%[0m ms\n"
+#define ANSI_LOG "\x1b[1;32m[%s]\x1b[0m \x1b[36m%s\x1b[0m:%d request \x1b[1m%lu\x1b[0m took \x1b[33m%.2f\x1b[0m ms\n"
+
+/* Formats with no conversions in them go to snprintf through a volatile pointer, or the compiler turns the call
+* into a copy (or nothing at all) and there's nothing left to compare against.
+*/
+static const char* volatile literal_format = LITERAL;
+static const char* volatile color_one_format = "\x1b[31mred\x1b[0m";
+static const char* volatile color_ext_format = "\x1b[38;5;208mx\x1b[38;2;255;128;0;48;2;20;20;20my\x1b[0m";
+
+BENCH(literal_csn, csnprintf(buf, sizeof(buf), LITERAL))
+BENCH(literal_sn, snprintf(buf, sizeof(buf), literal_format))
+BENCH(literal_c, cprintf(LITERAL))
+BENCH(literal_cf, cfprintf(devnull, LITERAL))
+BENCH(literal_f, fprintf(devnull, literal_format))
+
+// one of each family the engine's conversion switch handles, in isolation
+BENCH(int_csn, csnprintf(buf, sizeof(buf), "%d", (int) i))
+BENCH(int_sn, snprintf(buf, sizeof(buf), "%d", (int) i))
+BENCH(width_csn, csnprintf(buf, sizeof(buf), "%08d|%-6d", (int) i, (int) -i))
+BENCH(width_sn, snprintf(buf, sizeof(buf), "%08d|%-6d", (int) i, (int) -i))
+BENCH(unsigned_csn, csnprintf(buf, sizeof(buf), "%u %x %o %X", (unsigned) i, (unsigned) i, (unsigned) i, (unsigned) i))
+BENCH(unsigned_sn, snprintf(buf, sizeof(buf), "%u %x %o %X", (unsigned) i, (unsigned) i, (unsigned) i, (unsigned) i))
+BENCH(long_csn, csnprintf(buf, sizeof(buf), "%lld %zu", (long long) i * 1000003, (size_t) i))
+BENCH(long_sn, snprintf(buf, sizeof(buf), "%lld %zu", (long long) i * 1000003, (size_t) i))
+BENCH(char_csn, csnprintf(buf, sizeof(buf), "%c%c", 'a' + (int) (i % 26), 'A' + (int) (i % 26)))
+BENCH(char_sn, snprintf(buf, sizeof(buf), "%c%c", 'a' + (int) (i % 26), 'A' + (int) (i % 26)))
+BENCH(string_csn, csnprintf(buf, sizeof(buf), "%s %-12.8s", "a string of some length", "padded and cut"))
+BENCH(string_sn, snprintf(buf, sizeof(buf), "%s %-12.8s", "a string of some length", "padded and cut"))
+BENCH(float_csn, csnprintf(buf, sizeof(buf), "%f %.3e %g", (double) i * 0.25, (double) i * 1.5, (double) i / 3.0))
+BENCH(float_sn, snprintf(buf, sizeof(buf), "%f %.3e %g", (double) i * 0.25, (double) i * 1.5, (double) i / 3.0))
+BENCH(pointer_csn, csnprintf(buf, sizeof(buf), "%p", (void*) (buf + (i & 15))))
+BENCH(pointer_sn, snprintf(buf, sizeof(buf), "%p", (void*) (buf + (i & 15))))
+BENCH(log_csn, csnprintf(buf, sizeof(buf), LOG_FORMAT, LOG_ARGS))
+BENCH(log_sn, snprintf(buf, sizeof(buf), LOG_FORMAT, LOG_ARGS))
+BENCH(log_c, cprintf(LOG_FORMAT, LOG_ARGS))
+BENCH(log_cf, cfprintf(devnull, LOG_FORMAT, LOG_ARGS))
+BENCH(log_f, fprintf(devnull, LOG_FORMAT, LOG_ARGS))
+BENCH(log_compiled, cprintf_compiled(cprintf_cache(LOG_FORMAT), LOG_ARGS))
+
+// color sequences (parse_color_sequence), against printf with the escape sequences already written out
+BENCH(color_one_csn, csnprintf(buf, sizeof(buf), "%[31mred%[0m"))
+BENCH(color_one_sn, snprintf(buf, sizeof(buf), color_one_format))
+BENCH(color_one_c, cprintf("%[31mred%[0m"))
+BENCH(color_ext_csn, csnprintf(buf, sizeof(buf), "%[38;5;208mx%[38;2;255;128;0;48;2;20;20;20my%[0m"))
+BENCH(color_ext_sn, snprintf(buf, sizeof(buf), color_ext_format))
+BENCH(color_ext_c, cprintf("%[38;5;208mx%[38;2;255;128;0;48;2;20;20;20my%[0m"))
+BENCH(color_log_csn, csnprintf(buf, sizeof(buf), COLOR_LOG, LOG_ARGS))
+BENCH(color_log_sn, snprintf(buf, sizeof(buf), ANSI_LOG, LOG_ARGS))
+BENCH(color_log_c, cprintf(COLOR_LOG, LOG_ARGS))
+BENCH(color_log_cf, cfprintf(devnull, COLOR_LOG, LOG_ARGS))
+BENCH(color_log_f, fprintf(devnull, ANSI_LOG, LOG_ARGS))
+BENCH(color_log_compiled, cprintf_compiled(cprintf_cache(COLOR_LOG), LOG_ARGS))
+
+// the same output from a wide format and a narrow one
+BENCH(wide_literal_c, cwprintf(L"" LITERAL))
+BENCH(wide_literal_sw, swprintf(wbuf, sizeof(wbuf) / sizeof(wbuf[0]), L"" LITERAL))
+BENCH(wide_log_c, cwprintf(L"[%ls] %ls:%d request %lu took %.2f ms\n", L"INFO", L"server.c", (int) (i & 1023), (unsigned long) i,
+	(double) (i & 4095) / 7.0))
+BENCH(wide_log_sw, swprintf(wbuf, sizeof(wbuf) / sizeof(wbuf[0]), L"[%ls] %ls:%d request %lu took %.2f ms\n", L"INFO", L"server.c",
+	(int) (i & 1023), (unsigned long) i, (double) (i & 4095) / 7.0))
+BENCH(wide_arg_c, cprintf("[%ls] %ls:%d request %lu took %.2f ms\n", L"INFO", L"server.c", (int) (i & 1023), (unsigned long) i,
+	(double) (i & 4095) / 7.0))
+
+typedef struct bench_case {
+	const char* group;
+	const char* name;
+	const char* impl;
+	long (*run)(long n);
+} bench_case;
+
+static const bench_case cases[] = {
+	{ "literal", "literal", "csnprintf", literal_csn },
+	{ "literal", "literal", "snprintf", literal_sn },
+	{ "literal", "literal", "cprintf", literal_c },
+	{ "literal", "literal", "cfprintf", literal_cf },
+	{ "literal", "literal", "fprintf", literal_f },
+	{ "conversion", "%d", "csnprintf", int_csn },
+	{ "conversion", "%d", "snprintf", int_sn },
+	{ "conversion", "%08d|%-6d", "csnprintf", width_csn },
+	{ "conversion", "%08d|%-6d", "snprintf", width_sn },
+	{ "conversion", "%u %x %o %X", "csnprintf", unsigned_csn },
+	{ "conversion", "%u %x %o %X", "snprintf", unsigned_sn },
+	{ "conversion", "%lld %zu", "csnprintf", long_csn },
+	{ "conversion", "%lld %zu", "snprintf", long_sn },
+	{ "conversion", "%c%c", "csnprintf", char_csn },
+	{ "conversion", "%c%c", "snprintf", char_sn },
+	{ "conversion", "%s %-12.8s", "csnprintf", string_csn },
+	{ "conversion", "%s %-12.8s", "snprintf", string_sn },
+	{ "conversion", "%f %.3e %g", "csnprintf", float_csn },
+	{ "conversion", "%f %.3e %g", "snprintf", float_sn },
+	{ "conversion", "%p", "csnprintf", pointer_csn },
+	{ "conversion", "%p", "snprintf", pointer_sn },
+	{ "log", "log line", "csnprintf", log_csn },
+	{ "log", "log line", "snprintf", log_sn },
+	{ "log", "log line", "cprintf", log_c },
+	{ "log", "log line", "cprintf_compiled", log_compiled },
+	{ "log", "log line", "cfprintf", log_cf },
+	{ "log", "log line", "fprintf", log_f },
+	{ "color", "one color", "csnprintf", color_one_csn },
+	{ "color", "one color", "snprintf", color_one_sn },
+	{ "color", "one color", "cprintf", color_one_c },
+	{ "color", "256 and 24-bit", "csnprintf", color_ext_csn },
+	{ "color", "256 and 24-bit", "snprintf", color_ext_sn },
+	{ "color", "256 and 24-bit", "cprintf", color_ext_c },
+	{ "color", "colored log line", "csnprintf", color_log_csn },
+	{ "color", "colored log line", "snprintf", color_log_sn },
+	{ "color", "colored log line", "cprintf", color_log_c },
+	{ "color", "colored log line", "cprintf_compiled", color_log_compiled },
+	{ "color", "colored log line", "cfprintf", color_log_cf },
+	{ "color", "colored log line", "fprintf", color_log_f },
+	{ "wide", "literal", "cwprintf", wide_literal_c },
+	{ "wide", "literal", "swprintf", wide_literal_sw },
+	{ "wide", "literal", "cprintf", literal_c },
+	{ "wide", "log line", "cwprintf", wide_log_c },
+	{ "wide", "log line", "swprintf", wide_log_sw },
+	{ "wide", "log line", "cprintf", log_c },
+	{ "wide", "log line, %ls arguments", "cprintf", wide_arg_c }
+};
+
+// the modes the scaling cases run cprintf in
+typedef enum bench_mode {
+	MODE_PLAIN,
+	MODE_ATOMIC,
+	MODE_ASYNC
+} bench_mode;
+
+typedef struct scaling_case {
+	const char* impl;
+	bench_mode mode;
+	long (*run)(long n);
+} scaling_case;
+
+static const scaling_case scaling_cases[] = {
+	{ "csnprintf", MODE_PLAIN, color_log_csn },
+	{ "snprintf", MODE_PLAIN, color_log_sn },
+	{ "cprintf_atomic", MODE_ATOMIC, color_log_c },
+	{ "cprintf_async", MODE_ASYNC, color_log_c }
+};
+
+// ======================
+// running them
+// ======================
+
+static bool wanted(const char* group, const char* name, const char* impl) {
+	char key[128];
+	if (!filter)
+		return true;
+	snprintf(key, sizeof(key), "%s/%s/%s", group, name, impl);
+	return strstr(key, filter) != NULL;
+}
+
+// how many calls take about min_seconds
+static long calibrate(long (*run)(long)) {
+	long n = 1;
+	double elapsed;
+
+	for (;;) {
+		elapsed = now();
+		run(n);
+		elapsed = now() - elapsed;
+		if (elapsed >= min_seconds || n > LONG_MAX / 100)
+			return n;
+		n = elapsed > min_seconds / 100 ? (long) ((double) n * min_seconds / elapsed * 1.1) + 1 : n * 10;
+	}
+}
+
+static void json_string(const char* str) {
+	fputc('"', out);
+	for (; *str; ++str) {
+		if (*str == '"' || *str == '\\')
+			fputc('\\', out);
+		fputc(*str, out);
+	}
+	fputc('"', out);
+}
+
+static bool first_result = true;
+
+static void json_result(const char* group, const char* name, const char* impl, int threads, long calls, double seconds,
+	long total) {
+	fprintf(out, "%s\n\t\t{ \"group\": ", first_result ? "" : ",");
+	first_result = false;
+	json_string(group);
+	fprintf(out, ", \"name\": ");
+	json_string(name);
+	fprintf(out, ", \"impl\": ");
+	json_string(impl);
+	fprintf(out, ", \"threads\": %d, \"calls\": %ld, \"ns_per_call\": %.2f, \"calls_per_sec\": %.0f, \"returned_per_call\": %.1f",
+		threads, calls, seconds * 1e9 / (double) calls, (double) calls / seconds, (double) total / (double) calls);
+}
+
+// the best of 3 runs of n calls, to keep the noise down
+static double best_of_3(long (*run)(long), long n, long* pTotal) {
+	double best = 0;
+
+	for (int rep = 0; rep < 3; ++rep) {
+		double elapsed = now();
+		*pTotal = run(n);
+		elapsed = now() - elapsed;
+		if (rep == 0 || elapsed < best)
+			best = elapsed;
+	}
+	return best;
+}
+
+static void run_cases(void) {
+	for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c) {
+		const bench_case* bench = &cases[c];
+		double best;
+		long total = 0;
+		long n;
+
+		if (!wanted(bench->group, bench->name, bench->impl))
+			continue;
+		n = calibrate(bench->run);
+		best = best_of_3(bench->run, n, &total);
+		json_result(bench->group, bench->name, bench->impl, 1, n, best, total);
+		fprintf(out, " }");
+		fprintf(stderr, "%-12s %-24s %-18s %10.1f ns\n", bench->group, bench->name, bench->impl, best * 1e9 / (double) n);
+	}
+}
+
+// ======================
+// the scanner sweep
+// ======================
+
+#define SCAN_MAX 65536
+
+static char scan_format[SCAN_MAX + 1];
+static char scan_buf[SCAN_MAX + 16];
+
+// one %d at the very end, so everything before it is literal text for the scanner to get through
+BENCH(scan_csn, csnprintf(scan_buf, sizeof(scan_buf), scan_format, (int) (i & 7)))
+
+typedef struct scanner_case {
+	const char* impl;
+	cprintf_scanner scanner;
+} scanner_case;
+
+static const scanner_case scanners[] = {
+	{ "scalar", CPRINTF_SCANNER_SCALAR },
+	{ "sse2", CPRINTF_SCANNER_SSE2 },
+	{ "avx2", CPRINTF_SCANNER_AVX2 }
+};
+
+static void run_scan(void) {
+	static const size_t sizes[] = { 16, 64, 256, 1024, 4096, 16384, 65536 };
+	const char* text = LITERAL;
+	size_t text_len = strlen(text) - 1; // (not the newline)
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+		size_t size = sizes[s];
+		char name[32];
+
+		for (size_t i = 0; i < size - 3; ++i)
+			scan_format[i] = text[i % text_len];
+		memcpy(scan_format + size - 3, "%d\n", 4);
+		snprintf(name, sizeof(name), "%zu bytes", size);
+
+		for (size_t c = 0; c < sizeof(scanners) / sizeof(scanners[0]); ++c) {
+			double best;
+			long total = 0;
+			long n;
+
+			if (!wanted("scan", name, scanners[c].impl))
+				continue;
+			if (cprintf_set_scanner(scanners[c].scanner) < 0) {
+				fprintf(stderr, "%-12s %-24s %-18s %13s\n", "scan", name, scanners[c].impl, "not here");
+				continue;
+			}
+			n = calibrate(scan_csn);
+			best = best_of_3(scan_csn, n, &total);
+			json_result("scan", name, scanners[c].impl, 1, n, best, total);
+			fprintf(out, ", \"bytes\": %zu, \"gb_per_sec\": %.2f }", size, (double) size * (double) n / best * 1e-9);
+			fprintf(stderr, "%-12s %-24s %-18s %10.1f ns\n", "scan", name, scanners[c].impl, best * 1e9 / (double) n);
+		}
+	}
+	cprintf_set_scanner(CPRINTF_SCANNER_AUTO);
+}
+
+typedef struct worker {
+	long (*run)(long n);
+	long n;
+	uint32_t* latencies; // ns per call, for the async latency (run is unused then)
+	thrd_t thread;
+} worker;
+
+static atomic_int workers_ready;
+static atomic_bool workers_go;
+
+static void wait_for_go(void) {
+	atomic_fetch_add(&workers_ready, 1);
+	while (!atomic_load(&workers_go))
+		thrd_yield();
+}
+
+static int scaling_worker(void* arg) {
+	worker* w = arg;
+	wait_for_go();
+	w->run(w->n);
+	return 0;
+}
+
+static int latency_worker(void* arg) {
+	worker* w = arg;
+	wait_for_go();
+	for (long i = 0; i < w->n; ++i) {
+		double start = now();
+		cprintf(COLOR_LOG, LOG_ARGS);
+		w->latencies[i] = (uint32_t) ((now() - start) * 1e9);
+	}
+	return 0;
+}
+
+/* Starts threads workers with fn, and returns how long it took from letting them go to the last one finishing
+* (and, with flush, everything they queued being written), or -1 if the threads couldn't be started.
+*/
+static double run_workers(worker* workers, int threads, thrd_start_t fn, bool flush) {
+	double elapsed;
+	int started = 0;
+
+	atomic_store(&workers_ready, 0);
+	atomic_store(&workers_go, false);
+	for (; started < threads; ++started) {
+		if (thrd_create(&workers[started].thread, fn, &workers[started]) != thrd_success)
+			break;
+	}
+	while (atomic_load(&workers_ready) < started)
+		thrd_yield();
+	elapsed = now();
+	atomic_store(&workers_go, true);
+	for (int t = 0; t < started; ++t)
+		thrd_join(workers[t].thread, NULL);
+	if (flush)
+		cprintf_flush();
+	return started == threads ? now() - elapsed : -1;
+}
+
+static bool set_mode(bench_mode mode) {
+	cprintf_set_atomic_writes(mode == MODE_ATOMIC);
+	return mode != MODE_ASYNC || cprintf_start_async(4096, CPRINTF_OVERFLOW_BLOCK) == 0;
+}
+
+static void end_mode(bench_mode mode) {
+	if (mode == MODE_ASYNC) {
+		cprintf_flush();
+		cprintf_stop_async();
+	}
+	cprintf_set_atomic_writes(false);
+}
+
+static void run_scaling(int max_threads) {
+	worker workers[MAX_THREADS];
+
+	for (size_t c = 0; c < sizeof(scaling_cases) / sizeof(scaling_cases[0]); ++c) {
+		const scaling_case* bench = &scaling_cases[c];
+		long n;
+
+		if (!wanted("scaling", "colored log line", bench->impl) || !set_mode(bench->mode))
+			continue;
+		n = calibrate(bench->run);
+		for (int threads = 1; threads <= max_threads; threads = threads < max_threads && threads * 2 > max_threads ? max_threads : threads * 2) {
+			double elapsed;
+
+			for (int t = 0; t < threads; ++t) {
+				workers[t].run = bench->run;
+				workers[t].n = n;
+			}
+			atomic_store(&torn_writes, 0);
+			atomic_store(&check_lines, bench->mode == MODE_ATOMIC);
+			elapsed = run_workers(workers, threads, scaling_worker, bench->mode == MODE_ASYNC);
+			atomic_store(&check_lines, false);
+			if (elapsed < 0)
+				break;
+			json_result("scaling", "colored log line", bench->impl, threads, n * threads, elapsed, 0);
+			fprintf(out, ", \"torn_writes\": %lu }", (unsigned long) atomic_load(&torn_writes));
+			fprintf(stderr, "%-12s %-24s %-18s %2d threads %10.0f calls/s\n", "scaling", "colored log line", bench->impl,
+				threads, (double) (n * threads) / elapsed);
+			if (threads == max_threads)
+				break;
+		}
+		end_mode(bench->mode);
+	}
+}
+
+static int compare_latency(const void* a, const void* b) {
+	uint32_t x = *(const uint32_t*) a;
+	uint32_t y = *(const uint32_t*) b;
+	return (x > y) - (x < y);
+}
+
+static void run_latency(int max_threads) {
+	worker workers[MAX_THREADS];
+	uint32_t* latencies;
+	bool first = true;
+
+	fprintf(out, "\n\t],\n\t\"async_latency\": [");
+	if (!wanted("async_latency", "colored log line", "cprintf_async")
+		|| !(latencies = malloc(sizeof(uint32_t) * LATENCY_CALLS * (size_t) max_threads)))
+		return;
+	for (int threads = 1; threads <= max_threads; threads = threads == 1 && max_threads > 1 ? max_threads : max_threads + 1) {
+		size_t count = (size_t) LATENCY_CALLS * (size_t) threads;
+
+		for (int t = 0; t < threads; ++t) {
+			workers[t].n = LATENCY_CALLS;
+			workers[t].latencies = latencies + (size_t) t * LATENCY_CALLS;
+		}
+		if (!set_mode(MODE_ASYNC))
+			break;
+		if (run_workers(workers, threads, latency_worker, false) < 0) {
+			end_mode(MODE_ASYNC);
+			break;
+		}
+		end_mode(MODE_ASYNC);
+		qsort(latencies, count, sizeof(uint32_t), compare_latency);
+		fprintf(out, "%s\n\t\t{ \"threads\": %d, \"calls\": %zu, \"slots\": 4096, \"p50_ns\": %lu, \"p99_ns\": %lu, "
+			"\"p999_ns\": %lu, \"max_ns\": %lu }", first ? "" : ",", threads, count, (unsigned long) latencies[count / 2],
+			(unsigned long) latencies[count * 99 / 100], (unsigned long) latencies[count * 999 / 1000],
+			(unsigned long) latencies[count - 1]);
+		fprintf(stderr, "%-12s %2d threads p50 %lu ns, p99 %lu ns, p999 %lu ns\n", "async", threads,
+			(unsigned long) latencies[count / 2], (unsigned long) latencies[count * 99 / 100],
+			(unsigned long) latencies[count * 999 / 1000]);
+		first = false;
+	}
+	free(latencies);
+}
+
+static int usage(const char* name) {
+	fprintf(stderr, "usage: %s [-o file.json] [-t max threads] [-m ms per measurement] [-f filter]\n", name);
+	return 1;
+}
+
+int main(int argc, char** argv) {
+	int max_threads = 4;
+
+	out = stdout;
+	for (int i = 1; i < argc; ++i) {
+		if (i + 1 >= argc || argv[i][0] != '-' || argv[i][2] != '\0')
+			return usage(argv[0]);
+		switch (argv[i++][1]) {
+		case 'o':
+			if (!(out = fopen(argv[i], "w"))) {
+				perror(argv[i]);
+				return 1;
+			}
+			break;
+		case 't':
+			max_threads = atoi(argv[i]);
+			break;
+		case 'm':
+			min_seconds = atof(argv[i]) / 1000.0;
+			break;
+		case 'f':
+			filter = argv[i];
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+	if (max_threads < 1 || max_threads > MAX_THREADS || min_seconds <= 0)
+		return usage(argv[0]);
+#if defined(_WIN32)
+	devnull = fopen("NUL", "w");
+#else
+	devnull = fopen("/dev/null", "w");
+#endif
+	if (!devnull) {
+		perror("null device");
+		return 1;
+	}
+
+	cprintf_set_backend(&null_backend);
+	cprintf_set_color_level(CPRINTF_COLOR_TRUECOLOR); // stdout doesn't matter here, the colors should be worked out
+
+	fprintf(out, "{\n\t\"benchmark\": \"cprintf_bench\",\n\t\"ms_per_measurement\": %.0f,\n\t\"max_threads\": %d,\n\t\"results\": [",
+		min_seconds * 1000.0, max_threads);
+	run_cases();
+	run_scan();
+	run_scaling(max_threads);
+	run_latency(max_threads);
+	fprintf(out, "\n\t]\n}\n");
+
+	cprintf_set_color_level(CPRINTF_COLOR_AUTO);
+	cprintf_set_backend(NULL);
+	fclose(devnull);
+	if (out != stdout)
+		fclose(out);
+	return 0;
+}
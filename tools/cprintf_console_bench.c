@@ -0,0 +1,145 @@
+/* Points the console backend at a mock console that just counts what it's asked to do, and compares how many
+* console calls a colorful log line costs with atomic writes off (every color change is its own call) and on
+* (the whole line reaches the backend at once and goes out as runs, or as cells when the mock can take them).
+* Runs anywhere, no Windows needed.
+* Build it with the library: cc -std=c11 -O2 tools/cprintf_console_bench.c cprintf.c cprintf_backend.c -I. -o cprintf_console_bench
+* (add -lpthread where threads.h needs it). Run it with how many lines to print (100000 by default) and, optionally,
+* what one console call costs in microseconds, to estimate how long the real console would take (20 by default).
+*/
+
+#include "cprintf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct mock_console {
+	unsigned short attr;
+	unsigned long set_calls;
+	unsigned long write_calls;
+	unsigned long cell_calls;
+	unsigned long info_calls;
+	unsigned long units;
+	int x; // where the cursor is, so get_info has something to say
+	int y;
+	bool trace; // print every call
+} mock_console;
+
+static int mock_set(void* ctx, unsigned short attr) {
+	mock_console* mock = ctx;
+	mock->attr = attr;
+	mock->set_calls++;
+	if (mock->trace)
+		printf("  SetConsoleTextAttribute(0x%04x)\n", attr);
+	return 0;
+}
+
+static int mock_get_info(void* ctx, cprintf_console_info* pInfo) {
+	mock_console* mock = ctx;
+	mock->info_calls++;
+	if (mock->trace)
+		printf("  GetConsoleScreenBufferInfo()\n");
+	pInfo->attr = mock->attr;
+	pInfo->x = mock->x;
+	pInfo->y = mock->y;
+	pInfo->width = 120;
+	return 0;
+}
+
+static int mock_write(void* ctx, const uint16_t* text, size_t len) {
+	mock_console* mock = ctx;
+	mock->write_calls++;
+	mock->units += len;
+	if (mock->trace) {
+		printf("  WriteConsoleW(\"");
+		for (size_t i = 0; i < len; ++i)
+			putchar(text[i] == '\n' ? '/' : text[i] < 0x80 ? (int) text[i] : '?');
+		printf("\")\n");
+	}
+	for (size_t i = 0; i < len; ++i) {
+		if (text[i] == '\n') {
+			mock->x = 0;
+			mock->y++;
+		} else {
+			mock->x++;
+		}
+	}
+	return 0;
+}
+
+static int mock_write_cells(void* ctx, const cprintf_console_cell* cells, size_t count, int x, int y) {
+	mock_console* mock = ctx;
+	mock->cell_calls++;
+	mock->units += count;
+	if (mock->trace) {
+		printf("  WriteConsoleOutputW(%d, %d, \"", x, y);
+		for (size_t i = 0; i < count; ++i)
+			putchar(cells[i].ch < 0x80 ? (int) cells[i].ch : '?');
+		printf("\")\n");
+	}
+	mock->x = x + (int) count; // the real one doesn't move the cursor, but the newline after it ends the line anyway
+	return 0;
+}
+
+static void print_lines(long lines) {
+	for (long i = 0; i < lines; ++i)
+		cprintf("%[1;30m12:00:%02ld%[0m [%[1;32m%-5s%[0m] worker %[36m%ld%[0m finished %[1m%d%[0m jobs in %[33m%.1f%[0m ms\n",
+			i % 60, "INFO", i % 8, (int) (i * 7 % 100), (double) (i % 1000) / 10.0);
+}
+
+static void run(const char* name, mock_console* mock, long lines, double call_us) {
+	clock_t elapsed;
+	unsigned long calls;
+
+	mock->set_calls = mock->write_calls = mock->cell_calls = mock->info_calls = mock->units = 0;
+	elapsed = clock();
+	print_lines(lines);
+	elapsed = clock() - elapsed;
+	calls = mock->set_calls + mock->write_calls + mock->cell_calls + mock->info_calls;
+	printf("%-14s %8.2f %8.2f %8.2f %8.2f %8.2f %10.2f %14.1f\n", name, (double) mock->set_calls / lines,
+		(double) mock->write_calls / lines, (double) mock->cell_calls / lines, (double) mock->info_calls / lines,
+		(double) mock->units / lines,
+		(double) elapsed * 1e9 / CLOCKS_PER_SEC / lines, (double) calls / lines * call_us);
+}
+
+int main(int argc, char** argv) {
+	long lines = argc > 1 ? atol(argv[1]) : 100000;
+	double call_us = argc > 2 ? atof(argv[2]) : 20.0;
+	mock_console mock = { FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE, 0, 0, 0, 0, 0, 0, 0, true };
+	cprintf_console console = { &mock, mock_set, mock_get_info, mock_write, NULL };
+	cprintf_backend backend;
+
+	if (lines <= 0)
+		return 1;
+	cprintf_console_backend(&console, &backend);
+	cprintf_set_backend(&backend);
+	cprintf_set_color_level(CPRINTF_COLOR_16);
+
+	printf("one line, atomic writes off:\n");
+	print_lines(1);
+	cprintf_set_atomic_writes(true);
+	printf("one line, atomic writes on, runs:\n");
+	print_lines(1);
+	console.write_cells = mock_write_cells;
+	cprintf_console_backend(&console, &backend);
+	cprintf_set_backend(&backend);
+	printf("one line, atomic writes on, cells:\n");
+	print_lines(1);
+	mock.trace = false;
+
+	printf("\n%-14s %8s %8s %8s %8s %8s %10s %14s\n", "per line", "set", "write", "cells", "info", "units", "ns (cpu)",
+		"console us");
+	cprintf_set_atomic_writes(true);
+	run("cells", &mock, lines, call_us);
+	console.write_cells = NULL;
+	cprintf_console_backend(&console, &backend);
+	cprintf_set_backend(&backend);
+	run("runs", &mock, lines, call_us);
+	cprintf_set_atomic_writes(false);
+	run("atomic off", &mock, lines, call_us);
+
+	cprintf_set_atomic_writes(false);
+	cprintf_set_color_level(CPRINTF_COLOR_AUTO);
+	cprintf_set_backend(NULL);
+	return 0;
+}
@@ -0,0 +1,70 @@
+/* Prints a file of cprintf_deferred records (or stdin if you don't give it one), colors and all.
+* Build it with the library: cc tools/cprintf_decode.c cprintf.c cprintf_backend.c -I. -o cprintf_decode
+*/
+
+#include "cprintf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <locale.h>
+
+int main(int argc, char** argv) {
+	FILE* file = stdin;
+	cprintf_decoder* decoder;
+	unsigned char* buf;
+	unsigned char* grown;
+	size_t capacity = 65536;
+	size_t len = 0;
+	size_t got;
+	ptrdiff_t used;
+	int res = 0;
+
+	if (argc > 2) {
+		fprintf(stderr, "usage: %s [file]\n", argv[0]);
+		return 2;
+	}
+	if (argc == 2 && !(file = fopen(argv[1], "rb"))) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	setlocale(LC_ALL, ""); // so %ls and %lc come out right
+	decoder = cprintf_decoder_new();
+	buf = malloc(capacity);
+	if (!decoder || !buf) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	while ((got = fread(buf + len, 1, capacity - len, file)) > 0) {
+		len += got;
+		used = cprintf_decode(decoder, buf, len);
+		if (used < 0) {
+			fprintf(stderr, "broken record\n");
+			res = 1;
+			break;
+		}
+		len -= (size_t) used;
+		memmove(buf, buf + used, len);
+		if (len == capacity) { // one record bigger than the whole buffer
+			grown = realloc(buf, capacity * 2);
+			if (!grown) {
+				fprintf(stderr, "out of memory\n");
+				res = 1;
+				break;
+			}
+			buf = grown;
+			capacity *= 2;
+		}
+	}
+	if (res == 0 && len > 0) {
+		fprintf(stderr, "%zu bytes left over at the end (a record got cut off)\n", len);
+		res = 1;
+	}
+
+	cprintf_decoder_free(decoder);
+	free(buf);
+	if (file != stdin)
+		fclose(file);
+	return res;
+}
@@ -0,0 +1,131 @@
+/* How many bytes a dashboard costs per frame: redrawing all of it with cprintf every time, against drawing it into
+* a cprintf_frame and presenting only what changed. The output goes to a backend that just counts it.
+* Build it with the library: cc -std=c11 -O2 tools/cprintf_frame_bench.c cprintf.c cprintf_backend.c -I. -o cprintf_frame_bench
+* (add -lpthread where threads.h needs it). Run it with how many frames to draw (1000 by default).
+*/
+
+#include "cprintf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define WIDTH 80
+#define QUEUES 8
+#define HEIGHT (QUEUES + 4)
+
+static size_t bytes_written = 0;
+
+static int count_write(void* ctx, const char* bytes, size_t len) {
+	(void) ctx;
+	(void) bytes;
+	bytes_written += len;
+	return 0;
+}
+static int count_set(void* ctx, cprintf_attr_t attrs) {
+	char buf[CPRINTF_ENCODE_MAX];
+	(void) ctx;
+	bytes_written += cprintf_encode_ansi(attrs, buf);
+	return 0;
+}
+static int count_get(void* ctx, cprintf_attr_t* pAttrs) {
+	(void) ctx;
+	*pAttrs = FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE;
+	return 0;
+}
+static size_t count_encode(void* ctx, cprintf_attr_t attrs, char* buf) {
+	(void) ctx;
+	return cprintf_encode_ansi(attrs, buf);
+}
+static const cprintf_backend counter = { NULL, count_write, count_set, count_get, count_encode, 0 };
+
+// what the dashboard shows, wandering a little every frame like real numbers would
+typedef struct dashboard {
+	int depth[QUEUES];
+	double rate[QUEUES];
+	long processed;
+	int progress; // out of 1000
+} dashboard;
+
+static void step(dashboard* d) {
+	for (int i = 0; i < QUEUES; ++i) {
+		if (rand() % 3 == 0)
+			d->depth[i] = abs(d->depth[i] + rand() % 21 - 10);
+		d->rate[i] += (rand() % 200 - 100) / 10.0;
+		if (d->rate[i] < 0)
+			d->rate[i] = 0;
+	}
+	d->processed += rand() % 500;
+	d->progress = (d->progress + 1) % 1001;
+}
+
+static const char bar[] = "########################################";
+
+// The whole dashboard, drawn by print(row, format, ...). Every line is padded to the full width.
+#define DRAW_DASHBOARD(d, print) do { \
+		print(0, "%[1;37m%-80s%[0m", " queues"); \
+		for (int i_ = 0; i_ < QUEUES; ++i_) \
+			print(1 + i_, " queue-%-2d %[36m%6d%[0m deep %[%sm%9.1f%[0m msg/s %[34m%-40.*s%[0m        ", i_, \
+				(d)->depth[i_], (d)->rate[i_] > 500 ? "1;31" : "32", (d)->rate[i_], (d)->depth[i_] / 25 % 41, bar); \
+		print(QUEUES + 1, " processed %-69ld", (d)->processed); \
+		print(QUEUES + 2, " [%[32m%-40.*s%[0m] %5.1f%%%-30s", (d)->progress * 40 / 1000, bar, (d)->progress / 10.0, ""); \
+		print(QUEUES + 3, "%-80s", ""); \
+	} while (0)
+
+static cprintf_frame* frame;
+
+// cprintf from the top every time: move up over the last frame and write every line again
+#define FULL_LINE(row, ...) do { cprintf(__VA_ARGS__); cprintf("\n"); } while (0)
+#define FRAME_LINE(row, ...) cprintf_frame_printf(frame, row, 0, __VA_ARGS__)
+
+int main(int argc, char** argv) {
+	long frames = argc > 1 ? atol(argv[1]) : 1000;
+	dashboard d = { { 0 }, { 0 }, 0, 0 };
+	size_t full_bytes = 0;
+	size_t frame_bytes = 0;
+	size_t first_bytes = 0;
+	clock_t full_time;
+	clock_t frame_time;
+
+	frame = cprintf_frame_new(WIDTH, HEIGHT);
+	if (!frame || frames < 2)
+		return 1;
+	cprintf_set_backend(&counter);
+	cprintf_set_atomic_writes(true);
+
+	srand(1);
+	full_time = clock();
+	for (long i = 0; i < frames; ++i) {
+		step(&d);
+		bytes_written = 0;
+		if (i > 0)
+			cprintf("\x1b[%dA", HEIGHT);
+		DRAW_DASHBOARD(&d, FULL_LINE);
+		full_bytes += bytes_written;
+	}
+	full_time = clock() - full_time;
+
+	srand(1);
+	d = (dashboard) { { 0 }, { 0 }, 0, 0 };
+	frame_time = clock();
+	for (long i = 0; i < frames; ++i) {
+		step(&d);
+		DRAW_DASHBOARD(&d, FRAME_LINE);
+		bytes_written = 0;
+		cprintf_frame_present(frame);
+		if (i == 0)
+			first_bytes = bytes_written;
+		else
+			frame_bytes += bytes_written;
+	}
+	frame_time = clock() - frame_time;
+
+	cprintf_set_backend(NULL);
+	cprintf_frame_free(frame);
+	printf("%dx%d dashboard, %ld frames\n", WIDTH, HEIGHT, frames);
+	printf("%-22s %12s %12s\n", "", "bytes/frame", "us/frame");
+	printf("%-22s %12.1f %12.2f\n", "cprintf, everything", (double) full_bytes / frames,
+		(double) full_time * 1e6 / CLOCKS_PER_SEC / frames);
+	printf("%-22s %12.1f %12.2f (the first one was %zu)\n", "frame, what changed", (double) frame_bytes / (frames - 1),
+		(double) frame_time * 1e6 / CLOCKS_PER_SEC / frames, first_bytes);
+	return 0;
+}
@@ -0,0 +1,539 @@
+/* Checks cwprintf and csnprintf against the C library's swprintf and snprintf, with random formats and arguments.
+* Each format gets 1-4 conversions of one argument type (any of d i u o x X c s f F e E g G a A p, with every
+* length that fits the type, %lc and %ls included), random flags, widths and precisions (or * and .* with the
+* width and precision as arguments), wide literal text and %%, sometimes a %n, and sometimes %2$d style numbered
+* arguments in a random order. Every case runs four ways and the outputs, return values and what %n stored
+* have to match:
+* - cwprintf (through a backend that keeps the UTF-8 it gets, with colors off) against swprintf, turned to UTF-8
+* - csnprintf against snprintf, into a buffer of a random size (so truncation gets checked too)
+* A type per format is what keeps the calls well defined: C can't build a va_list at run time, so the ... of
+* each call is picked out of a switch on the type and how many conversions there are.
+* Build it with the library: cc -std=c11 -O2 tools/cprintf_fuzz.c cprintf.c cprintf_backend.c -I. -o cprintf_fuzz
+* (add -lpthread where threads.h needs it), or use the cprintf_fuzz target in CMakeLists.txt. It needs a UTF-8
+* locale (C.UTF-8 or en_US.UTF-8) and glibc's printf to compare against, so it's meant for Linux.
+* Run it with how many cases (1000000 by default) and a seed (the time by default). It prints the first few
+* mismatches and exits with 1 if there were any.
+*/
+
+#include "cprintf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <locale.h>
+#include <time.h>
+#include <wchar.h>
+
+#define MAX_CONVERSIONS 4
+#define MAX_FORMAT 512
+#define MAX_OUTPUT 16384
+#define MAX_REPORTS 10
+
+// ======================
+// random numbers
+// ======================
+
+static uint64_t rng_state;
+
+// xorshift64*
+static uint64_t rnd(void) {
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static unsigned rnd_below(unsigned n) {
+	return (unsigned) (rnd() % n);
+}
+
+static bool chance(unsigned percent) {
+	return rnd_below(100) < percent;
+}
+
+// ======================
+// argument types
+// ======================
+
+typedef enum fuzz_type {
+	T_INT, T_UINT, T_CHAR, T_WINT, T_LONG, T_ULONG, T_LLONG, T_ULLONG, T_INTMAX, T_UINTMAX, T_SIZE, T_PTRDIFF,
+	T_DOUBLE, T_LDOUBLE, T_STR, T_WSTR, T_PTR, T_COUNT
+} fuzz_type;
+
+typedef struct type_info {
+	const char* name;
+	const char* lengths[3]; // the length modifiers that read this type (NULL after the last one)
+	const char* conversions;
+} type_info;
+
+static const type_info types[T_COUNT] = {
+	[T_INT] = { "int", { "", "hh", "h" }, "di" },
+	[T_UINT] = { "unsigned", { "", "hh", "h" }, "uoxX" },
+	[T_CHAR] = { "char", { "" }, "c" },
+	[T_WINT] = { "wint_t", { "l" }, "c" },
+	[T_LONG] = { "long", { "l" }, "di" },
+	[T_ULONG] = { "unsigned long", { "l" }, "uoxX" },
+	[T_LLONG] = { "long long", { "ll" }, "di" },
+	[T_ULLONG] = { "unsigned long long", { "ll" }, "uoxX" },
+	[T_INTMAX] = { "intmax_t", { "j" }, "di" },
+	[T_UINTMAX] = { "uintmax_t", { "j" }, "uoxX" },
+	[T_SIZE] = { "size_t", { "z" }, "uoxX" },
+	[T_PTRDIFF] = { "ptrdiff_t", { "t" }, "di" },
+	[T_DOUBLE] = { "double", { "", "l" }, "fFeEgGaA" },
+	[T_LDOUBLE] = { "long double", { "L" }, "fFeEgGaA" },
+	[T_STR] = { "char*", { "" }, "s" },
+	[T_WSTR] = { "wchar_t*", { "l" }, "s" },
+	[T_PTR] = { "void*", { "" }, "p" }
+};
+
+static const char* const strings[] = {
+	"", "a", "hello", "x y z", "wide \xc3\xa9t\xc3\xa9", "\xe4\xb8\xad\xe6\x96\x87", "\xf0\x9f\x98\x80 grin",
+	"a longer string, so that precisions and widths have something to cut and pad in the middle of it"
+};
+static const wchar_t* const wstrings[] = {
+	L"", L"w", L"plain", L"\x00fc" L"ber", L"\x263a smile", L"\x4e2d\x6587", L"\U0001F600 grin",
+	L"a longer wide string with \x00e9 and \x263a in it, to cut and pad"
+};
+static const wchar_t wchars[] = {
+	L'a', L'Z', L' ', L'$', L'*', L'.', L'\n', L'\x00e9', L'\x00fc', L'\x263a', L'\x4e2d', L'\U0001F600'
+};
+
+typedef union fuzz_value {
+	intmax_t i;
+	uintmax_t u;
+	double d;
+	long double ld;
+	const char* s;
+	const wchar_t* ws;
+	void* p;
+} fuzz_value;
+
+static intmax_t random_int(void) {
+	static const intmax_t edges[] = { 0, 1, -1, 127, -128, 255, 32767, -32768, 65535, INT_MAX, INT_MIN, UINT_MAX,
+		LLONG_MAX, LLONG_MIN };
+	uint64_t bits;
+
+	if (chance(20))
+		return edges[rnd_below(sizeof(edges) / sizeof(edges[0]))];
+	bits = rnd() >> rnd_below(64); // all sizes, not just huge ones
+	return chance(50) ? (intmax_t) bits : -(intmax_t) (bits >> 1);
+}
+
+static double random_double(void) {
+	static const double edges[] = { 0.0, -0.0, 1.0, -1.0, 0.5, 0.1, 1e-300, 1e300, 9.5, 0.05, 123456789.0, 1e15,
+		1e16, 5e-324 };
+	uint64_t bits;
+	double d;
+
+	switch (rnd_below(4)) {
+		case 0:
+			return edges[rnd_below(sizeof(edges) / sizeof(edges[0]))];
+		case 1: // anything at all, infinities and NaNs included
+			bits = rnd();
+			memcpy(&d, &bits, sizeof(d));
+			return d;
+		case 2: // the numbers people print
+			return (double) ((int64_t) rnd_below(2000001) - 1000000) / (double) (1 + rnd_below(1000));
+		default:
+			return (double) ((int64_t) (rnd() >> 11)) * (chance(50) ? 1e-10 : 1.0) * (chance(50) ? -1 : 1);
+	}
+}
+
+// ======================
+// formats
+// ======================
+
+typedef struct fuzz_case {
+	fuzz_type type;
+	unsigned count; // how many conversions
+	bool stars; // every conversion has *.* (and takes a width and precision first)
+	bool numbered; // every conversion says which argument it takes
+	bool count_chars; // there's a %n (which takes &n_value after everything else)
+	wchar_t wformat[MAX_FORMAT];
+	char format[MAX_FORMAT * 4]; // the same, in UTF-8
+	size_t wlen;
+	size_t len;
+	fuzz_value values[MAX_CONVERSIONS];
+	int widths[MAX_CONVERSIONS];
+	int precisions[MAX_CONVERSIONS];
+	size_t size; // what csnprintf and snprintf get to write into
+} fuzz_case;
+
+static void put_char(fuzz_case* c, wchar_t wc) {
+	uint32_t cp = (uint32_t) wc;
+	char* out = c->format + c->len;
+
+	c->wformat[c->wlen++] = wc;
+	if (cp < 0x80) {
+		out[0] = (char) cp;
+		c->len += 1;
+	}
+	else if (cp < 0x800) {
+		out[0] = (char) (0xC0 | (cp >> 6));
+		out[1] = (char) (0x80 | (cp & 0x3F));
+		c->len += 2;
+	}
+	else if (cp < 0x10000) {
+		out[0] = (char) (0xE0 | (cp >> 12));
+		out[1] = (char) (0x80 | ((cp >> 6) & 0x3F));
+		out[2] = (char) (0x80 | (cp & 0x3F));
+		c->len += 3;
+	}
+	else {
+		out[0] = (char) (0xF0 | (cp >> 18));
+		out[1] = (char) (0x80 | ((cp >> 12) & 0x3F));
+		out[2] = (char) (0x80 | ((cp >> 6) & 0x3F));
+		out[3] = (char) (0x80 | (cp & 0x3F));
+		c->len += 4;
+	}
+}
+
+static void put_ascii(fuzz_case* c, const char* text) {
+	while (*text)
+		put_char(c, (wchar_t) (unsigned char) *text++);
+}
+
+static void put_number(fuzz_case* c, unsigned n, const char* after) {
+	char digits[16];
+
+	snprintf(digits, sizeof(digits), "%u%s", n, after);
+	put_ascii(c, digits);
+}
+
+static void put_text(fuzz_case* c) {
+	unsigned n = rnd_below(4);
+
+	for (unsigned i = 0; i < n; ++i) {
+		if (chance(10))
+			put_ascii(c, "%%");
+		else
+			put_char(c, wchars[rnd_below(sizeof(wchars) / sizeof(wchars[0]))]);
+	}
+}
+
+// Writes conversion i, which takes argument number arg (when the case numbers them)
+static void put_conversion(fuzz_case* c, unsigned i, unsigned arg) {
+	const type_info* info = types + c->type;
+	char conversion = info->conversions[rnd_below((unsigned) strlen(info->conversions))];
+	const char* length;
+	const char* flags;
+	unsigned lengths = 0;
+	unsigned n;
+
+	while (lengths < 3 && info->lengths[lengths])
+		++lengths;
+	length = info->lengths[rnd_below(lengths)];
+
+	// only the flags that mean something for the conversion (the rest are undefined)
+	if (strchr("di", conversion))
+		flags = "-+ 0";
+	else if (conversion == 'u')
+		flags = "-0";
+	else if (strchr("oxX", conversion))
+		flags = "-#0";
+	else if (strchr("fFeEgGaA", conversion))
+		flags = "-+ #0";
+	else
+		flags = "-";
+
+	put_ascii(c, "%");
+	if (c->numbered)
+		put_number(c, c->stars ? arg + 2 : arg, "$");
+	n = chance(50) ? rnd_below(4) : 0;
+	for (unsigned f = 0; f < n; ++f)
+		put_char(c, (wchar_t) flags[rnd_below((unsigned) strlen(flags))]);
+
+	if (c->stars) {
+		put_ascii(c, "*");
+		if (c->numbered)
+			put_number(c, arg, "$");
+		put_ascii(c, ".*");
+		if (c->numbered)
+			put_number(c, arg + 1, "$");
+		// (glibc gets negative widths wrong when the arguments are numbered: it drops the flags, or pads with
+		// zeros on the right, so those only get checked in order)
+		c->widths[i] = !c->numbered && chance(20) ? -(int) rnd_below(30) : (int) rnd_below(30);
+		c->precisions[i] = chance(20) ? -1 - (int) rnd_below(3) : (int) rnd_below(30);
+	}
+	else {
+		if (chance(50))
+			put_number(c, 1 + rnd_below(60), "");
+		if (conversion != 'c' && conversion != 'p' && chance(50)) {
+			put_ascii(c, ".");
+			if (chance(80))
+				put_number(c, rnd_below(40), "");
+		}
+	}
+	put_ascii(c, length);
+	put_char(c, (wchar_t) conversion);
+}
+
+static void make_value(fuzz_case* c, unsigned i) {
+	fuzz_value* v = c->values + i;
+
+	switch (c->type) {
+		case T_CHAR:
+			v->i = ' ' + rnd_below(95);
+			break;
+		case T_WINT:
+			v->i = wchars[rnd_below(sizeof(wchars) / sizeof(wchars[0]))];
+			break;
+		case T_DOUBLE:
+			v->d = random_double();
+			break;
+		case T_LDOUBLE:
+			v->ld = (long double) random_double() * (chance(50) ? 1.0L : 1e-5L);
+			break;
+		case T_STR:
+			v->s = strings[rnd_below(sizeof(strings) / sizeof(strings[0]))];
+			break;
+		case T_WSTR:
+			v->ws = wstrings[rnd_below(sizeof(wstrings) / sizeof(wstrings[0]))];
+			break;
+		case T_PTR:
+			v->p = chance(10) ? NULL : (void*) (uintptr_t) rnd();
+			break;
+		default:
+			v->i = random_int();
+			break;
+	}
+}
+
+static void make_case(fuzz_case* c) {
+	unsigned order[MAX_CONVERSIONS];
+	unsigned per = 1;
+	unsigned count_at;
+
+	memset(c, 0, sizeof(*c));
+	c->type = (fuzz_type) rnd_below(T_COUNT);
+	c->count = 1 + rnd_below(MAX_CONVERSIONS);
+	c->stars = c->type != T_CHAR && c->type != T_WINT && c->type != T_PTR && chance(30); // no precision for those
+	c->numbered = chance(25);
+	c->count_chars = chance(20);
+	if (c->stars)
+		per = 3;
+
+	for (unsigned i = 0; i < c->count; ++i) {
+		order[i] = i;
+		make_value(c, i);
+	}
+	// numbered arguments can come in any order (but they all have to be used)
+	if (c->numbered) {
+		for (unsigned i = c->count - 1; i > 0; --i) {
+			unsigned j = rnd_below(i + 1);
+			unsigned t = order[i];
+			order[i] = order[j];
+			order[j] = t;
+		}
+	}
+	// and so can the %n when they're numbered, otherwise it comes last
+	count_at = c->numbered ? rnd_below(c->count + 1) : c->count;
+
+	put_text(c);
+	for (unsigned i = 0; i <= c->count; ++i) {
+		if (c->count_chars && i == count_at) {
+			put_ascii(c, "%");
+			if (c->numbered)
+				put_number(c, c->count * per + 1, "$");
+			put_ascii(c, "n");
+			put_text(c);
+		}
+		if (i == c->count)
+			break;
+		put_conversion(c, order[i], order[i] * per + 1);
+		put_text(c);
+	}
+	c->wformat[c->wlen] = L'\0';
+	c->format[c->len] = '\0';
+	c->size = chance(80) ? MAX_OUTPUT : rnd_below(64);
+}
+
+// ======================
+// running a case
+// ======================
+
+static char captured[MAX_OUTPUT * 4];
+static size_t captured_len;
+
+static int capture_write(void* ctx, const char* bytes, size_t len) {
+	(void) ctx;
+	if (len > sizeof(captured) - captured_len)
+		return -1;
+	memcpy(captured + captured_len, bytes, len);
+	captured_len += len;
+	return 0;
+}
+static int capture_set(void* ctx, cprintf_attr_t attrs) {
+	(void) ctx;
+	(void) attrs;
+	return 0;
+}
+static int capture_get(void* ctx, cprintf_attr_t* pAttrs) {
+	(void) ctx;
+	*pAttrs = FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE;
+	return 0;
+}
+static size_t capture_encode(void* ctx, cprintf_attr_t attrs, char* buf) {
+	(void) ctx;
+	return cprintf_encode_ansi(attrs, buf);
+}
+
+static int n_value;
+static unsigned long mismatches = 0;
+
+static void report(const fuzz_case* c, const char* what, const char* expected, int expected_res, int expected_n,
+	const char* got, int got_res, int got_n) {
+	if (++mismatches > MAX_REPORTS)
+		return;
+	printf("MISMATCH (%s) format \"%s\" with %u %s%s", what, c->format, c->count, types[c->type].name,
+		c->stars ? " (and *.*" : "");
+	if (c->stars) {
+		for (unsigned i = 0; i < c->count; ++i)
+			printf(" %d,%d", c->widths[i], c->precisions[i]);
+		printf(")");
+	}
+	printf(", size %zu\n  expected %d n=%d \"%s\"\n  got      %d n=%d \"%s\"\n", c->size, expected_res, expected_n,
+		expected, got_res, got_n, got);
+}
+
+// Runs the case four ways with the arguments in the ...
+static void compare(const fuzz_case* c, ...) {
+	static wchar_t wexpected[MAX_OUTPUT];
+	static char expected[MAX_OUTPUT * 4];
+	static char got[MAX_OUTPUT + 1];
+	va_list args;
+	va_list copy;
+	mbstate_t state;
+	size_t len = 0;
+	int expected_res, expected_n;
+	int got_res, got_n;
+
+	// cwprintf against swprintf
+	va_start(args, c);
+	va_copy(copy, args);
+	n_value = -1;
+	expected_res = vswprintf(wexpected, MAX_OUTPUT, c->wformat, copy);
+	expected_n = n_value;
+	va_end(copy);
+	if (expected_res >= 0) { // (it gives up on anything it can't encode, so there's nothing to compare to)
+		memset(&state, 0, sizeof(state));
+		for (int i = 0; i < expected_res; ++i)
+			len += wcrtomb(expected + len, wexpected[i], &state);
+		expected[len] = '\0';
+
+		va_copy(copy, args);
+		n_value = -1;
+		captured_len = 0;
+		got_res = cvwprintf(c->wformat, copy);
+		got_n = n_value;
+		va_end(copy);
+		captured[captured_len] = '\0';
+		if (got_res != expected_res || got_n != expected_n || captured_len != len || memcmp(captured, expected, len))
+			report(c, "cwprintf", expected, expected_res, expected_n, captured, got_res, got_n);
+	}
+
+	// csnprintf against snprintf
+	va_copy(copy, args);
+	n_value = -1;
+	memset(expected, '#', c->size + 1);
+	expected_res = vsnprintf(expected, c->size, c->format, copy);
+	expected_n = n_value;
+	va_end(copy);
+	if (expected_res >= 0) {
+		va_copy(copy, args);
+		n_value = -1;
+		memset(got, '#', c->size + 1);
+		got_res = cvsnprintf(got, c->size, c->format, copy);
+		got_n = n_value;
+		va_end(copy);
+		expected[c->size] = got[c->size] = '\0'; // (so they print, the rest past what was written is still #s)
+		if (got_res != expected_res || got_n != expected_n || memcmp(got, expected, c->size))
+			report(c, "csnprintf", expected, expected_res, expected_n, got, got_res, got_n);
+	}
+	va_end(args);
+}
+
+// the ... for each number of conversions, with *.* and without
+#define PLAIN_1 v[0]
+#define PLAIN_2 PLAIN_1, v[1]
+#define PLAIN_3 PLAIN_2, v[2]
+#define PLAIN_4 PLAIN_3, v[3]
+#define STARS_1 c->widths[0], c->precisions[0], v[0]
+#define STARS_2 STARS_1, c->widths[1], c->precisions[1], v[1]
+#define STARS_3 STARS_2, c->widths[2], c->precisions[2], v[2]
+#define STARS_4 STARS_3, c->widths[3], c->precisions[3], v[3]
+
+// Makes run_<name>, which passes the case's values as type (the %n's pointer always comes after them)
+#define FUZZ_TYPE(name, type, field) \
+	static void run_##name(const fuzz_case* c) { \
+		type v[MAX_CONVERSIONS]; \
+		for (unsigned i = 0; i < MAX_CONVERSIONS; ++i) \
+			v[i] = (type) c->values[i].field; \
+		switch (c->count * 2 + c->stars) { \
+			case 2: compare(c, PLAIN_1, &n_value); break; \
+			case 3: compare(c, STARS_1, &n_value); break; \
+			case 4: compare(c, PLAIN_2, &n_value); break; \
+			case 5: compare(c, STARS_2, &n_value); break; \
+			case 6: compare(c, PLAIN_3, &n_value); break; \
+			case 7: compare(c, STARS_3, &n_value); break; \
+			case 8: compare(c, PLAIN_4, &n_value); break; \
+			case 9: compare(c, STARS_4, &n_value); break; \
+			default: break; \
+		} \
+	}
+
+FUZZ_TYPE(int, int, i)
+FUZZ_TYPE(uint, unsigned int, u)
+FUZZ_TYPE(wint, wint_t, u)
+FUZZ_TYPE(long, long, i)
+FUZZ_TYPE(ulong, unsigned long, u)
+FUZZ_TYPE(llong, long long, i)
+FUZZ_TYPE(ullong, unsigned long long, u)
+FUZZ_TYPE(intmax, intmax_t, i)
+FUZZ_TYPE(uintmax, uintmax_t, u)
+FUZZ_TYPE(size, size_t, u)
+FUZZ_TYPE(ptrdiff, ptrdiff_t, i)
+FUZZ_TYPE(double, double, d)
+FUZZ_TYPE(ldouble, long double, ld)
+FUZZ_TYPE(str, const char*, s)
+FUZZ_TYPE(wstr, const wchar_t*, ws)
+FUZZ_TYPE(ptr, void*, p)
+
+static void (*const runs[T_COUNT])(const fuzz_case*) = {
+	[T_INT] = run_int, [T_UINT] = run_uint, [T_CHAR] = run_int, [T_WINT] = run_wint, [T_LONG] = run_long,
+	[T_ULONG] = run_ulong, [T_LLONG] = run_llong, [T_ULLONG] = run_ullong, [T_INTMAX] = run_intmax,
+	[T_UINTMAX] = run_uintmax, [T_SIZE] = run_size, [T_PTRDIFF] = run_ptrdiff, [T_DOUBLE] = run_double,
+	[T_LDOUBLE] = run_ldouble, [T_STR] = run_str, [T_WSTR] = run_wstr, [T_PTR] = run_ptr
+};
+
+int main(int argc, char** argv) {
+	cprintf_backend backend = { NULL, capture_write, capture_set, capture_get, capture_encode, 0 };
+	static fuzz_case c;
+	long cases = argc > 1 ? atol(argv[1]) : 1000000;
+	uint64_t seed = argc > 2 ? strtoull(argv[2], NULL, 0) : (uint64_t) time(NULL);
+
+	if (cases <= 0 || argc > 3) {
+		fprintf(stderr, "usage: %s [cases] [seed]\n", argv[0]);
+		return 2;
+	}
+	if (!setlocale(LC_ALL, "C.UTF-8") && !setlocale(LC_ALL, "en_US.UTF-8")) {
+		fprintf(stderr, "no UTF-8 locale to compare with\n");
+		return 2;
+	}
+	rng_state = seed ? seed : 1;
+	cprintf_set_backend(&backend);
+	cprintf_set_color_level(CPRINTF_COLOR_NONE);
+
+	for (long i = 0; i < cases; ++i) {
+		make_case(&c);
+		runs[c.type](&c);
+	}
+
+	cprintf_set_color_level(CPRINTF_COLOR_AUTO);
+	cprintf_set_backend(NULL);
+	printf("%ld cases (seed %llu): %lu mismatches\n", cases, (unsigned long long) seed, mismatches);
+	return mismatches ? 1 : 0;
+}